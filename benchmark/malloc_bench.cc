@@ -28,8 +28,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "run_benchmark.h"
 
@@ -87,6 +89,8 @@ static void bench_fastpath_simple(long iterations,
 
 extern "C" void tc_free_sized(void *ptr, size_t size) __attribute__((weak));
 extern "C" void *tc_memalign(size_t align, size_t size) __attribute__((weak));
+extern "C" size_t tc_malloc_batch(size_t size, size_t n, void **out) __attribute__((weak));
+extern "C" void tc_free_batch(void **ptrs, size_t n) __attribute__((weak));
 
 static bool is_sized_free_available(void)
 {
@@ -98,6 +102,11 @@ static bool is_memalign_available(void)
   return tc_memalign != NULL;
 }
 
+static bool is_batch_available(void)
+{
+  return tc_malloc_batch != NULL && tc_free_batch != NULL;
+}
+
 static void bench_fastpath_simple_sized(long iterations,
                                         uintptr_t param)
 {
@@ -136,6 +145,29 @@ static void bench_fastpath_memalign(long iterations,
 
 #define STACKSZ (1 << 16)
 
+#ifdef HAVE_SIZED_FREE_OPTION
+
+// Same work as bench_fastpath_stack_simple, in batches of 'param'
+// objects.
+static void bench_batch(long iterations,
+                        uintptr_t _param)
+{
+
+  void *stack[STACKSZ];
+  size_t sz = 128;
+  long param = static_cast<long>(_param);
+  param &= STACKSZ - 1;
+  param = param ? param : 1;
+  for (; iterations>0; iterations -= param) {
+    if (tc_malloc_batch(sz, param, stack) != static_cast<size_t>(param)) {
+      abort();
+    }
+    tc_free_batch(stack, param);
+  }
+}
+
+#endif
+
 static void bench_fastpath_stack(long iterations,
                                  uintptr_t _param)
 {
@@ -222,6 +254,123 @@ static void bench_fastpath_rnd_dependent(long iterations,
   }
 }
 
+#define CONTENTION_OBJS 4096
+
+static void *contention_thread(void *arg)
+{
+  long iterations = *static_cast<long *>(arg);
+  void *ptrs[CONTENTION_OBJS];
+  size_t sz = 16;
+
+  // working set of mixed small sizes is large enough that thread
+  // caches keep spilling to and refilling from central free lists
+  for (; iterations > 0; iterations -= CONTENTION_OBJS) {
+    for (int k = 0; k < CONTENTION_OBJS; k++) {
+      void *p = malloc(sz);
+      if (!p) {
+        abort();
+      }
+      ptrs[k] = p;
+      sz = ((sz * 8191) & 511) + 16;
+    }
+    for (int k = CONTENTION_OBJS - 1; k >= 0; k--) {
+      free(ptrs[k]);
+    }
+  }
+  return NULL;
+}
+
+// param is number of threads. Reported time is wall time per
+// malloc/free pair across all threads, so perfect scaling shows up
+// as time going down linearly with thread count (up to core count).
+static void bench_contention(long iterations,
+                             uintptr_t param)
+{
+  int nthreads = static_cast<int>(param);
+  long per_thread = iterations / nthreads;
+  std::vector<pthread_t> threads(nthreads);
+
+  for (int i = 0; i < nthreads; i++) {
+    int rv = pthread_create(&threads[i], NULL, contention_thread,
+                            &per_thread);
+    if (rv) {
+      perror("pthread_create");
+      abort();
+    }
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+#define FREE_RANDOM_MAX_OBJS (1 << 18)
+
+static void *free_random_buffer[FREE_RANDOM_MAX_OBJS];
+
+// Allocates 'param' objects and frees them in random order.  With a
+// large enough working set the thread cache and transfer cache spill
+// over, so this mostly measures how fast the central free list puts
+// scattered objects back into their spans.
+static void bench_free_random(long iterations,
+                              uintptr_t _param)
+{
+  static const uint32_t rnd_c = 1013904223;
+  static const uint32_t rnd_a = 1664525;
+
+  size_t sz = 64;
+  if (_param > FREE_RANDOM_MAX_OBJS) {
+    abort();
+  }
+  int param = static_cast<int>(_param);
+  uint32_t rnd = 0;
+
+  for (; iterations>0; iterations -= param) {
+    for (int k = 0; k < param; k++) {
+      void *p = malloc(sz);
+      if (!p) {
+        abort();
+      }
+      free_random_buffer[k] = p;
+    }
+    for (int k = param - 1; k > 0; k--) {
+      rnd = rnd * rnd_a + rnd_c;
+      std::swap(free_random_buffer[k], free_random_buffer[(rnd >> 8) % (k + 1)]);
+    }
+    for (int k = 0; k < param; k++) {
+      free(free_random_buffer[k]);
+    }
+  }
+}
+
+#define REALLOC_GROW_MAX_BYTES (32 << 20)
+
+// Grows a block from 256 KiB to 32 MiB, param bytes per realloc,
+// writing to each new page.
+static void bench_realloc_grow(long iterations,
+                               uintptr_t param)
+{
+  char *p = NULL;
+  size_t sz = 0;
+
+  for (; iterations>0; iterations--) {
+    if (sz + param > REALLOC_GROW_MAX_BYTES) {
+      free(p);
+      p = NULL;
+      sz = 0;
+    }
+    size_t new_sz = (sz == 0 ? (256 << 10) : sz + param);
+    p = static_cast<char *>(realloc(p, new_sz));
+    if (!p) {
+      abort();
+    }
+    for (size_t i = sz; i < new_sz; i += 4096) {
+      p[i] = 1;
+    }
+    sz = new_sz;
+  }
+  free(p);
+}
+
 static void *randomize_buffer[13<<20];
 
 
@@ -289,5 +438,23 @@ int main(void)
   report_benchmark("bench_fastpath_stack_simple", bench_fastpath_stack_simple, 8192);
   report_benchmark("bench_fastpath_rnd_dependent", bench_fastpath_rnd_dependent, 32);
   report_benchmark("bench_fastpath_rnd_dependent", bench_fastpath_rnd_dependent, 8192);
+  report_benchmark("bench_free_random", bench_free_random, 1 << 14);
+  report_benchmark("bench_free_random", bench_free_random, 1 << 18);
+  report_benchmark("bench_realloc_grow", bench_realloc_grow, 4 << 10);
+  report_benchmark("bench_realloc_grow", bench_realloc_grow, 64 << 10);
+  report_benchmark("bench_realloc_grow", bench_realloc_grow, 1 << 20);
+
+#ifdef HAVE_SIZED_FREE_OPTION
+  if (is_batch_available()) {
+    report_benchmark("bench_fastpath_stack_simple", bench_fastpath_stack_simple, 16);
+    report_benchmark("bench_batch", bench_batch, 16);
+    report_benchmark("bench_fastpath_stack_simple", bench_fastpath_stack_simple, 256);
+    report_benchmark("bench_batch", bench_batch, 256);
+  }
+#endif
+
+  for (int i = 1; i <= 64; i <<= 1) {
+    report_benchmark("bench_contention", bench_contention, i);
+  }
   return 0;
 }
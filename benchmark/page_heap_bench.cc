@@ -0,0 +1,156 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Benchmarks PageHeap::New and PageHeap::Delete directly, without the
+// caches in front of them.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "page_heap.h"
+#include "span.h"
+
+#include "run_benchmark.h"
+
+// One heap is shared by all runs, so that its memory is reused rather
+// than grown again for every run.  It has no lock, and never releases
+// memory by itself.
+static tcmalloc::PageHeap* heap;
+
+static unsigned rnd_state = 1;
+
+static unsigned next_rnd(void) {
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return rnd_state >> 16;
+}
+
+// Allocates and frees spans of 'param' pages on an otherwise idle heap.
+static void bench_new_delete(long iterations, uintptr_t param)
+{
+  const Length n = static_cast<Length>(param);
+  for (; iterations > 0; iterations--) {
+    tcmalloc::Span* s = heap->New(n);
+    if (!s) {
+      abort();
+    }
+    heap->Delete(s);
+  }
+}
+
+// Allocates single pages when the only free span that fits has 'param'
+// pages, so the search has to skip all the empty smaller lists.
+static void bench_sparse_lists(long iterations, uintptr_t param)
+{
+  tcmalloc::Span* free_span = heap->New(static_cast<Length>(param));
+  tcmalloc::Span* guard = heap->New(1);
+  heap->Delete(free_span);
+
+  for (; iterations > 0; iterations--) {
+    tcmalloc::Span* s = heap->New(1);
+    if (!s) {
+      abort();
+    }
+    heap->Delete(s);
+  }
+
+  heap->Delete(guard);
+}
+
+// Keeps 'param' spans of random small lengths alive, replacing a random
+// one on every iteration, which fragments the free lists.
+static void bench_fragmented(long iterations, uintptr_t param)
+{
+  const size_t count = static_cast<size_t>(param);
+  tcmalloc::Span** spans = new tcmalloc::Span*[count];
+  for (size_t i = 0; i < count; i++) {
+    spans[i] = heap->New(1 + next_rnd() % kMaxPages);
+  }
+
+  for (; iterations > 0; iterations--) {
+    const size_t i = next_rnd() % count;
+    heap->Delete(spans[i]);
+    spans[i] = heap->New(1 + next_rnd() % kMaxPages);
+    if (!spans[i]) {
+      abort();
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    heap->Delete(spans[i]);
+  }
+  delete[] spans;
+}
+
+// Keeps 'param' free spans longer than kMaxPages, separated by spans
+// in use, and allocates and frees random large lengths among them.  This
+// is what the large span sets look like on big, fragmented heaps.
+static void bench_large_fragmented(long iterations, uintptr_t param)
+{
+  const size_t count = static_cast<size_t>(param);
+  tcmalloc::Span** spans = new tcmalloc::Span*[2 * count];
+  for (size_t i = 0; i < 2 * count; i += 2) {
+    spans[i] = heap->New(kMaxPages + 1 + next_rnd() % 1024);
+    spans[i + 1] = heap->New(1);
+  }
+  for (size_t i = 0; i < 2 * count; i += 2) {
+    heap->Delete(spans[i]);
+  }
+
+  for (; iterations > 0; iterations--) {
+    tcmalloc::Span* s = heap->New(kMaxPages + 1 + next_rnd() % 1024);
+    if (!s) {
+      abort();
+    }
+    heap->Delete(s);
+  }
+
+  for (size_t i = 1; i < 2 * count; i += 2) {
+    heap->Delete(spans[i]);
+  }
+  delete[] spans;
+}
+
+int main(void)
+{
+  heap = new tcmalloc::PageHeap();
+  heap->SetBackgroundRelease(true);
+
+  report_benchmark("bench_new_delete", bench_new_delete, 1);
+  report_benchmark("bench_new_delete", bench_new_delete, kMaxPages);
+  report_benchmark("bench_sparse_lists", bench_sparse_lists, kMaxPages / 2);
+  report_benchmark("bench_sparse_lists", bench_sparse_lists, kMaxPages);
+  report_benchmark("bench_fragmented", bench_fragmented, 64);
+  report_benchmark("bench_fragmented", bench_fragmented, 1024);
+  report_benchmark("bench_large_fragmented", bench_large_fragmented, 1024);
+  report_benchmark("bench_large_fragmented", bench_large_fragmented, 16384);
+
+  return 0;
+}
@@ -33,23 +33,86 @@
 
 #include "config.h"
 #include <algorithm>
+#include <string.h>                     // for memset
 #include "central_freelist.h"
 #include "internal_logging.h"  // for ASSERT, MESSAGE
 #include "linked_list.h"       // for SLL_Next, SLL_Push, etc
 #include "page_heap.h"         // for PageHeap
+#include "page_heap_allocator.h"  // for PageHeapAllocator
 #include "static_vars.h"       // for Static
+#include "system-alloc.h"      // for TCMalloc_SystemRelease, etc
 
 using std::min;
 using std::max;
 
 namespace tcmalloc {
 
-void CentralFreeList::Init(size_t cl) {
+bool CentralFreeList::span_bitmaps_ = false;
+
+// Span bitmaps come and go with their spans, under the page heap lock.
+static PageHeapAllocator<SpanBitmap> bitmap_allocator;
+static bool bitmap_allocator_initialized = false;
+
+static inline bool TestBit(const uint64* bitmap, size_t i) {
+  return (bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void SetBit(uint64* bitmap, size_t i) {
+  bitmap[i / 64] |= uint64(1) << (i % 64);
+}
+
+static inline void ClearBit(uint64* bitmap, size_t i) {
+  bitmap[i / 64] &= ~(uint64(1) << (i % 64));
+}
+
+static inline int LowestBit(uint64 bits) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  int bit = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+// Returns true if bits 'first' to 'last', inclusive, are all set.
+static bool AllBitsSet(const uint64* bitmap, size_t first, size_t last) {
+  for (size_t word = first / 64; word <= last / 64; word++) {
+    uint64 mask = ~uint64(0);
+    if (word == first / 64) mask &= ~uint64(0) << (first % 64);
+    if (word == last / 64 && last % 64 != 63) {
+      mask &= (uint64(1) << (last % 64 + 1)) - 1;
+    }
+    if ((bitmap[word] & mask) != mask) return false;
+  }
+  return true;
+}
+
+void CentralFreeList::Init(size_t cl, int shard, int node) {
+  ASSERT(0 <= shard && shard < kMaxShards);
+  ASSERT(0 <= node && node < kMaxNumaNodes);
   size_class_ = cl;
+  shard_ = shard;
+  node_ = node;
   tcmalloc::DLL_Init(&empty_);
-  tcmalloc::DLL_Init(&nonempty_);
+  for (int i = 0; i < kOccupancyBuckets; ++i) {
+    tcmalloc::DLL_Init(&nonempty_[i]);
+    num_nonempty_[i] = 0;
+  }
   num_spans_ = 0;
   counter_ = 0;
+  released_bytes_ = 0;
+  objects_per_span_ = 1;
+  if (cl > 0) {
+    objects_per_span_ =
+        (Static::sizemap()->class_to_pages(cl) << kPageShift) /
+        Static::sizemap()->ByteSizeForClass(cl);
+  }
+  bitmaps_ = (cl > 0 && span_bitmaps_ &&
+              objects_per_span_ <= SpanBitmap::kMaxObjects);
 
   max_cache_size_ = kMaxNumTransferEntries;
 #ifdef TCMALLOC_SMALL_BUT_SLOW
@@ -75,82 +138,217 @@ void CentralFreeList::Init(size_t cl) {
                           (max)(1, (1024 * 1024) / (bytes * objs_to_move)));
     cache_size_ = (min)(cache_size_, max_cache_size_);
   }
+  for (int i = 0; i < kMaxNumTransferEntries; ++i) {
+    tc_slots_[i].sequence = i;
+  }
+  tc_enqueue_pos_ = 0;
+  tc_dequeue_pos_ = 0;
   used_slots_ = 0;
   ASSERT(cache_size_ <= max_cache_size_);
 }
 
-void CentralFreeList::ReleaseListToSpans(void* start) {
-  while (start) {
-    void *next = SLL_Next(start);
-    ReleaseToSpans(start);
-    start = next;
-  }
-}
-
-// MapObjectToSpan should logically be part of ReleaseToSpans.  But
-// this triggers an optimization bug in gcc 4.5.0.  Moving to a
-// separate function, and making sure that function isn't inlined,
-// seems to fix the problem.  It also should be fixed for gcc 4.5.1.
-static
-#if __GNUC__ == 4 && __GNUC_MINOR__ == 5 && __GNUC_PATCHLEVEL__ == 0
-__attribute__ ((noinline))
-#endif
-Span* MapObjectToSpan(void* object) {
-  const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
-  Span* span = Static::pageheap()->GetDescriptor(p);
-  return span;
-}
-
-void CentralFreeList::ReleaseToSpans(void* object) {
-  Span* span = MapObjectToSpan(object);
+void CentralFreeList::ReleaseToSpan(Span* span, void* head, void* tail,
+                                    int n) {
   ASSERT(span != NULL);
-  ASSERT(span->refcount > 0);
+  ASSERT(span->refcount >= n);
 
-  // If span is empty, move it to non-empty list
-  if (span->objects == NULL) {
-    tcmalloc::DLL_Remove(span);
-    tcmalloc::DLL_Prepend(&nonempty_, span);
-    Event(span, 'N', 0);
-  }
+  const bool was_full = !HasFreeObjects(span);
 
   // The following check is expensive, so it is disabled by default
   if (false) {
-    // Check that object does not occur in list
+    // Check that no object occurs in list
     int got = 0;
-    for (void* p = span->objects; p != NULL; p = *((void**) p)) {
-      ASSERT(p != object);
-      got++;
+    if (bitmaps_) {
+      got = span->bitmap->free_count;
+    } else {
+      for (void* p = span->objects; p != NULL; p = *((void**) p)) {
+        for (void* q = head; q != NULL; q = SLL_Next(q)) ASSERT(p != q);
+        got++;
+      }
+    }
+    const size_t size = Static::sizemap()->ByteSizeForClass(span->sizeclass);
+    if (span->untouched != NULL) {
+      for (void* q = head; q != NULL; q = SLL_Next(q)) {
+        ASSERT(q < span->untouched);
+      }
+      got += (((span->start + span->length) << kPageShift) -
+              reinterpret_cast<uintptr_t>(span->untouched)) / size;
+    }
+    ASSERT(got + span->refcount == (span->length<<kPageShift) / size);
+  }
+
+  // The objects of a span that becomes unused need not be marked free.
+  if (span->refcount > n) {
+    if (bitmaps_) {
+      const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+      const uintptr_t base = span->start << kPageShift;
+      for (void* q = head; q != NULL; q = SLL_Next(q)) {
+        const size_t index = (reinterpret_cast<uintptr_t>(q) - base) / size;
+        ASSERT(!TestBit(span->bitmap->free, index));
+        SetBit(span->bitmap->free, index);
+      }
+      span->bitmap->free_count += n;
+    } else {
+      SLL_PushRange(&span->objects, head, tail);
     }
-    ASSERT(got + span->refcount ==
-           (span->length<<kPageShift) /
-           Static::sizemap()->ByteSizeForClass(span->sizeclass));
   }
+  ObjectsReturnedToSpan(span, n, was_full);
+}
 
-  counter_++;
-  span->refcount--;
+void CentralFreeList::ObjectsReturnedToSpan(Span* span, int n,
+                                            bool was_full) {
+  // If span is empty, move it to non-empty list
+  if (was_full) {
+    tcmalloc::DLL_Remove(span);
+    Event(span, 'N', 0);
+  }
+
+  counter_ += n;
+  const int old_refcount = span->refcount;
+  span->refcount -= n;
   if (span->refcount == 0) {
     Event(span, '#', 0);
     counter_ -= ((span->length<<kPageShift) /
                  Static::sizemap()->ByteSizeForClass(span->sizeclass));
-    tcmalloc::DLL_Remove(span);
+    if (!was_full) {
+      RemoveFromNonempty(span, old_refcount);
+    }
     --num_spans_;
 
+    // The page heap expects the pages of its spans to be usable.
+    SpanBitmap* bitmap = NULL;
+    if (bitmaps_) {
+      bitmap = span->bitmap;
+      span->objects = NULL;
+      for (Length i = 0; bitmap->released_count != 0; i++) {
+        if (TestBit(bitmap->released, i)) {
+          TCMalloc_SystemCommit(
+              reinterpret_cast<void*>((span->start + i) << kPageShift),
+              kPageSize);
+          ClearBit(bitmap->released, i);
+          bitmap->released_count--;
+          released_bytes_ -= kPageSize;
+        }
+      }
+    }
+
     // Release central list lock while operating on pageheap
     lock_.Unlock();
     {
       SpinLockHolder h(Static::pageheap_lock());
+      if (bitmap != NULL) {
+        bitmap_allocator.Delete(bitmap);
+      }
       Static::pageheap()->Delete(span);
     }
     lock_.Lock();
-  } else {
-    *(reinterpret_cast<void**>(object)) = span->objects;
-    span->objects = object;
+    return;
+  }
+
+  // The span may have moved down an occupancy bucket.
+  if (was_full) {
+    AddToNonempty(span);
+  } else if (OccupancyBucket(old_refcount) !=
+             OccupancyBucket(span->refcount)) {
+    RemoveFromNonempty(span, old_refcount);
+    AddToNonempty(span);
+  }
+}
+
+void CentralFreeList::AddToNonempty(Span* span) {
+  const int bucket = OccupancyBucket(span->refcount);
+  tcmalloc::DLL_Prepend(&nonempty_[bucket], span);
+  num_nonempty_[bucket]++;
+}
+
+void CentralFreeList::RemoveFromNonempty(Span* span, int refcount) {
+  tcmalloc::DLL_Remove(span);
+  num_nonempty_[OccupancyBucket(refcount)]--;
+}
+
+void CentralFreeList::GetSpanOccupancy(SpanOccupancy* occupancy) {
+  SpinLockHolder h(&lock_);
+  size_t partial = 0;
+  for (int i = 0; i < kOccupancyBuckets; ++i) {
+    occupancy->partial[i] += num_nonempty_[i];
+    partial += num_nonempty_[i];
+  }
+  occupancy->full += num_spans_ - partial;
+}
+
+void CentralFreeList::ReleaseListToSpans(void* start) {
+  // Objects travel between shards of a size class through the transfer
+  // caches, but a span is only ever linked into the lists of the shard
+  // that populated it.  Objects of other shards are collected per shard
+  // and handed straight to their owners once we're done with ours.
+  const bool sharded = Static::num_central_shards(size_class_) > 1;
+  void* foreign[kMaxShards];
+  bool have_foreign = false;
+  if (sharded) memset(foreign, 0, sizeof(foreign));
+  // The list is taken in chunks whose objects are grouped by page
+  // through a small open-addressed table.  Each page's span is then
+  // looked up and updated once per chunk rather than once per object.
+  // Sorting the chunk would give the same groups, but costs more than
+  // it saves when the objects are scattered over many spans.
+  struct PageGroup {
+    PageID page;
+    void* head;
+    void* tail;
+    int n;
+  };
+  static const int kSlots = 2 * kMaxReleaseBatch;
+  PageGroup groups[kMaxReleaseBatch];
+  unsigned char slots[kSlots];
+  while (start) {
+    memset(slots, 0, sizeof(slots));
+    int num_groups = 0;
+    for (int n = 0; start != NULL && n < kMaxReleaseBatch; n++) {
+      void* object = start;
+      start = SLL_Next(start);
+      const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
+      int h = p & (kSlots - 1);
+      while (slots[h] != 0 && groups[slots[h] - 1].page != p) {
+        h = (h + 1) & (kSlots - 1);
+      }
+      if (slots[h] == 0) {
+        PageGroup* g = &groups[num_groups++];
+        g->page = p;
+        g->head = NULL;
+        g->tail = object;
+        g->n = 0;
+        slots[h] = num_groups;
+      }
+      PageGroup* g = &groups[slots[h] - 1];
+      SLL_Push(&g->head, object);
+      g->n++;
+    }
+    for (int i = 0; i < num_groups; i++) {
+      const PageGroup& g = groups[i];
+      Span* span = Static::pageheap()->GetDescriptor(g.page);
+      if (sharded && span->central_shard != shard_) {
+        SLL_PushRange(&foreign[span->central_shard], g.head, g.tail);
+        have_foreign = true;
+      } else {
+        ReleaseToSpan(span, g.head, g.tail, g.n);
+      }
+    }
+  }
+  if (have_foreign) {
+    lock_.Unlock();
+    for (int s = 0; s < kMaxShards; s++) {
+      if (foreign[s] == NULL) continue;
+      CentralFreeList* owner = Static::central_shard(s, size_class_);
+      SpinLockHolder h(&owner->lock_);
+      owner->ReleaseListToSpans(foreign[s]);
+    }
+    lock_.Lock();
   }
 }
 
 bool CentralFreeList::EvictRandomSizeClass(
-    int locked_size_class, bool force) {
+    CentralFreeList* locked, bool force) {
   static int race_counter = 0;
+  static int shard_counter = 0;
   int t = race_counter++;  // Updated without a lock, but who cares.
   if (t >= Static::num_size_classes()) {
     while (t >= Static::num_size_classes()) {
@@ -160,18 +358,28 @@ bool CentralFreeList::EvictRandomSizeClass(
   }
   ASSERT(t >= 0);
   ASSERT(t < Static::num_size_classes());
-  if (t == locked_size_class) return false;
-  return Static::central_cache()[t].ShrinkCache(locked_size_class, force);
+  const int shards = Static::num_central_shards(t);
+  int s = 0;
+  if (shards > 1) {
+    s = shard_counter++;  // Updated without a lock, too.
+    if (s < 0 || s >= shards) {
+      s = 0;
+      shard_counter = 1;
+    }
+  }
+  CentralFreeList* victim = Static::central_shard(s, t);
+  if (victim == locked) return false;
+  return victim->ShrinkCache(locked, force);
 }
 
 bool CentralFreeList::MakeCacheSpace() {
   // Is there room in the cache?
-  if (used_slots_ < cache_size_) return true;
+  if (base::subtle::NoBarrier_Load(&used_slots_) < cache_size_) return true;
   // Check if we can expand this cache?
   if (cache_size_ == max_cache_size_) return false;
   // Ok, we'll try to grab an entry from some other size class.
-  if (EvictRandomSizeClass(size_class_, false) ||
-      EvictRandomSizeClass(size_class_, true)) {
+  if (EvictRandomSizeClass(this, false) ||
+      EvictRandomSizeClass(this, true)) {
     // Succeeded in evicting, we're going to make our cache larger.
     // However, we may have dropped and re-acquired the lock in
     // EvictRandomSizeClass (via ShrinkCache and the LockInverter), so the
@@ -200,44 +408,138 @@ class LockInverter {
 // This function is marked as NO_THREAD_SAFETY_ANALYSIS because it uses
 // LockInverter to release one lock and acquire another in scoped-lock
 // style, which our current annotation/analysis does not support.
-bool CentralFreeList::ShrinkCache(int locked_size_class, bool force)
+bool CentralFreeList::ShrinkCache(CentralFreeList* locked, bool force)
     NO_THREAD_SAFETY_ANALYSIS {
   // Start with a quick check without taking a lock.
-  if (cache_size_ == 0) return false;
+  if (base::subtle::NoBarrier_Load(&cache_size_) == 0) return false;
   // We don't evict from a full cache unless we are 'forcing'.
-  if (force == false && used_slots_ == cache_size_) return false;
+  if (force == false &&
+      base::subtle::NoBarrier_Load(&used_slots_) >=
+      base::subtle::NoBarrier_Load(&cache_size_)) {
+    return false;
+  }
 
   // Grab lock, but first release the other lock held by this thread.  We use
   // the lock inverter to ensure that we never hold two size class locks
   // concurrently.  That can create a deadlock because there is no well
   // defined nesting order.
-  LockInverter li(&Static::central_cache()[locked_size_class].lock_, &lock_);
-  ASSERT(used_slots_ <= cache_size_);
+  LockInverter li(&locked->lock_, &lock_);
   ASSERT(0 <= cache_size_);
   if (cache_size_ == 0) return false;
-  if (used_slots_ == cache_size_) {
+  // Producers only reserve slots below cache_size_, but they may have
+  // read it before we last shrank it, so used_slots_ can briefly exceed
+  // cache_size_.
+  if (base::subtle::NoBarrier_Load(&used_slots_) >= cache_size_) {
     if (force == false) return false;
+    void *head, *tail;
+    if (!TryPopBatch(&head, &tail)) return false;
     // ReleaseListToSpans releases the lock, so we have to make all the
     // updates to the central list before calling it.
     cache_size_--;
-    used_slots_--;
-    ReleaseListToSpans(tc_slots_[used_slots_].head);
+    ReleaseListToSpans(head);
     return true;
   }
   cache_size_--;
   return true;
 }
 
+void CentralFreeList::AddUsedSlots(int32_t delta) {
+  Atomic32 used = base::subtle::NoBarrier_Load(&used_slots_);
+  for (;;) {
+    Atomic32 prev = base::subtle::NoBarrier_CompareAndSwap(
+        &used_slots_, used, used + delta);
+    if (prev == used) return;
+    used = prev;
+  }
+}
+
+// Positions are free running 32-bit counters; they are compared via the
+// signed difference so that wrap-around is harmless.
+static inline Atomic32 NextPos(Atomic32 pos, uint32_t n) {
+  return static_cast<Atomic32>(static_cast<uint32_t>(pos) + n);
+}
+
+static inline int32_t PosDiff(Atomic32 a, Atomic32 b) {
+  return static_cast<int32_t>(static_cast<uint32_t>(a) -
+                              static_cast<uint32_t>(b));
+}
+
+bool CentralFreeList::TryPushBatch(void *head, void *tail) {
+  // Reserve room for the batch first; that keeps the number of batches in
+  // flight within the ring's capacity.
+  Atomic32 used = base::subtle::NoBarrier_Load(&used_slots_);
+  for (;;) {
+    if (used >= base::subtle::NoBarrier_Load(&cache_size_)) return false;
+    Atomic32 prev = base::subtle::NoBarrier_CompareAndSwap(
+        &used_slots_, used, used + 1);
+    if (prev == used) break;
+    used = prev;
+  }
+
+  Atomic32 pos = base::subtle::NoBarrier_Load(&tc_enqueue_pos_);
+  for (;;) {
+    TCEntry *entry = &tc_slots_[pos & (kMaxNumTransferEntries - 1)];
+    int32_t dif = PosDiff(base::subtle::Acquire_Load(&entry->sequence), pos);
+    if (dif == 0) {
+      Atomic32 prev = base::subtle::NoBarrier_CompareAndSwap(
+          &tc_enqueue_pos_, pos, NextPos(pos, 1));
+      if (prev == pos) {
+        entry->head = head;
+        entry->tail = tail;
+        base::subtle::Release_Store(&entry->sequence, NextPos(pos, 1));
+        return true;
+      }
+      pos = prev;
+    } else if (dif < 0) {
+      // A consumer that claimed this slot a full lap ago has not finished
+      // with it yet.  Rare; let the caller take the slow path.
+      AddUsedSlots(-1);
+      return false;
+    } else {
+      pos = base::subtle::NoBarrier_Load(&tc_enqueue_pos_);
+    }
+  }
+}
+
+bool CentralFreeList::TryPopBatch(void **head, void **tail) {
+  if (base::subtle::NoBarrier_Load(&used_slots_) <= 0) return false;
+
+  Atomic32 pos = base::subtle::NoBarrier_Load(&tc_dequeue_pos_);
+  for (;;) {
+    TCEntry *entry = &tc_slots_[pos & (kMaxNumTransferEntries - 1)];
+    int32_t dif = PosDiff(base::subtle::Acquire_Load(&entry->sequence),
+                          NextPos(pos, 1));
+    if (dif == 0) {
+      Atomic32 prev = base::subtle::NoBarrier_CompareAndSwap(
+          &tc_dequeue_pos_, pos, NextPos(pos, 1));
+      if (prev == pos) {
+        *head = entry->head;
+        *tail = entry->tail;
+        base::subtle::Release_Store(
+            &entry->sequence, NextPos(pos, kMaxNumTransferEntries));
+        AddUsedSlots(-1);
+        return true;
+      }
+      pos = prev;
+    } else if (dif < 0) {
+      // Empty, or the next batch is still being published.
+      return false;
+    } else {
+      pos = base::subtle::NoBarrier_Load(&tc_dequeue_pos_);
+    }
+  }
+}
+
 void CentralFreeList::InsertRange(void *start, void *end, int N) {
+  const bool full_batch =
+      (N == Static::sizemap()->num_objects_to_move(size_class_));
+  if (full_batch && TryPushBatch(start, end)) {
+    return;
+  }
   SpinLockHolder h(&lock_);
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-    MakeCacheSpace()) {
-    int slot = used_slots_++;
-    ASSERT(slot >=0);
-    ASSERT(slot < max_cache_size_);
-    TCEntry *entry = &tc_slots_[slot];
-    entry->head = start;
-    entry->tail = end;
+  // The transfer cache is full; see if we can grow it at the expense of
+  // some other size class.
+  if (full_batch && MakeCacheSpace() && TryPushBatch(start, end)) {
     return;
   }
   ReleaseListToSpans(start);
@@ -245,14 +547,18 @@ void CentralFreeList::InsertRange(void *start, void *end, int N) {
 
 int CentralFreeList::RemoveRange(void **start, void **end, int N) {
   ASSERT(N > 0);
+  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
+      TryPopBatch(start, end)) {
+    return N;
+  }
+
   lock_.Lock();
+
+  // Before growing this shard from the page heap, see if a sibling shard
+  // has a batch it isn't using.
   if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-      used_slots_ > 0) {
-    int slot = --used_slots_;
-    ASSERT(slot >= 0);
-    TCEntry *entry = &tc_slots_[slot];
-    *start = entry->head;
-    *end = entry->tail;
+      FullestNonemptySpan() == NULL &&
+      StealFromSiblingShard(start, end)) {
     lock_.Unlock();
     return N;
   }
@@ -278,6 +584,22 @@ int CentralFreeList::RemoveRange(void **start, void **end, int N) {
 }
 
 
+bool CentralFreeList::StealFromSiblingShard(void **start, void **end) {
+  // Only shards of our own NUMA node are siblings.
+  const int shards = Static::central_shards_per_node(size_class_);
+  if (shards <= 1) return false;
+
+  const int first = node_ * shards;
+  for (int i = 1; i < shards; ++i) {
+    CentralFreeList* sibling = Static::central_shard(
+        first + (shard_ - first + i) % shards, size_class_);
+    if (sibling->TryPopBatch(start, end)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 int CentralFreeList::FetchFromOneSpansSafe(int N, void **start, void **end) {
   int result = FetchFromOneSpans(N, start, end);
   if (!result) {
@@ -288,35 +610,282 @@ int CentralFreeList::FetchFromOneSpansSafe(int N, void **start, void **end) {
 }
 
 int CentralFreeList::FetchFromOneSpans(int N, void **start, void **end) {
-  if (tcmalloc::DLL_IsEmpty(&nonempty_)) return 0;
-  Span* span = nonempty_.next;
+  Span* span = FullestNonemptySpan();
+  if (span == NULL) return 0;
 
-  ASSERT(span->objects != NULL);
+  ASSERT(HasFreeObjects(span));
 
+  // Objects that were freed back to the span come first, since their
+  // memory has been touched already.
   int result = 0;
-  void *prev, *curr;
-  curr = span->objects;
-  do {
-    prev = curr;
-    curr = *(reinterpret_cast<void**>(curr));
-  } while (++result < N && curr != NULL);
+  void *head = NULL, *tail = NULL;
+  if (bitmaps_) {
+    result = FetchFromBitmap(span, N, &head, &tail);
+  } else if (span->objects != NULL) {
+    void *prev, *curr;
+    curr = span->objects;
+    do {
+      prev = curr;
+      curr = *(reinterpret_cast<void**>(curr));
+    } while (++result < N && curr != NULL);
+    head = span->objects;
+    tail = prev;
+    span->objects = curr;
+  }
+
+  // Then new objects are carved from the part of the span that nothing
+  // has written to yet, so that its pages are only faulted in as they
+  // are needed.
+  if (result < N && span->untouched != NULL) {
+    const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+    char* limit = reinterpret_cast<char*>(
+        (span->start + span->length) << kPageShift);
+    char* ptr = span->untouched;
+    do {
+      if (bitmaps_ && span->bitmap->released_count != 0) {
+        ReuseReleasedPages(span, ptr);
+      }
+      if (tail != NULL) {
+        *reinterpret_cast<void**>(tail) = ptr;
+      } else {
+        head = ptr;
+      }
+      tail = ptr;
+      ptr += size;
+    } while (++result < N && ptr + size <= limit);
+    span->untouched = (ptr + size <= limit) ? ptr : NULL;
+  }
+
+  ObjectsTakenFromSpan(span, result);
 
-  if (curr == NULL) {
+  *start = head;
+  *end = tail;
+  SLL_SetNext(*end, NULL);
+  return result;
+}
+
+void CentralFreeList::ObjectsTakenFromSpan(Span* span, int n) {
+  const int old_refcount = span->refcount;
+  span->refcount += n;
+  counter_ -= n;
+  if (!HasFreeObjects(span)) {
     // Move to empty list
-    tcmalloc::DLL_Remove(span);
+    RemoveFromNonempty(span, old_refcount);
     tcmalloc::DLL_Prepend(&empty_, span);
     Event(span, 'E', 0);
+  } else if (OccupancyBucket(old_refcount) !=
+             OccupancyBucket(span->refcount)) {
+    RemoveFromNonempty(span, old_refcount);
+    AddToNonempty(span);
   }
+}
 
-  *start = span->objects;
-  *end = prev;
-  span->objects = curr;
-  SLL_SetNext(*end, NULL);
-  span->refcount += result;
-  counter_ -= result;
+int CentralFreeList::FetchFromBitmap(Span* span, int N,
+                                     void **head, void **tail) {
+  SpanBitmap* bitmap = span->bitmap;
+  if (bitmap->free_count == 0) return 0;
+  const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+  char* base = reinterpret_cast<char*>(span->start << kPageShift);
+  int result = 0;
+  for (int word = 0; result < N; word++) {
+    ASSERT(word < SpanBitmap::kMaxObjects / 64);
+    uint64 bits = bitmap->free[word];
+    while (bits != 0 && result < N) {
+      char* object = base + (word * 64 + LowestBit(bits)) * size;
+      bits &= bits - 1;
+      if (bitmap->released_count != 0) {
+        ReuseReleasedPages(span, object);
+      }
+      if (*tail != NULL) {
+        *reinterpret_cast<void**>(*tail) = object;
+      } else {
+        *head = object;
+      }
+      *tail = object;
+      result++;
+    }
+    bitmap->free[word] = bits;
+    if (result == bitmap->free_count) break;
+  }
+  bitmap->free_count -= result;
   return result;
 }
 
+void CentralFreeList::ReuseReleasedPages(Span* span, char* object) {
+  const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+  const PageID first = reinterpret_cast<uintptr_t>(object) >> kPageShift;
+  const PageID last =
+      (reinterpret_cast<uintptr_t>(object) + size - 1) >> kPageShift;
+  SpanBitmap* bitmap = span->bitmap;
+  for (PageID p = first; p <= last; p++) {
+    if (TestBit(bitmap->released, p - span->start)) {
+      TCMalloc_SystemCommit(reinterpret_cast<void*>(p << kPageShift),
+                            kPageSize);
+      ClearBit(bitmap->released, p - span->start);
+      bitmap->released_count--;
+      released_bytes_ -= kPageSize;
+    }
+  }
+}
+
+struct CentralFreeList::ReleaseBatch {
+  static const int kMaxRuns = 32;
+
+  SystemReleaseRange ranges[kMaxRuns];
+  Span* spans[kMaxRuns];
+  uint16 first[kMaxRuns];       // Objects taken out of the span for run i
+  uint16 last[kMaxRuns];        // are first[i] to last[i] - 1
+  int count;
+
+  ReleaseBatch() : count(0) { }
+};
+
+size_t CentralFreeList::ReleaseFreePages() {
+  if (!bitmaps_) return 0;
+  SpinLockHolder h(&lock_);
+  size_t released = 0;
+  ReleaseBatch batch;
+  bool full;
+  do {
+    // Taking objects out moves a span to a fuller list, which has been
+    // looked at already.
+    for (int i = kOccupancyBuckets - 1; i >= 0; --i) {
+      Span* span = nonempty_[i].next;
+      while (span != &nonempty_[i] && batch.count < ReleaseBatch::kMaxRuns) {
+        Span* next = span->next;
+        AddFreePagesToBatch(span, &batch);
+        span = next;
+      }
+    }
+    full = (batch.count == ReleaseBatch::kMaxRuns);
+    const size_t batch_released = FlushReleaseBatch(&batch);
+    // Some systems do not support release
+    if (batch_released == 0) break;
+    released += batch_released;
+  } while (full);
+  return released;
+}
+
+void CentralFreeList::AddFreePagesToBatch(Span* span, ReleaseBatch* batch) {
+  // A span with objects in use has no free pages unless it has several.
+  if (span->length == 1) return;
+
+  SpanBitmap* bitmap = span->bitmap;
+  const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
+  const size_t objects = (span->length << kPageShift) / size;
+  // Objects past the untouched mark are free too.
+  size_t untouched = (span->untouched == NULL) ? objects :
+      (reinterpret_cast<uintptr_t>(span->untouched) -
+       (span->start << kPageShift)) / size;
+
+  const int old_count = batch->count;
+  int taken = 0;
+  size_t taken_end = 0;  // Objects before it are taken or not to be
+  Length run = 0;  // Free pages found before page i, not added yet
+  for (Length i = 0; i <= span->length; i++) {
+    bool free = false;
+    if (i < span->length && !TestBit(bitmap->released, i)) {
+      // The objects that overlap page i.
+      const size_t first = (i << kPageShift) / size;
+      const size_t last = min(min(objects, untouched),
+                              (((i + 1) << kPageShift) - 1) / size + 1);
+      free = (first >= last || AllBitsSet(bitmap->free, first, last - 1));
+    }
+    if (free) {
+      run++;
+      continue;
+    }
+    if (run > 0) {
+      if (batch->count == ReleaseBatch::kMaxRuns) break;
+      const Length start = i - run;
+      // An object on both sides of a released page is taken only once.
+      const size_t first = max(taken_end, (start << kPageShift) / size);
+      const size_t last = min(objects, ((i << kPageShift) - 1) / size + 1);
+      // The untouched objects become ordinary free ones, so that those
+      // on the run can be taken out of the bitmap.
+      if (last > untouched) {
+        for (size_t k = untouched; k < objects; k++) {
+          SetBit(bitmap->free, k);
+        }
+        bitmap->free_count += objects - untouched;
+        span->untouched = NULL;
+        untouched = objects;
+      }
+      for (size_t k = first; k < last; k++) {
+        ASSERT(TestBit(bitmap->free, k));
+        ClearBit(bitmap->free, k);
+      }
+      bitmap->free_count -= last - first;
+      taken += last - first;
+      taken_end = last;
+
+      const int n = batch->count++;
+      batch->ranges[n].start =
+          reinterpret_cast<void*>((span->start + start) << kPageShift);
+      batch->ranges[n].length = run << kPageShift;
+      batch->ranges[n].released = false;
+      batch->ranges[n].zeroed = false;
+      batch->spans[n] = span;
+      batch->first[n] = first;
+      batch->last[n] = last;
+      run = 0;
+    }
+  }
+  // The objects taken keep the span from being freed meanwhile, so a
+  // span can not be released with none.
+  if (taken > 0) {
+    ObjectsTakenFromSpan(span, taken);
+  } else {
+    batch->count = old_count;
+  }
+}
+
+size_t CentralFreeList::FlushReleaseBatch(ReleaseBatch* batch) {
+  if (batch->count == 0) return 0;
+
+  // The objects on the runs are out of their spans, so they can not be
+  // handed out, nor the spans freed, until they are put back below.
+  lock_.Unlock();
+  TCMalloc_SystemReleaseBatch(batch->ranges, batch->count);
+  lock_.Lock();
+
+  size_t released = 0;
+  bool was_full = false;
+  int taken = 0;
+  for (int n = 0; n < batch->count; n++) {
+    Span* span = batch->spans[n];
+    SpanBitmap* bitmap = span->bitmap;
+    if (n == 0 || batch->spans[n - 1] != span) {
+      was_full = !HasFreeObjects(span);
+    }
+    if (batch->ranges[n].released) {
+      const PageID p =
+          reinterpret_cast<uintptr_t>(batch->ranges[n].start) >> kPageShift;
+      const Length start = p - span->start;
+      const Length length = batch->ranges[n].length >> kPageShift;
+      for (Length j = start; j < start + length; j++) {
+        SetBit(bitmap->released, j);
+      }
+      bitmap->released_count += length;
+      released_bytes_ += batch->ranges[n].length;
+      released += batch->ranges[n].length;
+    }
+    for (int k = batch->first[n]; k < batch->last[n]; k++) {
+      SetBit(bitmap->free, k);
+    }
+    bitmap->free_count += batch->last[n] - batch->first[n];
+    taken += batch->last[n] - batch->first[n];
+    // The runs of a span are next to each other in the batch.  Its
+    // objects go back together after the last, which may free the span.
+    if (n + 1 == batch->count || batch->spans[n + 1] != span) {
+      ObjectsReturnedToSpan(span, taken, was_full);
+      taken = 0;
+    }
+  }
+  batch->count = 0;
+  return released;
+}
+
 // Fetch memory from the system and add to the central cache freelist.
 void CentralFreeList::Populate() {
   // Release central list lock while operating on pageheap
@@ -326,8 +895,18 @@ void CentralFreeList::Populate() {
   Span* span;
   {
     SpinLockHolder h(Static::pageheap_lock());
-    span = Static::pageheap()->New(npages);
-    if (span) Static::pageheap()->RegisterSizeClass(span, size_class_);
+    span = Static::pageheap()->NewForSizeClass(npages, size_class_, node_);
+    if (span) {
+      span->central_shard = shard_;
+      span->bitmap = NULL;
+      if (bitmaps_) {
+        if (!bitmap_allocator_initialized) {
+          bitmap_allocator.Init();
+          bitmap_allocator_initialized = true;
+        }
+        span->bitmap = bitmap_allocator.New();
+      }
+    }
   }
   if (span == NULL) {
     Log(kLog, __FILE__, __LINE__,
@@ -339,37 +918,36 @@ void CentralFreeList::Populate() {
   // Cache sizeclass info eagerly.  Locking is not necessary.
   // (Instead of being eager, we could just replace any stale info
   // about this span, but that seems to be no better in practice.)
-  for (int i = 0; i < npages; i++) {
-    Static::pageheap()->SetCachedSizeClass(span->start + i, size_class_);
+  // Spans in size class regions need no caching.
+  if (!Static::pageheap()->InSizeClassRegion(span->start)) {
+    for (int i = 0; i < npages; i++) {
+      Static::pageheap()->SetCachedSizeClass(span->start + i, size_class_);
+    }
   }
 
-  // Split the block into pieces and add to the free-list
+  // The objects are carved out of the span as they are fetched, rather
+  // than threaded onto the free list here, which would touch every
+  // page of the span up front.
   // TODO: coloring of objects to avoid cache conflicts?
-  void** tail = &span->objects;
-  char* ptr = reinterpret_cast<char*>(span->start << kPageShift);
-  char* limit = ptr + (npages << kPageShift);
   const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
-  int num = 0;
-  while (ptr + size <= limit) {
-    *tail = ptr;
-    tail = reinterpret_cast<void**>(ptr);
-    ptr += size;
-    num++;
-  }
-  ASSERT(ptr <= limit);
-  *tail = NULL;
+  const int num = (npages << kPageShift) / size;
+  ASSERT(num > 0);
+  if (bitmaps_) {
+    memset(span->bitmap, 0, sizeof(*span->bitmap));
+  }
+  span->untouched = reinterpret_cast<char*>(span->start << kPageShift);
   span->refcount = 0; // No sub-object in use yet
 
   // Add span to list of non-empty spans
   lock_.Lock();
-  tcmalloc::DLL_Prepend(&nonempty_, span);
+  AddToNonempty(span);
   ++num_spans_;
   counter_ += num;
 }
 
 int CentralFreeList::tc_length() {
-  SpinLockHolder h(&lock_);
-  return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_);
+  return base::subtle::NoBarrier_Load(&used_slots_) *
+      Static::sizemap()->num_objects_to_move(size_class_);
 }
 
 size_t CentralFreeList::OverheadBytes() {
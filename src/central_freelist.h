@@ -39,6 +39,7 @@
 #ifdef HAVE_STDINT_H
 #include <stdint.h>                     // for int32_t
 #endif
+#include "base/atomicops.h"
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
 #include "common.h"
@@ -54,7 +55,29 @@ class CentralFreeList {
   // lock_ state.
   CentralFreeList() : lock_(base::LINKER_INITIALIZED) { }
 
-  void Init(size_t cl);
+  // Hot size classes may be split into up to kMaxShards independent
+  // free lists, counting those of all NUMA nodes (see
+  // Static::central_freelist()).  The limit is bounded by the width of
+  // Span::central_shard.
+  static const int kMaxShards = 16;
+
+  // Initializes shard 'shard' of the free list for size class 'cl'.  It
+  // gets its spans from the page heap lists of NUMA node 'node'.
+  void Init(size_t cl, int shard, int node);
+
+  // Returns which shard of its size class this free list is.
+  int shard() const { return shard_; }
+
+  // Returns the NUMA node the free list belongs to.
+  int node() const { return node_; }
+
+  // If 'enabled', size classes with at most SpanBitmap::kMaxObjects
+  // objects per span keep their free objects in SpanBitmaps instead of
+  // lists threaded through the objects.  This lets ReleaseFreePages()
+  // give the free pages of partly used spans back to the system.  Must
+  // be called before the free lists are initialized.
+  static void SetSpanBitmaps(bool enabled) { span_bitmaps_ = enabled; }
+  static bool GetSpanBitmaps() { return span_bitmaps_; }
 
   // These methods all do internal locking.
 
@@ -71,9 +94,39 @@ class CentralFreeList {
     return counter_;
   }
 
-  // Returns the number of free objects in the transfer cache.
+  // Returns the number of free objects in the transfer cache.  Does not
+  // lock.
   int tc_length();
 
+  // Spans that still have free objects are kept in this many lists, by
+  // the share of their objects in use: up to 1/4, up to 1/2, up to 3/4,
+  // and more.  Objects are handed out from the fullest spans first, so
+  // that the emptiest ones get a chance to drain back to the page heap.
+  static const int kOccupancyBuckets = 4;
+
+  struct SpanOccupancy {
+    size_t partial[kOccupancyBuckets];  // Spans with free objects, by bucket
+    size_t full;                        // Spans with no free objects
+  };
+
+  // Adds the number of spans of this free list in each occupancy bucket
+  // to *occupancy.
+  void GetSpanOccupancy(SpanOccupancy* occupancy);
+
+  // Releases to the system the pages of partly used spans that hold
+  // only free objects, if this free list keeps span bitmaps.  Returns
+  // the number of bytes released.  lock_ is not held during the
+  // release system calls.
+  // REQUIRES: pageheap_lock is not held
+  size_t ReleaseFreePages();
+
+  // Returns the number of bytes of the spans of this free list that
+  // ReleaseFreePages() has released and that have not been used since.
+  size_t released_bytes() {
+    SpinLockHolder h(&lock_);
+    return released_bytes_;
+  }
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
@@ -94,7 +147,14 @@ class CentralFreeList {
   // TransferCache is used to cache transfers of
   // sizemap.num_objects_to_move(size_class) back and forth between
   // thread caches and the central cache for a given size class.
+  //
+  // It is a bounded multi-producer/multi-consumer ring in the style of
+  // Dmitry Vyukov's queue, so full batches move in and out without
+  // taking lock_.  A slot's sequence number says whose turn it is: it
+  // equals the enqueue position when the slot is free and the enqueue
+  // position + 1 once a batch has been published in it.
   struct TCEntry {
+    Atomic32 sequence;
     void *head;  // Head of chain of objects.
     void *tail;  // Tail of chain of objects.
   };
@@ -111,6 +171,17 @@ class CentralFreeList {
   static const int kMaxNumTransferEntries = 64;
 #endif
 
+  // Lock free.  Pushes a full batch into the transfer cache if it has room
+  // under cache_size_.  Returns false otherwise.
+  bool TryPushBatch(void *head, void *tail);
+
+  // Lock free.  Pops a full batch from the transfer cache.  Returns false
+  // if it is empty (or the only batches in it are still being pushed).
+  bool TryPopBatch(void **head, void **tail);
+
+  // Atomically adds delta to used_slots_.
+  void AddUsedSlots(int32_t delta);
+
   // REQUIRES: lock_ is held
   // Remove object from cache and return.
   // Return NULL if no free entries in cache.
@@ -122,15 +193,102 @@ class CentralFreeList {
   // NULL on allocation failure.
   int FetchFromOneSpansSafe(int N, void **start, void **end) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
+  // ReleaseListToSpans groups its list by page in chunks of this many
+  // objects.
+  static const int kMaxReleaseBatch = 64;
+
   // REQUIRES: lock_ is held
   // Release a linked list of objects to spans.
   // May temporarily release lock_.
   void ReleaseListToSpans(void *start) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: lock_ is held
-  // Release an object to spans.
+  // Release the NULL-terminated list of n objects from head to tail,
+  // which all lie in 'span', to that span.
   // May temporarily release lock_.
-  void ReleaseToSpans(void* object) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void ReleaseToSpan(Span* span, void* head, void* tail, int n)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Accounts for n objects of 'span' that have been marked free again,
+  // moving the span to the list it now belongs on, or giving it back to
+  // the page heap once none is in use.  'was_full' tells whether the
+  // span had no free objects before.
+  // May temporarily release lock_.
+  void ObjectsReturnedToSpan(Span* span, int n, bool was_full)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Accounts for n objects that have been taken out of 'span', moving
+  // the span to the list it now belongs on.
+  void ObjectsTakenFromSpan(Span* span, int n) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Moves a full batch out of the transfer cache of another shard of this
+  // size class.  Returns false if no sibling shard had one to spare.
+  bool StealFromSiblingShard(void **start, void **end);
+
+  // Returns the occupancy bucket of a span with 'refcount' objects in
+  // use, which must be fewer than all of them.
+  int OccupancyBucket(int refcount) const {
+    ASSERT(refcount < objects_per_span_);
+    return refcount == 0 ? 0 :
+        (refcount * kOccupancyBuckets - 1) / objects_per_span_;
+  }
+
+  // REQUIRES: lock_ is held
+  // Adds 'span', which is on no list and has free objects, to the
+  // nonempty list of its occupancy.
+  void AddToNonempty(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Takes 'span' off the nonempty list it is on, 'refcount' being the
+  // number of its objects in use when it was put there.
+  void RemoveFromNonempty(Span* span, int refcount)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Returns the fullest span with free objects, or NULL if there is none.
+  Span* FullestNonemptySpan() EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    for (int i = kOccupancyBuckets - 1; i >= 0; i--) {
+      if (!tcmalloc::DLL_IsEmpty(&nonempty_[i])) return nonempty_[i].next;
+    }
+    return NULL;
+  }
+
+  // REQUIRES: lock_ is held
+  // Returns true if 'span' has objects left to hand out.
+  bool HasFreeObjects(const Span* span) const EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    if (span->untouched != NULL) return true;
+    return bitmaps_ ? span->bitmap->free_count != 0 : span->objects != NULL;
+  }
+
+  // REQUIRES: lock_ is held
+  // Takes up to N freed objects of 'span' out of its bitmap, appending
+  // them to the list from *head to *tail.  Returns how many it took.
+  int FetchFromBitmap(Span* span, int N, void **head, void **tail)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Takes back from the system the released pages of 'span' that the
+  // object at 'object' lies on, before it is handed out.
+  void ReuseReleasedPages(Span* span, char* object)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Runs of free pages of partly used spans to be released together.
+  struct ReleaseBatch;
+
+  // REQUIRES: lock_ is held
+  // Adds the runs of pages of 'span' that hold only free objects to
+  // *batch, as long as it has room, and takes the objects on them out
+  // of the span so that they are not handed out meanwhile.
+  void AddFreePagesToBatch(Span* span, ReleaseBatch* batch)
+      EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // REQUIRES: lock_ is held
+  // Releases the runs of *batch to the system with lock_ dropped, then
+  // puts their objects back.  Returns the number of bytes released.
+  // May temporarily release lock_.
+  size_t FlushReleaseBatch(ReleaseBatch* batch) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: lock_ is held
   // Populate cache by fetching from the page heap.
@@ -143,47 +301,60 @@ class CentralFreeList {
   // no space.
   bool MakeCacheSpace() EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  // REQUIRES: lock_ for locked_size_class is held.
+  // REQUIRES: locked->lock_ is held.
   // Picks a "random" size class to steal TCEntry slot from.  In reality it
-  // just iterates over the sizeclasses but does so without taking a lock.
-  // Returns true on success.
+  // just iterates over the sizeclasses (and their shards) but does so
+  // without taking a lock.  Returns true on success.
   // May temporarily lock a "random" size class.
-  static bool EvictRandomSizeClass(int locked_size_class, bool force);
+  static bool EvictRandomSizeClass(CentralFreeList* locked, bool force);
 
   // REQUIRES: lock_ is *not* held.
   // Tries to shrink the Cache.  If force is true it will relase objects to
   // spans if it allows it to shrink the cache.  Return false if it failed to
   // shrink the cache.  Decrements cache_size_ on succeess.
-  // May temporarily take lock_.  If it takes lock_, the locked_size_class
-  // lock is released to keep the thread from holding two size class locks
+  // May temporarily take lock_.  If it takes lock_, the lock of 'locked'
+  // is released to keep the thread from holding two size class locks
   // concurrently which could lead to a deadlock.
-  bool ShrinkCache(int locked_size_class, bool force) LOCKS_EXCLUDED(lock_);
+  bool ShrinkCache(CentralFreeList* locked, bool force) LOCKS_EXCLUDED(lock_);
 
-  // This lock protects all the data members.  cached_entries and cache_size_
-  // may be looked at without holding the lock.
+  // This lock protects the span lists and counters, and serializes changes
+  // of cache_size_.  The transfer cache itself is lock free.
   SpinLock lock_;
 
   // We keep linked lists of empty and non-empty spans.
   size_t   size_class_;     // My size class
+  int      shard_;          // Which shard of size_class_ I am
+  int      node_;           // NUMA node my spans come from
   Span     empty_;          // Dummy header for list of empty spans
-  Span     nonempty_;       // Dummy header for list of non-empty spans
+  Span     nonempty_[kOccupancyBuckets];  // Dummy headers for lists of
+                                          // non-empty spans, by occupancy
+  size_t   num_nonempty_[kOccupancyBuckets];  // Lengths of those lists
   size_t   num_spans_;      // Number of spans in empty_ plus nonempty_
+  int      objects_per_span_;  // Number of objects in each of my spans
   size_t   counter_;        // Number of free objects in cache entry
+  bool     bitmaps_;        // Whether my spans keep SpanBitmaps
+  size_t   released_bytes_; // Bytes of my spans released to the system
+
+  static bool span_bitmaps_;
 
   // Here we reserve space for TCEntry cache slots.  Space is preallocated
   // for the largest possible number of entries than any one size class may
   // accumulate.  Not all size classes are allowed to accumulate
   // kMaxNumTransferEntries, so there is some wasted space for those size
   // classes.
+  // kMaxNumTransferEntries must be a power of two (or zero).
   TCEntry tc_slots_[kMaxNumTransferEntries];
+  Atomic32 tc_enqueue_pos_;
+  Atomic32 tc_dequeue_pos_;
 
-  // Number of currently used cached entries in tc_slots_.  This variable is
-  // updated under a lock but can be read without one.
-  int32_t used_slots_;
+  // Number of batches in tc_slots_, including ones that are being pushed.
+  // Producers reserve a slot by raising it while it is below cache_size_
+  // and consumers lower it once they have taken a batch out.
+  Atomic32 used_slots_;
   // The current number of slots for this size class.  This is an
   // adaptive value that is increased if there is lots of traffic
-  // on a given size class.
-  int32_t cache_size_;
+  // on a given size class.  Changed under lock_ but read without it.
+  Atomic32 cache_size_;
   // Maximum size of the cache for a given size class.
   int32_t max_cache_size_;
 };
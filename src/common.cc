@@ -33,6 +33,12 @@
 
 #include <stdlib.h> // for getenv and strtol
 #include "config.h"
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>  // for open
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> // for read, close
+#endif
 #include "common.h"
 #include "system-alloc.h"
 #include "base/spinlock.h"
@@ -118,21 +124,27 @@ int SizeMap::NumMoveSize(size_t size) {
   return num;
 }
 
-// Initialize the mapping arrays
-void SizeMap::Init() {
-  InitTCMallocTransferNumObjects();
-
-  // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
-  if (ClassIndex(0) != 0) {
-    Log(kCrash, __FILE__, __LINE__,
-        "Invalid class index for size 0", ClassIndex(0));
-  }
-  if (ClassIndex(kMaxSize) >= sizeof(class_array_)) {
-    Log(kCrash, __FILE__, __LINE__,
-        "Invalid class index for kMaxSize", ClassIndex(kMaxSize));
-  }
+// Returns the number of pages in the spans of a size class of objects
+// of "size" bytes.
+size_t SizeMap::PagesForSize(size_t size) {
+  int blocks_to_move = NumMoveSize(size) / 4;
+  size_t psize = 0;
+  do {
+    psize += kPageSize;
+    // Allocate enough pages so leftover is less than 1/8 of total.
+    // This bounds wasted space to at most 12.5%.
+    while ((psize % size) > (psize >> 3)) {
+      psize += kPageSize;
+    }
+    // Continue to add pages until there are at least as many objects in
+    // the span as are needed when moving objects from the central
+    // freelists and spans to the thread caches.
+  } while ((psize / size) < (blocks_to_move));
+  return psize >> kPageShift;
+}
 
-  // Compute the size classes we want to use
+// Compute the size classes we want to use
+void SizeMap::ComputeSizeClasses() {
   int sc = 1;   // Next size class to assign
   int alignment = kAlignment;
   CHECK_CONDITION(kAlignment <= kMinAlign);
@@ -140,20 +152,7 @@ void SizeMap::Init() {
     alignment = AlignmentForSize(size);
     CHECK_CONDITION((size % alignment) == 0);
 
-    int blocks_to_move = NumMoveSize(size) / 4;
-    size_t psize = 0;
-    do {
-      psize += kPageSize;
-      // Allocate enough pages so leftover is less than 1/8 of total.
-      // This bounds wasted space to at most 12.5%.
-      while ((psize % size) > (psize >> 3)) {
-        psize += kPageSize;
-      }
-      // Continue to add pages until there are at least as many objects in
-      // the span as are needed when moving objects from the central
-      // freelists and spans to the thread caches.
-    } while ((psize / size) < (blocks_to_move));
-    const size_t my_pages = psize >> kPageShift;
+    const size_t my_pages = PagesForSize(size);
 
     if (sc > 1 && my_pages == class_to_pages_[sc-1]) {
       // See if we can merge this into the previous class without
@@ -178,16 +177,162 @@ void SizeMap::Init() {
     Log(kCrash, __FILE__, __LINE__,
         "too many size classes: (found vs. max)", sc, kClassSizesMax);
   }
+}
 
-  // Initialize the mapping arrays
+// Reports a TCMALLOC_SIZE_CLASSES file that can not be used.
+static bool BadSizeClasses(const char* path, const char* reason, int line) {
+  Log(kLog, __FILE__, __LINE__,
+      "Ignoring TCMALLOC_SIZE_CLASSES file (file, reason, line):",
+      path, reason, line);
+  return false;
+}
+
+static const char* SkipBlanks(const char* p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+  if (*p == '#') {
+    while (*p != '\0' && *p != '\n') p++;
+  }
+  return p;
+}
+
+bool SizeMap::LoadSizeClasses(const char* path) {
+#if defined(HAVE_FCNTL_H) && defined(HAVE_UNISTD_H)
+  // This runs before malloc works, so the file goes into a static
+  // buffer, by plain system calls.
+  static char buf[16 << 10];
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return BadSizeClasses(path, "can not be opened", 0);
+  }
+  size_t len = 0;
+  ssize_t count;
+  while (len < sizeof(buf) - 1 &&
+         (count = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+    len += count;
+  }
+  close(fd);
+  if (len == sizeof(buf) - 1) {
+    return BadSizeClasses(path, "is too long", 0);
+  }
+  buf[len] = '\0';
+
+  int sc = 1;
+  int line = 1;
+  size_t prev_size = 0;
+  for (const char* p = SkipBlanks(buf); *p != '\0'; p = SkipBlanks(p)) {
+    if (*p == '\n') {
+      p++;
+      line++;
+      continue;
+    }
+    char* end;
+    const size_t size = strtoul(p, &end, 10);
+    if (end == p) {
+      return BadSizeClasses(path, "expected a size", line);
+    }
+    p = SkipBlanks(end);
+    size_t pages = 0;
+    if (*p >= '0' && *p <= '9') {
+      pages = strtoul(p, &end, 10);
+      p = SkipBlanks(end);
+    }
+    if (*p != '\n' && *p != '\0') {
+      return BadSizeClasses(path, "expected a size and pages", line);
+    }
+
+    if (sc >= kClassSizesMax) {
+      return BadSizeClasses(path, "has too many classes", line);
+    }
+    if (size <= prev_size || size > kMaxSize || size % kAlignment != 0) {
+      return BadSizeClasses(
+          path, "sizes must increase, be multiples of 8 and at most 256KiB",
+          line);
+    }
+    if (pages == 0) {
+      pages = PagesForSize(size);
+    } else if (pages > kMaxPages || (pages << kPageShift) < size) {
+      return BadSizeClasses(path, "bad number of pages", line);
+    }
+    // Span::refcount counts the objects of a span in 16 bits.
+    if ((pages << kPageShift) / size > 65535) {
+      return BadSizeClasses(path, "too many objects per span", line);
+    }
+    class_to_size_[sc] = size;
+    class_to_pages_[sc] = pages;
+    sc++;
+    prev_size = size;
+  }
+  if (prev_size != kMaxSize) {
+    return BadSizeClasses(path, "the last size must be 262144", line);
+  }
+  num_size_classes = sc;
+
+  FillClassArray();
+  if (!ClassesAreNaturallyAligned()) {
+    return BadSizeClasses(
+        path, "classes would misalign power-of-two sized objects", 0);
+  }
+  return true;
+#else
+  return BadSizeClasses(path, "not supported on this platform", 0);
+#endif
+}
+
+// Initialize the mapping arrays.  ClassIndex() is monotonic and takes
+// every value in between, so it is enough to fill the range of indexes
+// of each class, rather than step through all of its sizes.
+void SizeMap::FillClassArray() {
   int next_size = 0;
   for (int c = 1; c < num_size_classes; c++) {
     const int max_size_in_class = class_to_size_[c];
-    for (int s = next_size; s <= max_size_in_class; s += kAlignment) {
-      class_array_[ClassIndex(s)] = c;
+    const size_t last = ClassIndex(max_size_in_class);
+    for (size_t i = ClassIndex(next_size); i <= last; i++) {
+      class_array_[i] = c;
     }
     next_size = max_size_in_class + kAlignment;
   }
+}
+
+// Our fast-path aligned allocation functions rely on 'naturally
+// aligned' sizes to produce aligned addresses. Lets check if that
+// holds for size classes that we produced.
+//
+// I.e. we're checking that
+//
+// align = (1 << shift), malloc(i * align) % align == 0,
+//
+// for all align values up to kPageSize.
+bool SizeMap::ClassesAreNaturallyAligned() {
+  for (size_t align = kMinAlign; align <= kPageSize; align <<= 1) {
+    for (size_t size = align; size < kPageSize; size += align) {
+      if (class_to_size_[SizeClass(size)] % align != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Initialize the mapping arrays
+void SizeMap::Init() {
+  InitTCMallocTransferNumObjects();
+
+  // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
+  if (ClassIndex(0) != 0) {
+    Log(kCrash, __FILE__, __LINE__,
+        "Invalid class index for size 0", ClassIndex(0));
+  }
+  if (ClassIndex(kMaxSize) >= sizeof(class_array_)) {
+    Log(kCrash, __FILE__, __LINE__,
+        "Invalid class index for kMaxSize", ClassIndex(kMaxSize));
+  }
+
+  // Size classes may come from a file instead.
+  const char* path = TCMallocGetenvSafe("TCMALLOC_SIZE_CLASSES");
+  if (path == NULL || !LoadSizeClasses(path)) {
+    ComputeSizeClasses();
+    FillClassArray();
+  }
 
   // Double-check sizes just to be safe
   for (size_t size = 0; size <= kMaxSize;) {
@@ -212,20 +357,7 @@ void SizeMap::Init() {
     }
   }
 
-  // Our fast-path aligned allocation functions rely on 'naturally
-  // aligned' sizes to produce aligned addresses. Lets check if that
-  // holds for size classes that we produced.
-  //
-  // I.e. we're checking that
-  //
-  // align = (1 << shift), malloc(i * align) % align == 0,
-  //
-  // for all align values up to kPageSize.
-  for (size_t align = kMinAlign; align <= kPageSize; align <<= 1) {
-    for (size_t size = align; size < kPageSize; size += align) {
-      CHECK_CONDITION(class_to_size_[SizeClass(size)] % align == 0);
-    }
-  }
+  CHECK_CONDITION(ClassesAreNaturallyAligned());
 
   // Initialize the num_objects_to_move array.
   for (size_t cl = 1; cl  < num_size_classes; ++cl) {
@@ -286,6 +418,14 @@ void* MetaDataAlloc(size_t bytes) {
   return rv;
 }
 
+void MetaDataAllocLockAll() {
+  metadata_alloc_lock.Lock();
+}
+
+void MetaDataAllocUnlockAll() {
+  metadata_alloc_lock.Unlock();
+}
+
 uint64_t metadata_system_bytes() { return metadata_system_bytes_; }
 
 }  // namespace tcmalloc
@@ -90,6 +90,16 @@ static const size_t kAlignment  = 8;
 // For all span-lengths <= kMaxPages we keep an exact-size list in PageHeap.
 static const size_t kMaxPages = 1 << (20 - kPageShift);
 
+// Transparent huge pages are 2 MiB on the platforms we care about.  The
+// hugepage-aware page heap (TCMALLOC_HUGEPAGE_AWARE) works in these units.
+static const size_t kHugePageShift = 21;
+static const size_t kHugePageSize = 1 << kHugePageShift;
+static const size_t kPagesPerHugePage = 1 << (kHugePageShift - kPageShift);
+
+// Most NUMA nodes the page heap and central caches are partitioned into
+// (TCMALLOC_NUMA_AWARE).  Bounded by the width of Span::node.
+static const int kMaxNumaNodes = 8;
+
 // Default bound on the total amount of thread caches.
 #ifdef TCMALLOC_SMALL_BUT_SLOW
 // Make the overall thread cache no bigger than that of a single thread
@@ -231,6 +241,24 @@ class SizeMap {
 
   int NumMoveSize(size_t size);
 
+  // Fills class_to_size_, class_to_pages_ and num_size_classes with
+  // the size classes of objects up to kMaxSize.
+  void ComputeSizeClasses();
+  size_t PagesForSize(size_t size);
+
+  // Loads the size classes from the file at "path" instead, and fills
+  // class_array_ for them.  Returns false if the file can not be read
+  // or does not hold a usable set of classes; they are then left in an
+  // unspecified state.
+  bool LoadSizeClasses(const char* path);
+
+  // Fills class_array_ for the size classes.
+  void FillClassArray();
+
+  // Returns true if objects of every size that is a multiple of a power
+  // of two up to kPageSize get a size class that is a multiple of it too.
+  bool ClassesAreNaturallyAligned();
+
   // Mapping from size class to max size storable in that class
   int32 class_to_size_[kClassSizesMax];
 
@@ -293,6 +321,10 @@ class SizeMap {
 // fails.  Requires pageheap_lock is held.
 void* MetaDataAlloc(size_t bytes);
 
+// Acquire and release the lock held by MetaDataAlloc, around fork().
+void MetaDataAllocLockAll();
+void MetaDataAllocUnlockAll();
+
 // Returns the total number of bytes allocated from the system.
 // Requires pageheap_lock is held.
 uint64_t metadata_system_bytes();
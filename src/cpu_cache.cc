@@ -0,0 +1,409 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config.h"
+#include "cpu_cache.h"
+
+#ifdef TCMALLOC_PERCPU_RSEQ
+#include <fcntl.h>                      // for open, O_RDONLY
+#include <sched.h>                      // for sched_setaffinity, CPU_SET
+#include <sys/syscall.h>                // for SYS_rseq
+#include <unistd.h>                     // for read, close, syscall
+#endif
+#include <algorithm>                    // for min
+
+#include "base/atomicops.h"             // for Acquire_CompareAndSwap
+#include "base/commandlineflags.h"      // for StringToBool
+#include "central_freelist.h"           // for CentralFreeListPadded
+#include "getenv_safe.h"                // for TCMallocGetenvSafe
+#include "internal_logging.h"           // for ASSERT
+#include "linked_list.h"                // for SLL_Next, SLL_Push, etc
+#include "static_vars.h"                // for Static
+#include "thread_cache.h"               // for ThreadCache
+
+#ifdef TCMALLOC_PERCPU_RSEQ
+// Set by glibc 2.35+ when it registers an rseq area for every thread.
+extern "C" {
+extern const ptrdiff_t __rseq_offset ATTRIBUTE_WEAK;
+extern const unsigned int __rseq_size ATTRIBUTE_WEAK;
+}
+
+#ifndef SYS_rseq
+#define SYS_rseq 334
+#endif
+#endif
+
+namespace tcmalloc {
+
+// Byte budget of one size class in one per-CPU cache.  Classes of
+// objects larger than this are not cached per-CPU.
+static const size_t kPerCpuClassBytes = 64 << 10;
+
+// Upper bound on the number of cached objects of one class per CPU.
+static const int kMaxPerCpuLength = 1024;
+
+bool CpuCache::active_;
+int CpuCache::num_cpus_;
+char* CpuCache::slabs_;
+
+#ifdef TCMALLOC_PERCPU_RSEQ
+
+__thread CpuCache::KernelRseq* CpuCache::rseq_abi_ ATTR_INITIAL_EXEC;
+uint16_t CpuCache::capacity_[kClassSizesMax];
+uint16_t CpuCache::begin_[kClassSizesMax];
+
+// rseq area used by threads when libc did not register one for us.
+struct OwnRseq {
+  uint32_t cpu_id_start;
+  uint32_t cpu_id;
+  uint64_t rseq_cs;
+  uint32_t flags;
+  uint32_t padding[3];
+} __attribute__((aligned(32)));
+
+static __thread OwnRseq own_rseq ATTR_INITIAL_EXEC;
+
+static bool LibcRegistersRseq() {
+  return &__rseq_size != NULL && __rseq_size != 0;
+}
+
+// Returns the number of possible CPUs, i.e. an upper bound on the cpu
+// ids the kernel may report, or 0 if it cannot be determined.  We
+// cannot use sysconf() here, since older libcs may call malloc in it.
+static int PossibleCPUs() {
+  int fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+  if (fd < 0) return 0;
+  char buf[128];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return 0;
+  buf[len] = '\0';
+  // The file holds a list of ranges like "0-3,8-11".  The last number
+  // is the highest cpu id.
+  int value = -1;
+  int last = -1;
+  for (const char* p = buf; *p != '\0'; p++) {
+    if (*p >= '0' && *p <= '9') {
+      value = (value < 0 ? 0 : value * 10) + (*p - '0');
+    } else {
+      if (value >= 0) last = value;
+      value = -1;
+    }
+  }
+  if (value >= 0) last = value;
+  return last + 1;
+}
+
+void CpuCache::InitModule() {
+  active_ = tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_PERCPU_CACHES"), false);
+  if (!active_) {
+    return;
+  }
+  active_ = false;
+
+  if (!LibcRegistersRseq()) {
+    // Make sure the kernel supports rseq before committing to it.
+    // Registration is per-thread, this one gets unregistered again
+    // and re-registered in InitThread.
+    if (syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 0,
+                TCMALLOC_RSEQ_SIG) != 0) {
+      return;
+    }
+    syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 1 /* unregister */,
+            TCMALLOC_RSEQ_SIG);
+  }
+
+  const int ncpus = PossibleCPUs();
+  if (ncpus <= 0) {
+    return;
+  }
+  char* slabs = static_cast<char*>(
+      MetaDataAlloc(static_cast<size_t>(ncpus) << kSlabShift));
+  if (slabs == NULL) {
+    return;
+  }
+
+  // Carve slot arrays out of the slab, after the headers.
+  const int kHeaderSlots =
+      (kClassSizesMax * sizeof(Header) + sizeof(void*) - 1) / sizeof(void*);
+  const int kAvailableSlots = ((1 << kSlabShift) / sizeof(void*)) -
+                              kHeaderSlots;
+  int wanted[kClassSizesMax];
+  int total = 0;
+  for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+    size_t size = Static::sizemap()->class_to_size(cl);
+    wanted[cl] = std::min<size_t>(kPerCpuClassBytes / size, kMaxPerCpuLength);
+    total += wanted[cl];
+  }
+  int next = kHeaderSlots;
+  for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+    int capacity = wanted[cl];
+    if (total > kAvailableSlots) {
+      capacity = static_cast<int64>(capacity) * kAvailableSlots / total;
+    }
+    begin_[cl] = next;
+    capacity_[cl] = capacity;
+    next += capacity;
+  }
+  ASSERT(next <= (1 << kSlabShift) / sizeof(void*));
+
+  slabs_ = slabs;
+  num_cpus_ = ncpus;
+  active_ = true;
+}
+
+void CpuCache::InitThread() {
+  if (!active_ || rseq_abi_ != NULL) {
+    return;
+  }
+  KernelRseq* rseq;
+  if (LibcRegistersRseq()) {
+    char* tp;
+    asm("movq %%fs:0, %0" : "=r" (tp));
+    rseq = reinterpret_cast<KernelRseq*>(tp + __rseq_offset);
+  } else {
+    if (syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 0,
+                TCMALLOC_RSEQ_SIG) != 0) {
+      return;
+    }
+    rseq = reinterpret_cast<KernelRseq*>(&own_rseq);
+  }
+  // Negative cpu ids mean registration failed for this thread.
+  if (static_cast<int32_t>(rseq->cpu_id) < 0) {
+    return;
+  }
+  rseq_abi_ = rseq;
+}
+
+void CpuCache::EnsureHeader(uint32 cl) {
+  const uint32_t cpu = *static_cast<volatile uint32_t*>(&rseq_abi_->cpu_id);
+  if (cpu >= num_cpus_) {
+    return;
+  }
+  Header* hdr = reinterpret_cast<Header*>(
+      slabs_ + (static_cast<uintptr_t>(cpu) << kSlabShift)) + cl;
+  if (hdr->end != 0) {
+    return;
+  }
+  Header init;
+  init.current = begin_[cl];
+  init.end = begin_[cl] + capacity_[cl];
+  init.begin = begin_[cl];
+  init.unused = 0;
+  base::subtle::Atomic64 value;
+  memcpy(&value, &init, sizeof(value));
+  // A zero header fails every rseq operation, so installing the
+  // initial value with a single CAS cannot race with them.  If another
+  // thread got here first, its (possibly already used) header wins.
+  base::subtle::Acquire_CompareAndSwap(
+      reinterpret_cast<volatile base::subtle::Atomic64*>(hdr), 0, value);
+}
+
+void CpuCache::GetStats(uint64_t* total_bytes, uint64_t* class_count) {
+  if (!active_) {
+    return;
+  }
+  for (int cpu = 0; cpu < num_cpus_; cpu++) {
+    const Header* hdrs = reinterpret_cast<const Header*>(
+        slabs_ + (static_cast<uintptr_t>(cpu) << kSlabShift));
+    for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+      const volatile Header* hdr = &hdrs[cl];
+      const int length = hdr->current - hdr->begin;
+      if (length <= 0) {
+        continue;
+      }
+      *total_bytes += static_cast<uint64_t>(length) *
+          Static::sizemap()->ByteSizeForClass(cl);
+      if (class_count) {
+        class_count[cl] += length;
+      }
+    }
+  }
+}
+
+void CpuCache::Drain() {
+  if (!active_) {
+    return;
+  }
+  InitThread();
+  if (rseq_abi_ == NULL) {
+    return;
+  }
+  cpu_set_t saved;
+  if (sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+    return;
+  }
+  for (int cpu = 0; cpu < num_cpus_ && cpu < CPU_SETSIZE; cpu++) {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) != 0) {
+      continue;
+    }
+    DrainCurrentCpu();
+  }
+  sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+void CpuCache::DrainCurrentCpu() {
+  for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+    const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+    // Other threads may keep filling the cache while we empty it; take
+    // out no more than it holds.
+    int left = capacity_[cl];
+    while (left > 0) {
+      void *head, *tail;
+      const int count = PopBatch(cl, batch_size, &head, &tail);
+      if (count == 0) {
+        break;
+      }
+      const uint32_t cpu = rseq_abi_->cpu_id;
+      Static::central_freelist(cl, cpu, Static::NumaNodeOfCpu(cpu))->
+          InsertRange(head, tail, count);
+      left -= count;
+    }
+  }
+}
+
+#else  // !TCMALLOC_PERCPU_RSEQ
+
+void CpuCache::InitModule() {
+  active_ = false;
+}
+
+void CpuCache::Drain() {
+}
+
+void CpuCache::DrainCurrentCpu() {
+}
+
+void CpuCache::InitThread() {
+}
+
+void CpuCache::EnsureHeader(uint32 cl) {
+}
+
+void CpuCache::GetStats(uint64_t* total_bytes, uint64_t* class_count) {
+}
+
+#endif  // TCMALLOC_PERCPU_RSEQ
+
+int CpuCache::PopBatch(uint32 cl, int N, void** head, void** tail) {
+  void* list = NULL;
+  void* last = NULL;
+  int count = 0;
+  void* ptr;
+  while (count < N && TryPop(cl, &ptr)) {
+    if (last == NULL) last = ptr;
+    SLL_Push(&list, ptr);
+    count++;
+  }
+  *head = list;
+  *tail = last;
+  return count;
+}
+
+void* CpuCache::AllocateSlow(ThreadCache* heap, uint32 cl, size_t size,
+                             void *(*oom_handler)(size_t size)) {
+#ifdef TCMALLOC_PERCPU_RSEQ
+  if (rseq_abi_ == NULL) {
+    return heap->Allocate(size, cl, oom_handler);
+  }
+  EnsureHeader(cl);
+
+  const int batch_size = std::min<int>(
+      Static::sizemap()->num_objects_to_move(cl), capacity_[cl]);
+  void *start, *end;
+  const uint32_t cpu = rseq_abi_->cpu_id;
+  CentralFreeList* central =
+      Static::central_freelist(cl, cpu, Static::NumaNodeOfCpu(cpu));
+  int fetch_count = central->RemoveRange(&start, &end, batch_size);
+  if (fetch_count == 0) {
+    ASSERT(start == NULL);
+    return oom_handler(size);
+  }
+
+  // Keep the first object for the caller and cache the others on
+  // whatever CPU we are running on now.  Whatever does not fit goes
+  // straight back.
+  void* rv = start;
+  void* ptr = SLL_Next(start);
+  fetch_count--;
+  while (fetch_count > 0) {
+    void* next = SLL_Next(ptr);
+    if (!TryPush(cl, ptr)) {
+      break;
+    }
+    ptr = next;
+    fetch_count--;
+  }
+  if (fetch_count > 0) {
+    central->InsertRange(ptr, end, fetch_count);
+  }
+  return rv;
+#else
+  return heap->Allocate(size, cl, oom_handler);
+#endif
+}
+
+void CpuCache::DeallocateSlow(ThreadCache* heap, void* ptr, uint32 cl) {
+#ifdef TCMALLOC_PERCPU_RSEQ
+  if (rseq_abi_ == NULL) {
+    heap->Deallocate(ptr, cl);
+    return;
+  }
+  EnsureHeader(cl);
+  if (TryPush(cl, ptr)) {
+    return;
+  }
+
+  // The cache of this class is full.  Move a batch worth of objects to
+  // the central cache to make room.
+  const uint32_t cpu = rseq_abi_->cpu_id;
+  CentralFreeList* central =
+      Static::central_freelist(cl, cpu, Static::NumaNodeOfCpu(cpu));
+  void *head, *tail;
+  int count = PopBatch(cl, Static::sizemap()->num_objects_to_move(cl),
+                       &head, &tail);
+  if (count > 0) {
+    central->InsertRange(head, tail, count);
+  }
+  if (TryPush(cl, ptr)) {
+    return;
+  }
+  SLL_SetNext(ptr, NULL);
+  central->InsertRange(ptr, ptr, 1);
+#else
+  heap->Deallocate(ptr, cl);
+#endif
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,299 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Per-CPU front-end caches.
+//
+// When enabled (TCMALLOC_PERCPU_CACHES=true) small objects are cached
+// in per-CPU arrays instead of per-thread free lists.  The arrays are
+// manipulated inside Linux restartable sequences (rseq): if the thread
+// is preempted, migrated or interrupted by a signal before the
+// committing store, the kernel restarts the operation, so no locks or
+// atomic instructions are needed on the fast path.  Memory held by the
+// front-end is then bounded by the number of cores rather than by the
+// number of threads.
+//
+// Each CPU owns a slab of 1 << kSlabShift bytes.  The beginning of the
+// slab holds one Header per size class; the rest is carved into
+// per-class arrays of object pointers.  A header describes its array
+// as slot indexes relative to the start of the slab:
+//
+//   [begin, current)  cached objects (current-1 is the top)
+//   [current, end)    free slots
+//
+// A zeroed header (begin == current == end == 0) is both empty and
+// full, so the headers of CPUs which never allocated need no
+// initialization.  They are lazily set up by the slow path.
+//
+// Size classes that are not given any per-CPU capacity, threads for
+// which rseq could not be registered and platforms without rseq
+// support all keep using ThreadCache.
+
+#ifndef TCMALLOC_CPU_CACHE_H_
+#define TCMALLOC_CPU_CACHE_H_
+
+#include "config.h"
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint16_t, uint64_t
+#endif
+#include "base/basictypes.h"
+#include "common.h"
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__) && \
+    defined(__ELF__) && defined(HAVE_TLS) && !defined(TCMALLOC_NO_PERCPU)
+#define TCMALLOC_PERCPU_RSEQ 1
+#endif
+
+namespace tcmalloc {
+
+class ThreadCache;
+
+class CpuCache {
+ public:
+  // Per-CPU slabs are 256 KiB, i.e. up to 32768 pointer slots.
+  static const int kSlabShift = 18;
+
+  // Called from Static::InitStaticVars() with pageheap_lock held.
+  static void InitModule();
+
+  // Registers the calling thread with the kernel rseq interface, if
+  // needed.  Called when the thread's ThreadCache is created.
+  static void InitThread();
+
+  // Returns true iff objects of class "cl" are cached per-CPU.  This is
+  // a single load and is false for every class if the per-CPU mode is
+  // off.
+  static bool UsesClass(uint32 cl) {
+#ifdef TCMALLOC_PERCPU_RSEQ
+    return capacity_[cl] != 0;
+#else
+    return false;
+#endif
+  }
+
+  // Returns true iff the per-CPU mode is on.
+  static bool IsActive() { return active_; }
+
+  // Allocates an object of class "cl" and byte size "size".  Falls back
+  // to "heap" if the calling thread may not use the per-CPU caches.
+  // REQUIRES: UsesClass(cl)
+  static void* Allocate(ThreadCache* heap, uint32 cl, size_t size,
+                        void *(*oom_handler)(size_t size));
+
+  // Frees an object of class "cl".  Falls back to "heap" if the
+  // calling thread may not use the per-CPU caches.
+  // REQUIRES: UsesClass(cl)
+  static void Deallocate(ThreadCache* heap, void* ptr, uint32 cl);
+
+  // Adds to *total_bytes the bytes sitting in all per-CPU caches and,
+  // if class_count is not NULL, the number of cached objects of each
+  // size class to class_count[cl].  The result is only approximate,
+  // since the caches are modified without locks.
+  static void GetStats(uint64_t* total_bytes, uint64_t* class_count);
+
+  // Moves the objects cached for every CPU to the central lists, so
+  // that the spans they keep in use can go back to the page heap.  The
+  // calling thread runs on each CPU in turn to empty its slab; CPUs it
+  // may not run on keep their objects.
+  static void Drain();
+
+  // Returns the number of CPUs for which slabs were set up.
+  static int num_cpus() { return num_cpus_; }
+
+ private:
+  struct Header {
+    uint16_t current;
+    uint16_t end;
+    uint16_t begin;
+    uint16_t unused;
+  };
+
+  static void* AllocateSlow(ThreadCache* heap, uint32 cl, size_t size,
+                            void *(*oom_handler)(size_t size));
+  static void DeallocateSlow(ThreadCache* heap, void* ptr, uint32 cl);
+
+  // Sets up the header of class "cl" for the CPU the thread is
+  // currently running on, unless that was already done.
+  static void EnsureHeader(uint32 cl);
+
+  // Pops up to N objects of class "cl" from the current CPU and
+  // returns them as a linked list.  Returns the number popped.
+  static int PopBatch(uint32 cl, int N, void** head, void** tail);
+
+  // Moves the objects cached for the CPU the thread is currently
+  // running on to the central lists.
+  static void DrainCurrentCpu();
+
+  static inline bool TryPop(uint32 cl, void** result);
+  static inline bool TryPush(uint32 cl, void* ptr);
+
+#ifdef TCMALLOC_PERCPU_RSEQ
+  // Layout of the kernel's struct rseq that we depend upon.
+  struct KernelRseq {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+    uint32_t flags;
+  };
+
+  // rseq area registered for the calling thread, or NULL.
+  static __thread KernelRseq* rseq_abi_ ATTR_INITIAL_EXEC;
+
+  // Objects of class cl may use slots [begin, begin + capacity_[cl]).
+  static uint16_t capacity_[kClassSizesMax];
+  static uint16_t begin_[kClassSizesMax];
+#endif
+
+  static bool active_;
+  static int num_cpus_;
+  static char* slabs_;
+};
+
+#ifdef TCMALLOC_PERCPU_RSEQ
+
+// Signature that must precede abort handlers.  It is the same value
+// glibc registers, so we can share its rseq area.
+#define TCMALLOC_RSEQ_SIG 0x53053053
+
+// Emits the rseq critical section descriptor and abort handler.  The
+// abort handler is placed out of line and restarts the sequence from
+// "begin", which re-arms rseq_cs (the kernel clears it on abort).
+#define TCMALLOC_RSEQ_PROLOGUE                                   \
+  ".pushsection __rseq_cs, \"aw\"\n"                             \
+  ".balign 32\n"                                                 \
+  ".Lrseq_cs%=:\n"                                               \
+  ".long 0, 0\n"                                                 \
+  ".quad .Lrseq_start%=, .Lrseq_commit%= - .Lrseq_start%=, "     \
+  ".Lrseq_abort%=\n"                                             \
+  ".popsection\n"                                                \
+  ".pushsection __rseq_failure, \"ax\"\n"                        \
+  ".byte 0x0f, 0xb9, 0x3d\n"                                     \
+  ".long 0x53053053\n"                                           \
+  ".Lrseq_abort%=:\n"                                            \
+  "jmp .Lrseq_begin%=\n"                                         \
+  ".popsection\n"                                                \
+  ".Lrseq_begin%=:\n"                                            \
+  "leaq .Lrseq_cs%=(%%rip), %[slab]\n"                           \
+  "movq %[slab], 8(%[rseq])\n"                                   \
+  ".Lrseq_start%=:\n"                                            \
+  "movl 4(%[rseq]), %k[slab]\n"                                  \
+  "cmpl %[ncpus], %k[slab]\n"                                    \
+  "jae .Lrseq_fail%=\n"                                          \
+  "shlq $18, %[slab]\n"                                          \
+  "addq %[slabs], %[slab]\n"
+
+inline bool CpuCache::TryPop(uint32 cl, void** result) {
+  KernelRseq* rseq = rseq_abi_;
+  if (PREDICT_FALSE(rseq == NULL)) return false;
+  uintptr_t slab, current;
+  void* rv;
+  asm volatile(
+      TCMALLOC_RSEQ_PROLOGUE
+      "movzwl (%[slab], %[cl], 8), %k[current]\n"
+      "cmpw 4(%[slab], %[cl], 8), %w[current]\n"
+      "jbe .Lrseq_fail%=\n"
+      "movq -8(%[slab], %[current], 8), %[rv]\n"
+      "subl $1, %k[current]\n"
+      "movw %w[current], (%[slab], %[cl], 8)\n"
+      ".Lrseq_commit%=:\n"
+      "jmp .Lrseq_done%=\n"
+      ".Lrseq_fail%=:\n"
+      "xorl %k[rv], %k[rv]\n"
+      ".Lrseq_done%=:\n"
+      : [slab] "=&r" (slab), [current] "=&r" (current), [rv] "=&r" (rv)
+      : [rseq] "r" (rseq), [cl] "r" (static_cast<uintptr_t>(cl)),
+        [slabs] "m" (slabs_), [ncpus] "m" (num_cpus_)
+      : "cc", "memory");
+  COMPILE_ASSERT(kSlabShift == 18, rseq_asm_hardcodes_slab_shift);
+  *result = rv;
+  return rv != NULL;
+}
+
+inline bool CpuCache::TryPush(uint32 cl, void* ptr) {
+  KernelRseq* rseq = rseq_abi_;
+  if (PREDICT_FALSE(rseq == NULL)) return false;
+  uintptr_t slab, current;
+  int ok;
+  asm volatile(
+      TCMALLOC_RSEQ_PROLOGUE
+      "movzwl (%[slab], %[cl], 8), %k[current]\n"
+      "cmpw 2(%[slab], %[cl], 8), %w[current]\n"
+      "jae .Lrseq_fail%=\n"
+      "movq %[ptr], (%[slab], %[current], 8)\n"
+      "addl $1, %k[current]\n"
+      "movw %w[current], (%[slab], %[cl], 8)\n"
+      ".Lrseq_commit%=:\n"
+      "movl $1, %[ok]\n"
+      "jmp .Lrseq_done%=\n"
+      ".Lrseq_fail%=:\n"
+      "xorl %[ok], %[ok]\n"
+      ".Lrseq_done%=:\n"
+      : [slab] "=&r" (slab), [current] "=&r" (current), [ok] "=&r" (ok)
+      : [rseq] "r" (rseq), [cl] "r" (static_cast<uintptr_t>(cl)),
+        [ptr] "r" (ptr), [slabs] "m" (slabs_), [ncpus] "m" (num_cpus_)
+      : "cc", "memory");
+  return ok != 0;
+}
+
+#undef TCMALLOC_RSEQ_PROLOGUE
+
+#else  // !TCMALLOC_PERCPU_RSEQ
+
+inline bool CpuCache::TryPop(uint32 cl, void** result) {
+  return false;
+}
+
+inline bool CpuCache::TryPush(uint32 cl, void* ptr) {
+  return false;
+}
+
+#endif  // TCMALLOC_PERCPU_RSEQ
+
+inline ATTRIBUTE_ALWAYS_INLINE void* CpuCache::Allocate(
+    ThreadCache* heap, uint32 cl, size_t size,
+    void *(*oom_handler)(size_t size)) {
+  void* rv;
+  if (PREDICT_TRUE(TryPop(cl, &rv))) {
+    return rv;
+  }
+  return AllocateSlow(heap, cl, size, oom_handler);
+}
+
+inline ATTRIBUTE_ALWAYS_INLINE void CpuCache::Deallocate(
+    ThreadCache* heap, void* ptr, uint32 cl) {
+  if (PREDICT_TRUE(TryPush(cl, ptr))) {
+    return;
+  }
+  DeallocateSlow(heap, ptr, cl);
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_CPU_CACHE_H_
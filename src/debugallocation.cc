@@ -1331,6 +1331,17 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_new_nothrow(size_t size, const std::nothr
   return ptr;
 }
 
+// Blocks are checked against their exact size, so that is all the
+// size-returning functions report.
+extern "C" PERFTOOLS_DLL_DECL void* tc_new_size_returning(size_t size,
+                                                         size_t* actual_size) {
+  void* ptr = tc_new(size);
+  if (actual_size != NULL) {
+    *actual_size = size;
+  }
+  return ptr;
+}
+
 extern "C" PERFTOOLS_DLL_DECL void tc_delete(void* p) PERFTOOLS_NOTHROW {
   MallocHook::InvokeDeleteHook(p);
   DebugDeallocate(p, MallocBlock::kNewType, 0);
@@ -1581,3 +1592,37 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size) PERF
   MallocHook::InvokeNewHook(result, size);
   return result;
 }
+
+extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_size_returning(
+    size_t size, size_t* actual_size) PERFTOOLS_NOTHROW {
+  void* ptr = tc_malloc(size);
+  if (ptr != NULL && actual_size != NULL) {
+    *actual_size = size;
+  }
+  return ptr;
+}
+
+// Every object gets its own checks here, so batches save nothing.
+extern "C" PERFTOOLS_DLL_DECL size_t tc_malloc_batch(size_t size, size_t n,
+                                                     void** out) PERFTOOLS_NOTHROW {
+  size_t count = 0;
+  for (; count < n; count++) {
+    out[count] = tc_malloc(size);
+    if (out[count] == NULL) {
+      break;
+    }
+  }
+  return count;
+}
+
+extern "C" PERFTOOLS_DLL_DECL void tc_free_batch(void** ptrs, size_t n) PERFTOOLS_NOTHROW {
+  for (size_t i = 0; i < n; i++) {
+    tc_free(ptrs[i]);
+  }
+}
+
+// Blocks are checked against their exact size, so they never change
+// size in place.
+extern "C" PERFTOOLS_DLL_DECL int tc_try_expand(void* ptr, size_t new_size) PERFTOOLS_NOTHROW {
+  return 0;
+}
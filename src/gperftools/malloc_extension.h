@@ -181,6 +181,14 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      by the OS, they also count towards physical memory usage.
   //      This property is not writable.
   //
+  // "tcmalloc.central_cache_released_bytes"
+  //      Number of bytes of partly used spans of the central cache
+  //      that have been released back to the OS (see
+  //      TCMALLOC_SPAN_BITMAPS).  They are counted in
+  //      "tcmalloc.pageheap_unmapped_bytes" in GetStats(), not in
+  //      "tcmalloc.central_cache_free_bytes".  This property is not
+  //      writable.
+  //
   // "tcmalloc.transfer_cache_free_bytes"
   //      Number of free bytes that are waiting to be transfered between
   //      the central cache and a thread cache. They always count
@@ -194,6 +202,26 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      is swapped out by the OS, they also count towards physical
   //      memory usage. This property is not writable.
   //
+  // "tcmalloc.cpu_cache_free_bytes"
+  //      Number of free bytes in per-CPU caches (see
+  //      TCMALLOC_PERCPU_CACHES).  Zero unless per-CPU caching is
+  //      enabled.  This property is not writable.
+  //
+  // "tcmalloc.large_span_cache_bytes"
+  //      Number of bytes in freed large spans kept for reuse (see
+  //      TCMALLOC_LARGE_SPAN_CACHE_BYTES).  This property is not
+  //      writable.
+  //
+  // "tcmalloc.large_span_cache_budget"
+  //      The most bytes the large span cache may hold, 0 if it is
+  //      off.  This property is not writable.
+  //
+  // "tcmalloc.large_span_cache_hits"
+  // "tcmalloc.large_span_cache_misses"
+  //      Number of allocations of 1MB to 64MB that were and were not
+  //      served from the large span cache.  These properties are not
+  //      writable.
+  //
   // "tcmalloc.pageheap_free_bytes"
   //      Number of bytes in free, mapped pages in page heap.  These
   //      bytes can be used to fulfill allocation requests.  They
@@ -210,6 +238,67 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //        virtual memory usage, and depending on the OS, typically
   //        do not count towards physical memory usage.  This property
   //        is not writable.
+  //
+  // "tcmalloc.hugepage_aware"
+  //      1 if the page heap packs spans into hugepages and releases
+  //      memory in whole hugepages only (see TCMALLOC_HUGEPAGE_AWARE),
+  //      0 otherwise.  This property is not writable.
+  //
+  // "tcmalloc.background_release"
+  //      1 if free memory is returned to the OS by a background thread
+  //      instead of from free() (see TCMALLOC_BACKGROUND_RELEASE), 0
+  //      otherwise.  Setting it to 1 starts the thread.
+  //
+  // "tcmalloc.release_madv_free"
+  //      1 if memory is returned to the OS with MADV_FREE, which lets
+  //      the kernel take it back only under memory pressure, 0 if with
+  //      MADV_DONTNEED or otherwise (see TCMALLOC_RELEASE_MADV_FREE).
+  //      Can be set on Linux only.
+  //
+  // "tcmalloc.pageheap_reuse_count"
+  // "tcmalloc.pageheap_total_reuse_bytes"
+  //      Number of spans, and bytes, taken from memory returned to the
+  //      OS for new allocations, which faults it back in.  These
+  //      properties are not writable.
+  //
+  // "tcmalloc.pageheap_quick_reuse_count"
+  //      Number of those spans reused within 2 release ticks of being
+  //      returned to the OS.  A release tick is 100ms with background
+  //      release and one scavenge from free() otherwise.  This property
+  //      is not writable.
+  //
+  // "tcmalloc.pageheap_total_reuse_ticks"
+  //      Sum over those spans of the release ticks from their release
+  //      to their reuse.  This property is not writable.
+  //
+  // "tcmalloc.release_delay_ticks"
+  //      Extra release ticks a free span must wait before it is
+  //      returned to the OS.  Raised when released spans are reused
+  //      quickly, and lowered when they are not.  This property is not
+  //      writable.
+  //
+  // "tcmalloc.numa_nodes"
+  //      Number of NUMA nodes the page heap and central caches are
+  //      partitioned into (see TCMALLOC_NUMA_AWARE); 1 when the mode is
+  //      off.  This property is not writable.
+  //
+  // "tcmalloc.size_class_regions"
+  //      1 if the spans of each small size class are carved from an
+  //      address range of their own (see TCMALLOC_SIZE_CLASS_REGIONS),
+  //      0 otherwise.  This property is not writable.
+  //
+  // "tcmalloc.span_bitmaps"
+  //      1 if small size classes keep their free objects in bitmaps
+  //      outside their spans (see TCMALLOC_SPAN_BITMAPS), 0 otherwise.
+  //      This property is not writable.
+  //
+  // "tcmalloc.numa_node<N>_system_bytes"
+  // "tcmalloc.numa_node<N>_free_bytes"
+  // "tcmalloc.numa_node<N>_unmapped_bytes"
+  //      The "generic.heap_size", "tcmalloc.pageheap_free_bytes" and
+  //      "tcmalloc.pageheap_unmapped_bytes" figures for node N alone,
+  //      where 0 <= N < "tcmalloc.numa_nodes".  These properties are
+  //      not writable.
   // -------------------------------------------------------------------
 
   // Get the named "property"'s value.  Returns true if the property
@@ -369,6 +458,9 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //                      and not returned to tcmalloc.
   //
   // "tcmalloc.thread" - tcmalloc's per-thread caches. Never unmapped.
+  //
+  // "tcmalloc.cpu" - tcmalloc's per-CPU caches, only reported when
+  //          they are enabled. Never unmapped.
   virtual void GetFreeListSizes(std::vector<FreeListInfo>* v);
 
   // Get a list of stack traces of sampled allocation points.  Returns
@@ -404,6 +496,22 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // have an empty cache but will not need to pay to reconstruct the
   // cache data structures.
   virtual void MarkThreadTemporarilyIdle();
+
+  // Allocates n objects of "size" bytes into out[0..n-1] with malloc(),
+  // and returns the number allocated, which is less than n only if
+  // memory ran out.  tcmalloc does the work of a malloc() call once per
+  // batch rather than once per object.
+  virtual size_t MallocBatch(size_t size, size_t n, void** out);
+
+  // Frees the n objects in ptrs[] with free().  Runs of objects of the
+  // same size are freed together.
+  virtual void FreeBatch(void** ptrs, size_t n);
+
+  // Resizes the block at p, which came from malloc(), to hold new_size
+  // bytes without moving it.  Returns false, leaving the block as it
+  // was, if that cannot be done.  Callers fall back to realloc() or to
+  // allocating, copying and freeing.
+  virtual bool TryResize(void* p, size_t new_size);
 };
 
 namespace base {
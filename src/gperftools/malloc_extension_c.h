@@ -81,6 +81,9 @@ PERFTOOLS_DLL_DECL size_t MallocExtension_GetEstimatedAllocatedSize(size_t size)
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetAllocatedSize(const void* p);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetThreadCacheSize(void);
 PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadTemporarilyIdle(void);
+PERFTOOLS_DLL_DECL size_t MallocExtension_MallocBatch(size_t size, size_t n, void** out);
+PERFTOOLS_DLL_DECL void MallocExtension_FreeBatch(void** ptrs, size_t n);
+PERFTOOLS_DLL_DECL int MallocExtension_TryResize(void* p, size_t new_size);
 
 /*
  * NOTE: These enum values MUST be kept in sync with the version in
@@ -0,0 +1,154 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config.h"
+#include "large_span_cache.h"
+
+#include "base/commandlineflags.h"      // for StringToLongLong
+#include "getenv_safe.h"                // for TCMallocGetenvSafe
+#include "internal_logging.h"           // for ASSERT
+#include "page_heap.h"                  // for PageHeap
+#include "span.h"                       // for Span
+#include "static_vars.h"                // for Static
+
+namespace tcmalloc {
+
+size_t LargeSpanCache::budget_ = 0;
+volatile AtomicWord LargeSpanCache::bytes_ = 0;
+volatile AtomicWord LargeSpanCache::hits_ = 0;
+volatile AtomicWord LargeSpanCache::misses_ = 0;
+volatile AtomicWord
+    LargeSpanCache::slots_[kNumBuckets][kSlotsPerBucket] = {};
+
+void LargeSpanCache::InitModule() {
+  const long long budget = commandlineflags::StringToLongLong(
+      TCMallocGetenvSafe("TCMALLOC_LARGE_SPAN_CACHE_BYTES"), 0);
+  budget_ = budget > 0 ? budget : 0;
+}
+
+int LargeSpanCache::BucketFor(Length n) {
+  ASSERT(n >= kMinPages && n <= kMaxPages);
+  int lg = 0;
+  while ((n >> (lg + 1)) != 0) lg++;
+  int min_lg = 0;
+  while ((kMinPages >> (min_lg + 1)) != 0) min_lg++;
+  // The two bits below the leading one pick the quarter of the doubling.
+  const int quarter = lg >= 2 ? (n >> (lg - 2)) & 3 : 0;
+  return (lg - min_lg) * kBucketsPerDoubling + quarter;
+}
+
+void LargeSpanCache::Add(volatile AtomicWord* counter, AtomicWord delta) {
+  AtomicWord old = base::subtle::NoBarrier_Load(counter);
+  for (;;) {
+    AtomicWord prev =
+        base::subtle::NoBarrier_CompareAndSwap(counter, old, old + delta);
+    if (prev == old) return;
+    old = prev;
+  }
+}
+
+Span* LargeSpanCache::Get(Length n, int node) {
+  if (budget_ == 0 || n < kMinPages || n > kMaxPages) return NULL;
+  volatile AtomicWord* slots = slots_[BucketFor(n)];
+  for (int i = 0; i < kSlotsPerBucket; i++) {
+    Span* span = reinterpret_cast<Span*>(
+        base::subtle::Acquire_Load(&slots[i]));
+    if (span == NULL || span->length != n || span->node != node) continue;
+    if (base::subtle::Acquire_CompareAndSwap(
+            &slots[i], reinterpret_cast<AtomicWord>(span), 0) !=
+        reinterpret_cast<AtomicWord>(span)) {
+      continue;
+    }
+    Add(&bytes_, -static_cast<AtomicWord>(span->length << kPageShift));
+    span->cached = 0;
+    // Between the check and the swap the span may have been taken and
+    // another one of the same bucket put in the slot, reusing its Span.
+    if (span->length != n || span->node != node) {
+      if (!Put(span)) {
+        SpinLockHolder h(Static::pageheap_lock());
+        Static::pageheap()->Delete(span);
+      }
+      continue;
+    }
+    Add(&hits_, 1);
+    return span;
+  }
+  Add(&misses_, 1);
+  return NULL;
+}
+
+bool LargeSpanCache::Put(Span* span) {
+  const Length n = span->length;
+  if (budget_ == 0 || n < kMinPages || n > kMaxPages) return false;
+  ASSERT(!span->sample);
+  ASSERT(span->sizeclass == 0);
+  const AtomicWord size = n << kPageShift;
+  AtomicWord old = base::subtle::NoBarrier_Load(&bytes_);
+  for (;;) {
+    if (static_cast<size_t>(old + size) > budget_) return false;
+    AtomicWord prev =
+        base::subtle::NoBarrier_CompareAndSwap(&bytes_, old, old + size);
+    if (prev == old) break;
+    old = prev;
+  }
+  span->cached = 1;
+  span->known_zero = 0;
+  volatile AtomicWord* slots = slots_[BucketFor(n)];
+  for (int i = 0; i < kSlotsPerBucket; i++) {
+    if (base::subtle::NoBarrier_Load(&slots[i]) == 0 &&
+        base::subtle::Release_CompareAndSwap(
+            &slots[i], 0, reinterpret_cast<AtomicWord>(span)) == 0) {
+      return true;
+    }
+  }
+  span->cached = 0;
+  Add(&bytes_, -size);
+  return false;
+}
+
+size_t LargeSpanCache::Flush() {
+  size_t flushed = 0;
+  for (int b = 0; b < kNumBuckets; b++) {
+    for (int i = 0; i < kSlotsPerBucket; i++) {
+      Span* span = reinterpret_cast<Span*>(
+          base::subtle::Acquire_AtomicExchange(&slots_[b][i], 0));
+      if (span == NULL) continue;
+      const AtomicWord size = span->length << kPageShift;
+      Add(&bytes_, -size);
+      flushed += size;
+      span->cached = 0;
+      SpinLockHolder h(Static::pageheap_lock());
+      Static::pageheap()->Delete(span);
+    }
+  }
+  return flushed;
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,121 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// A lock-free cache of recently freed large spans.
+//
+// Large allocations go straight to the page heap, under
+// pageheap_lock.  When the heap decommits aggressively or the
+// scavenger has released the pages, each new allocation of a big
+// buffer also faults all of its pages back in.  With
+// TCMALLOC_LARGE_SPAN_CACHE_BYTES set, freed spans of kMinPages to
+// kMaxPages pages (1 MiB to 64 MiB) are instead parked here, still
+// committed and still "in use" as far as the page heap is concerned,
+// and handed out again to the next allocation of exactly the same
+// number of pages.
+//
+// The cache is an array of slots holding Span pointers, grouped in
+// buckets of four per doubling of the page count.  Slots are claimed
+// and emptied with compare-and-swap, so neither Get() nor Put() takes
+// a lock.  The bytes held are bounded by the budget given in the
+// environment variable; spans which don't fit go to the page heap as
+// before.
+
+#ifndef TCMALLOC_LARGE_SPAN_CACHE_H_
+#define TCMALLOC_LARGE_SPAN_CACHE_H_
+
+#include "config.h"
+#include <stddef.h>                     // for size_t, NULL
+#ifdef HAVE_STDINT_H
+#include <stdint.h>                     // for uint64_t
+#endif
+#include "base/atomicops.h"             // for AtomicWord
+#include "base/basictypes.h"
+#include "common.h"                     // for Length, kPageShift
+
+namespace tcmalloc {
+
+struct Span;
+
+class LargeSpanCache {
+ public:
+  static const Length kMinPages = Length(1) << (20 - kPageShift);
+  static const Length kMaxPages = Length(64) << (20 - kPageShift);
+
+  // Reads the budget from TCMALLOC_LARGE_SPAN_CACHE_BYTES.  Called from
+  // Static::InitStaticVars().
+  static void InitModule();
+
+  // Returns the most bytes the cache may hold, 0 if it is off.
+  static size_t budget() { return budget_; }
+
+  // Returns a cached span of exactly n pages that was allocated on
+  // NUMA node "node", or NULL if there is none.
+  static Span* Get(Length n, int node);
+
+  // Caches "span", an in-use, unsampled large span the application
+  // has freed.  Returns false if it is not of a cached length or does
+  // not fit in the budget, in which case the caller must give it to the
+  // page heap.
+  static bool Put(Span* span);
+
+  // Gives every cached span back to the page heap and returns the
+  // number of bytes that were cached.  pageheap_lock is only taken
+  // while each span is given back.
+  // REQUIRES: pageheap_lock is not held
+  static size_t Flush();
+
+  // Bytes currently cached, and the number of allocations of a
+  // cacheable length that were and were not served from the cache.
+  static uint64_t bytes() { return base::subtle::NoBarrier_Load(&bytes_); }
+  static uint64_t hits() { return base::subtle::NoBarrier_Load(&hits_); }
+  static uint64_t misses() { return base::subtle::NoBarrier_Load(&misses_); }
+
+ private:
+  static const int kBucketsPerDoubling = 4;
+  static const int kNumBuckets = 6 * kBucketsPerDoubling + 1;
+  static const int kSlotsPerBucket = 4;
+
+  // Returns the bucket of spans of n pages.
+  // REQUIRES: kMinPages <= n <= kMaxPages
+  static int BucketFor(Length n);
+
+  // Atomically adds "delta" to *counter.
+  static void Add(volatile AtomicWord* counter, AtomicWord delta);
+
+  static size_t budget_;
+  static volatile AtomicWord bytes_;
+  static volatile AtomicWord hits_;
+  static volatile AtomicWord misses_;
+  static volatile AtomicWord slots_[kNumBuckets][kSlotsPerBucket];
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_LARGE_SPAN_CACHE_H_
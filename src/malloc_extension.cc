@@ -33,6 +33,7 @@
 
 #include <config.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #if defined HAVE_STDINT_H
@@ -201,6 +202,27 @@ void MallocExtension::MarkThreadTemporarilyIdle() {
   // Default implementation does nothing
 }
 
+size_t MallocExtension::MallocBatch(size_t size, size_t n, void** out) {
+  size_t count = 0;
+  for (; count < n; count++) {
+    out[count] = malloc(size);
+    if (out[count] == NULL) {
+      break;
+    }
+  }
+  return count;
+}
+
+void MallocExtension::FreeBatch(void** ptrs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    free(ptrs[i]);
+  }
+}
+
+bool MallocExtension::TryResize(void* p, size_t new_size) {
+  return false;
+}
+
 // The current malloc extension object.
 
 static MallocExtension* current_instance;
@@ -379,6 +401,10 @@ C_SHIM(GetEstimatedAllocatedSize, size_t, (size_t size), (size));
 C_SHIM(GetAllocatedSize, size_t, (const void* p), (p));
 C_SHIM(GetThreadCacheSize, size_t, (void), ());
 C_SHIM(MarkThreadTemporarilyIdle, void, (void), ());
+C_SHIM(MallocBatch, size_t, (size_t size, size_t n, void** out),
+       (size, n, out));
+C_SHIM(FreeBatch, void, (void** ptrs, size_t n), (ptrs, n));
+C_SHIM(TryResize, int, (void* p, size_t new_size), (p, new_size));
 
 // Can't use the shim here because of the need to translate the enums.
 extern "C"
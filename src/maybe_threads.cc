@@ -39,6 +39,7 @@
 
 #include "config.h"
 #include <assert.h>
+#include <errno.h>     // for ENOSYS
 #include <string.h>    // for memcmp
 #include <stdio.h>     // for __isthreaded on FreeBSD
 // We don't actually need strings. But including this header seems to
@@ -69,6 +70,9 @@ extern "C" {
       __THROW ATTRIBUTE_WEAK;
   int pthread_once(pthread_once_t *, void (*)(void))
       ATTRIBUTE_WEAK;
+  int pthread_create(pthread_t *, const pthread_attr_t *,
+                     void *(*)(void *), void *)
+      __THROW ATTRIBUTE_WEAK;
 #ifdef HAVE_FORK
   int pthread_atfork(void (*__prepare) (void),
                      void (*__parent) (void),
@@ -163,6 +167,15 @@ int perftools_pthread_once(pthread_once_t *ctl,
   }
 }
 
+int perftools_pthread_create(pthread_t *thread,
+                             void *(*start_routine) (void *), void *arg) {
+  if (pthread_create) {
+    return pthread_create(thread, NULL, start_routine, arg);
+  } else {
+    return ENOSYS;
+  }
+}
+
 #ifdef HAVE_FORK
 
 void perftools_pthread_atfork(void (*before)(),
@@ -50,6 +50,9 @@ void *perftools_pthread_getspecific(pthread_key_t key);
 int perftools_pthread_setspecific(pthread_key_t key, void *val);
 int perftools_pthread_once(pthread_once_t *ctl,
                            void  (*init_routine) (void));
+// Returns non-zero (and starts nothing) when the app has no pthreads.
+int perftools_pthread_create(pthread_t *thread,
+                             void *(*start_routine) (void *), void *arg);
 
 // Our wrapper for pthread_atfork. Does _nothing_ when there are no
 // threads. See static_vars.cc:SetupAtForkLocksHandler for only user
@@ -0,0 +1,215 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "config.h"
+#include "numa.h"
+
+#include <stdlib.h>                     // for strtol
+#include <string.h>                     // for memcpy, memset
+#ifdef __linux__
+#include <errno.h>                      // for errno, EINTR
+#include <fcntl.h>                      // for open
+#include <sched.h>                      // for sched_getcpu
+#include <unistd.h>                     // for read, close
+#endif
+
+#include "base/commandlineflags.h"
+#include "getenv_safe.h"                // for TCMallocGetenvSafe
+#include "internal_logging.h"           // for ASSERT
+#include "system-alloc.h"
+
+namespace tcmalloc {
+
+void NumaTopology::Init() {
+  num_nodes_ = 1;
+  fake_ = false;
+  memset(kernel_node_, 0, sizeof(kernel_node_));
+  memset(cpu_node_, 0, sizeof(cpu_node_));
+
+  const char* fake = TCMallocGetenvSafe("TCMALLOC_NUMA_FAKE_NODES");
+  if (fake != NULL) {
+    int nodes = strtol(fake, NULL, 10);
+    if (nodes > kMaxNumaNodes) nodes = kMaxNumaNodes;
+    if (nodes <= 1) return;
+    for (int cpu = 0; cpu < kMaxCpus; cpu++) {
+      cpu_node_[cpu] = cpu % nodes;
+    }
+    num_nodes_ = nodes;
+    fake_ = true;
+    return;
+  }
+
+  if (tcmalloc::commandlineflags::StringToBool(
+          TCMallocGetenvSafe("TCMALLOC_NUMA_AWARE"), false)) {
+    if (!ReadSysfs()) {
+      num_nodes_ = 1;
+      memset(cpu_node_, 0, sizeof(cpu_node_));
+    }
+  }
+}
+
+#ifdef __linux__
+
+// Reads up to size-1 bytes of a small file into buf, NUL terminated.
+static bool ReadSmallFile(const char* path, char* buf, size_t size) {
+  int fd;
+  do {
+    fd = open(path, O_RDONLY);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0) return false;
+  size_t len = 0;
+  while (len < size - 1) {
+    ssize_t r = read(fd, buf + len, size - 1 - len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    len += r;
+  }
+  close(fd);
+  buf[len] = '\0';
+  return len > 0;
+}
+
+// Calls fn(arg, i) for every number i of a list like "0-3,8,10-11".
+static void ForEachInList(const char* list,
+                          void (*fn)(void* arg, int i), void* arg) {
+  const char* p = list;
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    const long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    for (long i = first; i <= last; i++) {
+      fn(arg, static_cast<int>(i));
+    }
+    p = end;
+    if (*p != ',') break;
+    p++;
+  }
+}
+
+// Most nodes we look at; the kernel supports up to 1024.
+static const int kMaxKernelNodes = 1024;
+
+namespace {
+struct NodeListState {
+  int kernel_node[kMaxKernelNodes];
+  int count;
+};
+
+struct CpuListState {
+  uint8* cpu_node;
+  int node;
+};
+}  // namespace
+
+static void AddNode(void* arg, int kernel_node) {
+  NodeListState* state = static_cast<NodeListState*>(arg);
+  if (state->count < kMaxKernelNodes) {
+    state->kernel_node[state->count++] = kernel_node;
+  }
+}
+
+static void AddCpu(void* arg, int cpu) {
+  CpuListState* state = static_cast<CpuListState*>(arg);
+  if (cpu >= 0 && cpu < NumaTopology::kMaxCpus) {
+    state->cpu_node[cpu] = state->node;
+  }
+}
+
+// Writes "/sys/devices/system/node/node<n>/cpulist" into buf.
+static void CpuListPath(int n, char* buf) {
+  static const char kPrefix[] = "/sys/devices/system/node/node";
+  static const char kSuffix[] = "/cpulist";
+  char digits[16];
+  int len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  memcpy(buf, kPrefix, sizeof(kPrefix) - 1);
+  buf += sizeof(kPrefix) - 1;
+  while (len > 0) *buf++ = digits[--len];
+  memcpy(buf, kSuffix, sizeof(kSuffix));
+}
+
+bool NumaTopology::ReadSysfs() {
+  char buf[4096];
+  if (!ReadSmallFile("/sys/devices/system/node/online", buf, sizeof(buf))) {
+    return false;
+  }
+  NodeListState nodes;
+  nodes.count = 0;
+  ForEachInList(buf, AddNode, &nodes);
+  if (nodes.count <= 1) return false;
+
+  // On machines with more nodes than we support, several kernel nodes
+  // share our node; their memory is bound to the first of them.
+  num_nodes_ = nodes.count < kMaxNumaNodes ? nodes.count : kMaxNumaNodes;
+  for (int i = 0; i < num_nodes_; i++) {
+    kernel_node_[i] = nodes.kernel_node[i];
+  }
+  for (int i = 0; i < nodes.count; i++) {
+    char path[64];
+    CpuListPath(nodes.kernel_node[i], path);
+    if (!ReadSmallFile(path, buf, sizeof(buf))) return false;
+    CpuListState cpus;
+    cpus.cpu_node = cpu_node_;
+    cpus.node = i % kMaxNumaNodes;
+    ForEachInList(buf, AddCpu, &cpus);
+  }
+  return true;
+}
+
+int NumaTopology::CurrentNodeSlow() const {
+  const int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : NodeOfCpu(cpu);
+}
+
+#else  // !__linux__
+
+bool NumaTopology::ReadSysfs() {
+  return false;
+}
+
+int NumaTopology::CurrentNodeSlow() const {
+  return 0;
+}
+
+#endif  // __linux__
+
+void NumaTopology::BindMemory(void* start, size_t length, int node) const {
+  if (!binds_memory()) return;
+  ASSERT(0 <= node && node < num_nodes_);
+  TCMalloc_SystemBindToNode(start, length, kernel_node_[node]);
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,102 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// NUMA topology as seen by the allocator.
+//
+// With TCMALLOC_NUMA_AWARE=true on a machine with several NUMA nodes,
+// the page heap keeps separate free lists per node, memory it gets from
+// the system for a node is bound to that node, and every size class has
+// central free lists per node.  Threads use the lists of the node they
+// are running on.  Nodes are numbered 0..num_nodes()-1 here, whatever
+// numbers the kernel gives them.
+//
+// TCMALLOC_NUMA_FAKE_NODES=N pretends there are N nodes, CPU c being on
+// node c % N, without binding any memory.  It allows the partitioned
+// mode to be exercised on single node machines.
+//
+// On single node machines, or when the mode is off, num_nodes() is 1 and
+// everything lives on node 0.
+
+#ifndef TCMALLOC_NUMA_H_
+#define TCMALLOC_NUMA_H_
+
+#include "config.h"
+#include <stddef.h>                     // for size_t
+#include "base/basictypes.h"
+#include "common.h"
+
+namespace tcmalloc {
+
+class NumaTopology {
+ public:
+  // CPUs above this are put on node 0.
+  static const int kMaxCpus = 1024;
+
+  // Reads the environment and, if asked to, the topology of the
+  // machine.  Must not allocate memory.
+  void Init();
+
+  int num_nodes() const { return num_nodes_; }
+
+  // Returns true iff memory of the nodes is actually placed on them,
+  // i.e. the topology is neither trivial nor fake.
+  bool binds_memory() const { return num_nodes_ > 1 && !fake_; }
+
+  // Returns the node of the CPU the calling thread is running on.
+  int CurrentNode() const {
+    if (PREDICT_TRUE(num_nodes_ <= 1)) return 0;
+    return CurrentNodeSlow();
+  }
+
+  int NodeOfCpu(unsigned cpu) const {
+    if (num_nodes_ <= 1 || cpu >= kMaxCpus) return 0;
+    return cpu_node_[cpu];
+  }
+
+  // Binds the not yet touched memory [start, start+length) to 'node'.
+  void BindMemory(void* start, size_t length, int node) const;
+
+ private:
+  int CurrentNodeSlow() const;
+
+  // Fills in the topology from /sys/devices/system/node.  Returns false
+  // if it is not available.
+  bool ReadSysfs();
+
+  int num_nodes_;
+  bool fake_;
+  // Kernel node number of each of our nodes.
+  int kernel_node_[kMaxNumaNodes];
+  uint8 cpu_node_[kMaxCpus];
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_NUMA_H_
@@ -36,9 +36,11 @@
 #include <inttypes.h>                   // for PRIuPTR
 #endif
 #include <errno.h>                      // for ENOMEM, errno
+#include <new>                          // for placement new
 #include <gperftools/malloc_extension.h>      // for MallocRange, etc
 #include "base/basictypes.h"
 #include "base/commandlineflags.h"
+#include "base/spinlock.h"              // for SpinLock
 #include "internal_logging.h"  // for ASSERT, TCMalloc_Printer, etc
 #include "page_heap_allocator.h"  // for PageHeapAllocator
 #include "static_vars.h"       // for Static
@@ -62,63 +64,304 @@ DEFINE_int64(tcmalloc_heap_limit_mb,
 
 namespace tcmalloc {
 
-PageHeap::PageHeap()
+PageHeap::PageHeap(SpinLock* lock)
     : pagemap_(MetaDataAlloc),
+      num_nodes_(1),
       scavenge_counter_(0),
       // Start scavenging at kMaxPages list
       release_index_(kMaxPages),
-      aggressive_decommit_(false) {
+      aggressive_decommit_(false),
+      hugepage_aware_(false),
+      background_release_(false),
+      lock_(lock),
+      growing_pages_(0),
+      release_tick_(0),
+      release_delay_(0),
+      quick_reuse_tick_(0),
+      regions_(NULL),
+      regions_start_(0),
+      regions_pages_(0) {
   COMPILE_ASSERT(kClassSizesMax <= (1 << PageMapCache::kValuebits), valuebits);
+  COMPILE_ASSERT(kMaxNumaNodes <= 16, span_node_bits);
+  lists_[0] = &node0_lists_;
+  for (int i = 1; i < kMaxNumaNodes; i++) {
+    lists_[i] = NULL;
+  }
+}
+
+PageHeap::FreeLists::FreeLists() {
   for (int i = 0; i < kMaxPages; i++) {
-    DLL_Init(&free_[i].normal);
-    DLL_Init(&free_[i].returned);
+    DLL_Init(&free[i].normal);
+    DLL_Init(&free[i].returned);
+  }
+  memset(normal_nonempty, 0, sizeof(normal_nonempty));
+  memset(returned_nonempty, 0, sizeof(returned_nonempty));
+}
+
+static inline void SetListBit(uint64* bitmap, Length i) {
+  bitmap[i / 64] |= uint64(1) << (i % 64);
+}
+
+static inline void ClearListBit(uint64* bitmap, Length i) {
+  bitmap[i / 64] &= ~(uint64(1) << (i % 64));
+}
+
+// Returns the index of the first bit set at or after 'i', or kMaxPages
+// if there is none.
+template <int kWords>
+static inline Length FindListBit(const uint64 (&bitmap)[kWords], Length i) {
+  Length word = i / 64;
+  if (word >= kWords) return kMaxPages;
+  uint64 bits = bitmap[word] & (~uint64(0) << (i % 64));
+  while (bits == 0) {
+    if (++word == kWords) return kMaxPages;
+    bits = bitmap[word];
+  }
+#if defined(__GNUC__)
+  const int bit = __builtin_ctzll(bits);
+#else
+  int bit = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    bit++;
+  }
+#endif
+  return word * 64 + bit;
+}
+
+bool PageHeap::SetNumaNodes(int nodes) {
+  ASSERT(stats_.system_bytes == 0);
+  ASSERT(1 <= nodes && nodes <= kMaxNumaNodes);
+  for (int i = 1; i < nodes; i++) {
+    if (lists_[i] != NULL) continue;
+    void* space = MetaDataAlloc(sizeof(FreeLists));
+    if (space == NULL) return false;
+    lists_[i] = new (space) FreeLists;
+  }
+  num_nodes_ = nodes;
+  return true;
+}
+
+bool PageHeap::SetSizeClassRegions(bool enable) {
+  ASSERT(stats_.system_bytes == 0);
+  if (!enable) {
+    regions_pages_ = 0;
+    regions_ = NULL;
+    return true;
+  }
+  if (regions_ != NULL) return true;
+  // Regions of 4 GiB only make sense with a 64-bit address space.
+  if (kAddressBits < 48) return false;
+
+  const int classes = Static::num_size_classes() - 1;
+  const Length pages = static_cast<Length>(classes) << kRegionPageShift;
+  // One page more, since the reservation need not be page aligned.
+  void* reservation = TCMalloc_SystemReserve((pages + 1) << kPageShift);
+  if (reservation == NULL) return false;
+  void* space = MetaDataAlloc(sizeof(ClassRegion) * (classes + 1));
+  if (space == NULL) return false;
+  // Free lists of every region for every node.
+  void* list_space = MetaDataAlloc(sizeof(Span) * 2 * num_nodes_ * classes);
+  if (list_space == NULL) return false;
+
+  regions_ = reinterpret_cast<ClassRegion*>(space);
+  regions_start_ =
+      (reinterpret_cast<uintptr_t>(reservation) + kPageSize - 1) >> kPageShift;
+  Span* lists = reinterpret_cast<Span*>(list_space);
+  for (int cl = 1; cl <= classes; cl++) {
+    ClassRegion* region = &regions_[cl];
+    region->next = regions_start_ +
+        (static_cast<Length>(cl - 1) << kRegionPageShift);
+    region->committed = region->next;
+    region->end = region->next + (Length(1) << kRegionPageShift);
+    region->normal = lists;
+    region->returned = lists + num_nodes_;
+    lists += 2 * num_nodes_;
+    for (int node = 0; node < num_nodes_; node++) {
+      DLL_Init(&region->normal[node]);
+      DLL_Init(&region->returned[node]);
+    }
+  }
+  regions_pages_ = pages;
+  return true;
+}
+
+Span* PageHeap::NewForSizeClass(Length n, uint32 sc, int node) {
+  ASSERT(0 < sc && sc < Static::num_size_classes());
+  ASSERT(0 <= node && node < num_nodes_);
+  Span* span = NULL;
+  if (regions_ != NULL) {
+    ClassRegion* region = &regions_[sc];
+    if (!DLL_IsEmpty(&region->normal[node])) {
+      span = region->normal[node].next;
+    } else if (!DLL_IsEmpty(&region->returned[node])) {
+      span = region->returned[node].next;
+    }
+    if (span != NULL) {
+      ASSERT(span->length == n);
+      RemoveFromRegion(span);
+      if (span->location == Span::ON_RETURNED_FREELIST) {
+        CommitSpan(span);
+      }
+      span->location = Span::IN_USE;
+      Event(span, 'A', n);
+    } else {
+      span = GrowClassRegion(n, sc, node);
+    }
+  }
+  // Without regions, or once the region is full, any span will do.
+  if (span == NULL) {
+    span = New(n, node);
+    if (span == NULL) return NULL;
+  }
+  RegisterSizeClass(span, sc);
+  return span;
+}
+
+Span* PageHeap::GrowClassRegion(Length n, uint32 sc, int node) {
+  ClassRegion* region = &regions_[sc];
+  if (region->end - region->next < n) return NULL;
+  if (region->committed - region->next < n) {
+    Length grow = n - (region->committed - region->next);
+    if (grow < kRegionCommitPages) grow = kRegionCommitPages;
+    if (grow > region->end - region->committed) {
+      grow = region->end - region->committed;
+    }
+    if (!EnsureLimit(grow)) return NULL;
+    if (!TCMalloc_SystemCommitReserved(
+            reinterpret_cast<void*>(region->committed << kPageShift),
+            grow << kPageShift)) {
+      return NULL;
+    }
+    region->committed += grow;
+  }
+
+  const PageID p = region->next;
+  if (!pagemap_.Ensure(p, n)) return NULL;
+  region->next += n;
+  Static::numa_topology()->BindMemory(reinterpret_cast<void*>(p << kPageShift),
+                                      n << kPageShift, node);
+
+  const size_t bytes = n << kPageShift;
+  ++stats_.reserve_count;
+  ++stats_.commit_count;
+  stats_.system_bytes += bytes;
+  stats_.committed_bytes += bytes;
+  stats_.total_commit_bytes += bytes;
+  stats_.total_reserve_bytes += bytes;
+  node_stats_[node].system_bytes += bytes;
+
+  Span* span = NewSpan(p, n);
+  span->node = node;
+  RecordSpan(span);
+  Event(span, 'A', n);
+  return span;
+}
+
+void PageHeap::DeleteFromRegion(Span* span, ClassRegion* region) {
+  ASSERT(span->location == Span::ON_NORMAL_FREELIST ||
+         span->location == Span::ON_RETURNED_FREELIST);
+  const size_t bytes = span->length << kPageShift;
+  if (span->location == Span::ON_NORMAL_FREELIST) {
+    stats_.free_bytes += bytes;
+    node_stats_[span->node].free_bytes += bytes;
+    DLL_Prepend(&region->normal[span->node], span);
+  } else {
+    stats_.unmapped_bytes += bytes;
+    node_stats_[span->node].unmapped_bytes += bytes;
+    DLL_Prepend(&region->returned[span->node], span);
+  }
+}
+
+void PageHeap::RemoveFromRegion(Span* span) {
+  ASSERT(span->location == Span::ON_NORMAL_FREELIST ||
+         span->location == Span::ON_RETURNED_FREELIST);
+  const size_t bytes = span->length << kPageShift;
+  DLL_Remove(span);
+  if (span->location == Span::ON_NORMAL_FREELIST) {
+    stats_.free_bytes -= bytes;
+    node_stats_[span->node].free_bytes -= bytes;
+  } else {
+    stats_.unmapped_bytes -= bytes;
+    node_stats_[span->node].unmapped_bytes -= bytes;
   }
 }
 
-Span* PageHeap::SearchFreeAndLargeLists(Length n) {
+Length PageHeap::ReleaseRegionPages(Length num_pages, uint32 min_idle) {
+  // Like ReleasePages, in batches with lock_ dropped.
+  Length released_pages = 0;
+  ReleaseBatch batch;
+  for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+    ClassRegion* region = &regions_[cl];
+    for (int node = 0; node < num_nodes_; node++) {
+      Span* list = &region->normal[node];
+      // Spans are prepended when freed, so the last one has been free
+      // the longest.
+      while (released_pages + batch.pages < num_pages &&
+             !DLL_IsEmpty(list) && IdleFor(list->prev, min_idle)) {
+        AddToReleaseBatch(list->prev, &batch);
+        if (batch.count == kReleaseBatchSize) {
+          const Length released_len = FlushReleaseBatch(&batch);
+          // Some systems do not support release
+          if (released_len == 0) return released_pages;
+          released_pages += released_len;
+        }
+      }
+    }
+  }
+  return released_pages + FlushReleaseBatch(&batch);
+}
+
+Span* PageHeap::SearchFreeAndLargeLists(Length n, int node) {
   ASSERT(Check());
   ASSERT(n > 0);
+  FreeLists* lists = lists_[node];
 
   // Find first size >= n that has a non-empty list
-  for (Length s = n; s <= kMaxPages; s++) {
-    Span* ll = &free_[s - 1].normal;
-    // If we're lucky, ll is non-empty, meaning it has a suitable span.
-    if (!DLL_IsEmpty(ll)) {
+  for (Length i = n - 1; i < kMaxPages; ) {
+    const Length normal = FindListBit(lists->normal_nonempty, i);
+    const Length returned = FindListBit(lists->returned_nonempty, i);
+    // If we're lucky, there is a normal span at least as small as any
+    // returned one.
+    if (normal <= returned) {
+      if (normal == kMaxPages) break;
+      Span* ll = &lists->free[normal].normal;
       ASSERT(ll->next->location == Span::ON_NORMAL_FREELIST);
-      return Carve(ll->next, n);
+      return Carve(hugepage_aware_ ? PickFullestSpan(ll) : ll->next, n);
     }
     // Alternatively, maybe there's a usable returned span.
-    ll = &free_[s - 1].returned;
-    if (!DLL_IsEmpty(ll)) {
-      // We did not call EnsureLimit before, to avoid releasing the span
-      // that will be taken immediately back.
-      // Calling EnsureLimit here is not very expensive, as it fails only if
-      // there is no more normal spans (and it fails efficiently)
-      // or SystemRelease does not work (there is probably no returned spans).
-      if (EnsureLimit(n)) {
-        // ll may have became empty due to coalescing
-        if (!DLL_IsEmpty(ll)) {
-          ASSERT(ll->next->location == Span::ON_RETURNED_FREELIST);
-          return Carve(ll->next, n);
-        }
+    Span* ll = &lists->free[returned].returned;
+    // We did not call EnsureLimit before, to avoid releasing the span
+    // that will be taken immediately back.
+    // Calling EnsureLimit here is not very expensive, as it fails only if
+    // there is no more normal spans (and it fails efficiently)
+    // or SystemRelease does not work (there is probably no returned spans).
+    if (EnsureLimit(n)) {
+      // ll may have became empty due to coalescing
+      if (!DLL_IsEmpty(ll)) {
+        ASSERT(ll->next->location == Span::ON_RETURNED_FREELIST);
+        return Carve(hugepage_aware_ ? PickFullestSpan(ll) : ll->next, n);
       }
     }
+    i = returned + 1;
   }
   // No luck in free lists, our last chance is in a larger class.
-  return AllocLarge(n);  // May be NULL
+  return AllocLarge(n, node);  // May be NULL
 }
 
 static const size_t kForcedCoalesceInterval = 128*1024*1024;
 
-Span* PageHeap::New(Length n) {
+Span* PageHeap::New(Length n, int node) {
   ASSERT(Check());
   ASSERT(n > 0);
+  ASSERT(0 <= node && node < num_nodes_);
 
-  Span* result = SearchFreeAndLargeLists(n);
+  Span* result = SearchFreeAndLargeLists(n, node);
   if (result != NULL)
     return result;
 
-  if (stats_.free_bytes != 0 && stats_.unmapped_bytes != 0
+  if (!hugepage_aware_
+      && stats_.free_bytes != 0 && stats_.unmapped_bytes != 0
       && stats_.free_bytes + stats_.unmapped_bytes >= stats_.system_bytes / 4
       && (stats_.system_bytes / kForcedCoalesceInterval
           != (stats_.system_bytes + (n << kPageShift)) / kForcedCoalesceInterval)) {
@@ -146,51 +389,62 @@ Span* PageHeap::New(Length n) {
     // insufficiently big large spans back to OS. So in case of really
     // unlucky memory fragmentation we'll be consuming virtual address
     // space, but not real memory
-    result = SearchFreeAndLargeLists(n);
+    result = SearchFreeAndLargeLists(n, node);
     if (result != NULL) return result;
   }
 
-  // Grow the heap and try again.
-  if (!GrowHeap(n)) {
-    ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
-    ASSERT(Check());
-    // underlying SysAllocator likely set ENOMEM but we can get here
-    // due to EnsureLimit so we set it here too.
-    //
-    // Setting errno to ENOMEM here allows us to avoid dealing with it
-    // in fast-path.
-    errno = ENOMEM;
-    return NULL;
-  }
-  return SearchFreeAndLargeLists(n);
+  // Grow the heap and try again.  Since lock_ is dropped while
+  // growing, another thread may have taken the new pages by then.
+  do {
+    if (!GrowHeap(n, node)) {
+      // Remote memory is better than none.
+      for (int other = 0; other < num_nodes_; other++) {
+        if (other == node) continue;
+        result = SearchFreeAndLargeLists(n, other);
+        if (result != NULL) return result;
+      }
+      ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
+      ASSERT(Check());
+      // underlying SysAllocator likely set ENOMEM but we can get here
+      // due to EnsureLimit so we set it here too.
+      //
+      // Setting errno to ENOMEM here allows us to avoid dealing with it
+      // in fast-path.
+      errno = ENOMEM;
+      return NULL;
+    }
+    result = SearchFreeAndLargeLists(n, node);
+  } while (result == NULL);
+  return result;
 }
 
-Span* PageHeap::AllocLarge(Length n) {
-  Span *best = NULL;
-  Span *best_normal = NULL;
-
-  // Create a Span to use as an upper bound.
-  Span bound;
-  bound.start = 0;
-  bound.length = n;
+void PageHeap::Pregrow(Length watermark) {
+  for (int node = 0; node < num_nodes_; node++) {
+    const NodeStats& ns = node_stats_[node];
+    const Length available =
+        ((ns.free_bytes + ns.unmapped_bytes) >> kPageShift) + growing_pages_;
+    if (available < watermark) {
+      GrowHeap(watermark - available, node);
+    }
+  }
+}
 
+Span* PageHeap::AllocLarge(Length n, int node) {
+  SpanSet* large_normal = &lists_[node]->large_normal;
+  SpanSet* large_returned = &lists_[node]->large_returned;
   // First search the NORMAL spans..
-  SpanSet::iterator place = large_normal_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_normal_.end()) {
-    best = place->span;
-    best_normal = best;
-    ASSERT(best->location == Span::ON_NORMAL_FREELIST);
-  }
+  Span *best = large_normal->BestFit(n);
+  Span *best_normal = best;
+  ASSERT(best == NULL || best->location == Span::ON_NORMAL_FREELIST);
 
   // Try to find better fit from RETURNED spans.
-  place = large_returned_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_returned_.end()) {
-    Span *c = place->span;
+  Span *c = large_returned->BestFit(n);
+  if (c != NULL) {
     ASSERT(c->location == Span::ON_RETURNED_FREELIST);
     if (best_normal == NULL
         || c->length < best->length
         || (c->length == best->length && c->start < best->start))
-      best = place->span;
+      best = c;
   }
 
   if (best == best_normal) {
@@ -207,7 +461,7 @@ Span* PageHeap::AllocLarge(Length n) {
     // best could have been destroyed by coalescing.
     // best_normal is not a best-fit, and it could be destroyed as well.
     // We retry, the limit is already ensured:
-    return AllocLarge(n);
+    return AllocLarge(n, node);
   }
 
   // If best_normal existed, EnsureLimit would succeeded:
@@ -226,6 +480,7 @@ Span* PageHeap::Split(Span* span, Length n) {
   const int extra = span->length - n;
   Span* leftover = NewSpan(span->start + n, extra);
   ASSERT(leftover->location == Span::IN_USE);
+  leftover->node = span->node;
   Event(leftover, 'U', extra);
   RecordSpan(leftover);
   pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
@@ -234,6 +489,54 @@ Span* PageHeap::Split(Span* span, Length n) {
   return leftover;
 }
 
+bool PageHeap::Extend(Span* span, Length n) {
+  ASSERT(n > span->length);
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->sizeclass == 0);
+  if (RegionOf(span->start) != NULL) {
+    return false;
+  }
+  const PageID p = span->start + span->length;
+  Span* next = GetDescriptor(p);
+  if (next == NULL || next->start != p ||
+      (next->location != Span::ON_NORMAL_FREELIST &&
+       next->location != Span::ON_RETURNED_FREELIST) ||
+      next->node != span->node || InSizeClassRegion(p)) {
+    return false;
+  }
+  const Length extra = n - span->length;
+  if (next->length < extra) {
+    return false;
+  }
+  Carve(next, extra);
+  ASSERT(next->length == extra);
+  Event(span, 'X', extra);
+  DeleteSpan(next);
+  span->length = n;
+  pagemap_.set(p, span);
+  pagemap_.set(span->start + n - 1, span);
+  ASSERT(Check());
+  return true;
+}
+
+void PageHeap::DeleteReleased(Span* span) {
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(!hugepage_aware_ && RegionOf(span->start) == NULL);
+  const size_t bytes = static_cast<size_t>(span->length) << kPageShift;
+  ++stats_.decommit_count;
+  stats_.committed_bytes -= bytes;
+  stats_.total_decommit_bytes += bytes;
+  span->sizeclass = 0;
+  span->sample = 0;
+  span->known_zero = 1;
+  span->location = Span::ON_RETURNED_FREELIST;
+  span->free_tick = release_tick_;
+  Event(span, 'D', span->length);
+  MergeIntoFreeList(span);
+  ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
+  ASSERT(Check());
+}
+
 void PageHeap::CommitSpan(Span* span) {
   ++stats_.commit_count;
 
@@ -241,16 +544,29 @@ void PageHeap::CommitSpan(Span* span) {
                         static_cast<size_t>(span->length << kPageShift));
   stats_.committed_bytes += span->length << kPageShift;
   stats_.total_commit_bytes += (span->length << kPageShift);
+
+  if (hugepage_aware_) {
+    const int kShift = kHugePageShift - kPageShift;
+    const PageID last = span->start + span->length - 1;
+    for (uintptr_t hp = span->start >> kShift; hp <= (last >> kShift); hp++) {
+      uint16* entry = hugepages_.Find(hp);
+      if (entry != NULL) *entry &= ~HugePageMap::kReleased;
+    }
+  }
 }
 
 bool PageHeap::DecommitSpan(Span* span) {
   ++stats_.decommit_count;
 
+  bool zeroed;
   bool rv = TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
-                                   static_cast<size_t>(span->length << kPageShift));
+                                   static_cast<size_t>(span->length << kPageShift),
+                                   &zeroed);
   if (rv) {
     stats_.committed_bytes -= span->length << kPageShift;
     stats_.total_decommit_bytes += (span->length << kPageShift);
+    if (zeroed) span->known_zero = 1;
+    span->free_tick = release_tick_;
   }
 
   return rv;
@@ -269,19 +585,25 @@ Span* PageHeap::Carve(Span* span, Length n) {
   if (extra > 0) {
     Span* leftover = NewSpan(span->start + n, extra);
     leftover->location = old_location;
+    leftover->free_tick = span->free_tick;
+    leftover->known_zero = span->known_zero;
+    leftover->node = span->node;
     Event(leftover, 'S', extra);
     RecordSpan(leftover);
 
     // The previous span of |leftover| was just splitted -- no need to
     // coalesce them. The next span of |leftover| was not previously coalesced
-    // with |span|, i.e. is NULL or has got location other than |old_location|.
+    // with |span|, i.e. is NULL or has got location other than |old_location|,
+    // or is fresh from the system and kept apart from it.
 #ifndef NDEBUG
     const PageID p = leftover->start;
     const Length len = leftover->length;
     Span* next = GetDescriptor(p+len);
     ASSERT (next == NULL ||
             next->location == Span::IN_USE ||
-            next->location != leftover->location);
+            next->location != leftover->location ||
+            next->known_zero != leftover->known_zero ||
+            next->node != leftover->node);
 #endif
 
     PrependToFreeList(leftover);  // Skip coalescing - no candidates possible
@@ -290,27 +612,45 @@ Span* PageHeap::Carve(Span* span, Length n) {
   }
   ASSERT(Check());
   if (old_location == Span::ON_RETURNED_FREELIST) {
+    RecordReuse(span);
     // We need to recommit this address space.
     CommitSpan(span);
   }
+  if (hugepage_aware_) {
+    UpdateHugePageUsage(span, 1);
+  }
   ASSERT(span->location == Span::IN_USE);
   ASSERT(span->length == n);
   ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
   return span;
 }
 
-void PageHeap::Delete(Span* span) {
+void PageHeap::FreeSpan(Span* span, bool known_zero) {
   ASSERT(Check());
   ASSERT(span->location == Span::IN_USE);
   ASSERT(span->length > 0);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start + span->length - 1) == span);
   const Length n = span->length;
+  ClassRegion* region = RegionOf(span->start);
+  if (hugepage_aware_ && region == NULL) {
+    UpdateHugePageUsage(span, -1);
+  }
   span->sizeclass = 0;
   span->sample = 0;
+  span->known_zero = known_zero;
   span->location = Span::ON_NORMAL_FREELIST;
+  span->free_tick = release_tick_;
   Event(span, 'D', span->length);
-  MergeIntoFreeList(span);  // Coalesces if possible
+  if (region != NULL) {
+    DeleteFromRegion(span, region);
+  } else {
+    // Fresh pages from the system are kept apart from used free pages
+    // next to them, so that a large calloc() can have them without
+    // clearing them.  They alone serve the allocation the heap grew
+    // for; later frees coalesce them with their neighbours as usual.
+    MergeIntoFreeList(span, known_zero);  // Coalesces if possible
+  }
   IncrementalScavenge(n);
   ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
   ASSERT(Check());
@@ -321,13 +661,20 @@ void PageHeap::Delete(Span* span) {
 // other span from free list, performs aggressive decommit if
 // necessary and returns 'other' span. Otherwise 'other' span cannot
 // be merged and is left untouched. In that case NULL is returned.
-Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other) {
-  if (other == NULL) {
-    return other;
+Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other,
+                                       bool keep_zero) {
+  if (other == NULL || other->node != span->node) {
+    return NULL;
+  }
+  // A span from the heap may border on a size class region, whose
+  // spans are never coalesced.
+  if (InSizeClassRegion(other->start)) {
+    return NULL;
   }
   // if we're in aggressive decommit mode and span is decommitted,
   // then we try to decommit adjacent span.
-  if (aggressive_decommit_ && other->location == Span::ON_NORMAL_FREELIST
+  if (DecommitAggressively()
+      && other->location == Span::ON_NORMAL_FREELIST
       && span->location == Span::ON_RETURNED_FREELIST) {
     bool worked = DecommitSpan(other);
     if (!worked) {
@@ -336,12 +683,15 @@ Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other) {
   } else if (other->location != span->location) {
     return NULL;
   }
+  if (keep_zero && span->known_zero && !other->known_zero) {
+    return NULL;
+  }
 
   RemoveFromFreeList(other);
   return other;
 }
 
-void PageHeap::MergeIntoFreeList(Span* span) {
+void PageHeap::MergeIntoFreeList(Span* span, bool keep_zero) {
   ASSERT(span->location != Span::IN_USE);
 
   // Coalesce -- we guarantee that "p" != 0, so no bounds checking
@@ -364,28 +714,31 @@ void PageHeap::MergeIntoFreeList(Span* span) {
   const PageID p = span->start;
   const Length n = span->length;
 
-  if (aggressive_decommit_ && span->location == Span::ON_NORMAL_FREELIST) {
+  if (DecommitAggressively()
+      && span->location == Span::ON_NORMAL_FREELIST) {
     if (DecommitSpan(span)) {
       span->location = Span::ON_RETURNED_FREELIST;
     }
   }
 
-  Span* prev = CheckAndHandlePreMerge(span, GetDescriptor(p-1));
+  Span* prev = CheckAndHandlePreMerge(span, GetDescriptor(p-1), keep_zero);
   if (prev != NULL) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
+    span->known_zero = span->known_zero & prev->known_zero;
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
     pagemap_.set(span->start, span);
     Event(span, 'L', len);
   }
-  Span* next = CheckAndHandlePreMerge(span, GetDescriptor(p+n));
+  Span* next = CheckAndHandlePreMerge(span, GetDescriptor(p+n), keep_zero);
   if (next != NULL) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
+    span->known_zero = span->known_zero & next->known_zero;
     DeleteSpan(next);
     span->length += len;
     pagemap_.set(span->start + span->length - 1, span);
@@ -397,51 +750,67 @@ void PageHeap::MergeIntoFreeList(Span* span) {
 
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(span->location != Span::IN_USE);
-  if (span->location == Span::ON_NORMAL_FREELIST)
+  FreeLists* lists = lists_[span->node];
+  NodeStats* ns = &node_stats_[span->node];
+  if (span->location == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes += (span->length << kPageShift);
-  else
+    ns->free_bytes += (span->length << kPageShift);
+  } else {
     stats_.unmapped_bytes += (span->length << kPageShift);
+    ns->unmapped_bytes += (span->length << kPageShift);
+  }
 
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
+    SpanSet *set = &lists->large_normal;
     if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    std::pair<SpanSet::iterator, bool> p =
-        set->insert(SpanPtrWithLength(span));
-    ASSERT(p.second); // We never have duplicates since span->start is unique.
-    span->SetSpanSetIterator(p.first);
+      set = &lists->large_returned;
+    set->insert(span);
     return;
   }
 
-  SpanList* list = &free_[span->length - 1];
+  SpanList* list = &lists->free[span->length - 1];
   if (span->location == Span::ON_NORMAL_FREELIST) {
     DLL_Prepend(&list->normal, span);
+    SetListBit(lists->normal_nonempty, span->length - 1);
   } else {
     DLL_Prepend(&list->returned, span);
+    SetListBit(lists->returned_nonempty, span->length - 1);
   }
 }
 
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(span->location != Span::IN_USE);
+  FreeLists* lists = lists_[span->node];
+  NodeStats* ns = &node_stats_[span->node];
   if (span->location == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= (span->length << kPageShift);
+    ns->free_bytes -= (span->length << kPageShift);
   } else {
     stats_.unmapped_bytes -= (span->length << kPageShift);
+    ns->unmapped_bytes -= (span->length << kPageShift);
   }
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
+    SpanSet *set = &lists->large_normal;
     if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    SpanSet::iterator iter = span->ExtractSpanSetIterator();
-    ASSERT(iter->span == span);
-    ASSERT(set->find(SpanPtrWithLength(span)) == iter);
-    set->erase(iter);
+      set = &lists->large_returned;
+    set->erase(span);
   } else {
     DLL_Remove(span);
+    SpanList* list = &lists->free[span->length - 1];
+    if (span->location == Span::ON_NORMAL_FREELIST) {
+      if (DLL_IsEmpty(&list->normal)) {
+        ClearListBit(lists->normal_nonempty, span->length - 1);
+      }
+    } else if (DLL_IsEmpty(&list->returned)) {
+      ClearListBit(lists->returned_nonempty, span->length - 1);
+    }
   }
 }
 
 void PageHeap::IncrementalScavenge(Length n) {
+  // The background thread does all releasing.
+  if (background_release_) return;
+
   // Fast path; not yet time to release memory
   scavenge_counter_ -= n;
   if (scavenge_counter_ >= 0) return;  // Not yet time to scavenge
@@ -454,18 +823,21 @@ void PageHeap::IncrementalScavenge(Length n) {
   }
 
   ++stats_.scavenge_count;
+  AdvanceReleaseTick();
 
-  Length released_pages = ReleaseAtLeastNPages(1);
+  Length released_pages = ReleasePages(1, release_delay_);
 
-  if (released_pages == 0) {
+  if (released_pages == 0 && (release_delay_ == 0 || stats_.free_bytes == 0)) {
     // Nothing to scavenge, delay for a while.
     scavenge_counter_ = kDefaultReleaseDelay;
   } else {
     // Compute how long to wait until we return memory.
     // FLAGS_tcmalloc_release_rate==1 means wait for 1000 pages
-    // after releasing one page.
+    // after releasing one page.  Free spans still waiting out
+    // release_delay_ are looked at again as if kMaxPages were released.
     const double mult = 1000.0 / rate;
-    double wait = mult * static_cast<double>(released_pages);
+    double wait = mult * static_cast<double>(
+        released_pages > 0 ? released_pages : kMaxPages);
     if (wait > kMaxReleaseDelay) {
       // Avoid overflow and bound to reasonable range.
       wait = kMaxReleaseDelay;
@@ -474,55 +846,354 @@ void PageHeap::IncrementalScavenge(Length n) {
   }
 }
 
-Length PageHeap::ReleaseSpan(Span* s) {
-  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+void PageHeap::AddReleasingBytes(const Span* s, int sign) {
+  const uint64_t bytes = static_cast<uint64_t>(s->length) << kPageShift;
+  if (sign > 0) {
+    stats_.free_bytes += bytes;
+    node_stats_[s->node].free_bytes += bytes;
+  } else {
+    stats_.free_bytes -= bytes;
+    node_stats_[s->node].free_bytes -= bytes;
+  }
+}
 
-  if (DecommitSpan(s)) {
+void PageHeap::AddToReleaseBatch(Span* s, ReleaseBatch* batch) {
+  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  ASSERT(batch->count < kReleaseBatchSize);
+  if (InSizeClassRegion(s->start)) {
+    RemoveFromRegion(s);
+  } else {
     RemoveFromFreeList(s);
-    const Length n = s->length;
-    s->location = Span::ON_RETURNED_FREELIST;
-    MergeIntoFreeList(s);  // Coalesces if possible.
-    return n;
   }
+  AddReleasingBytes(s, 1);
+  s->location = Span::BEING_RELEASED;
+  batch->spans[batch->count++] = s;
+  batch->pages += s->length;
+}
+
+Length PageHeap::FlushReleaseBatch(ReleaseBatch* batch) {
+  if (batch->count == 0) return 0;
 
-  return 0;
+  SystemReleaseRange ranges[kReleaseBatchSize];
+  for (int i = 0; i < batch->count; i++) {
+    ranges[i].start = reinterpret_cast<void*>(batch->spans[i]->start << kPageShift);
+    ranges[i].length = static_cast<size_t>(batch->spans[i]->length << kPageShift);
+    ranges[i].released = false;
+    ranges[i].zeroed = false;
+  }
+  stats_.decommit_count += batch->count;
+
+  // The spans are not on any free list, so they can neither be
+  // allocated nor coalesced with until they are put back below.
+  if (lock_ != NULL) lock_->Unlock();
+  TCMalloc_SystemReleaseBatch(ranges, batch->count);
+  if (lock_ != NULL) lock_->Lock();
+
+  Length released_pages = 0;
+  for (int i = 0; i < batch->count; i++) {
+    Span* s = batch->spans[i];
+    ASSERT(s->location == Span::BEING_RELEASED);
+    AddReleasingBytes(s, -1);
+    if (ranges[i].released) {
+      if (ranges[i].zeroed) s->known_zero = 1;
+      s->free_tick = release_tick_;
+      stats_.committed_bytes -= s->length << kPageShift;
+      stats_.total_decommit_bytes += (s->length << kPageShift);
+      if (hugepage_aware_ && !InSizeClassRegion(s->start)) {
+        MarkHugePagesReleased(s);
+      }
+      released_pages += s->length;
+      s->location = Span::ON_RETURNED_FREELIST;
+    } else {
+      s->location = Span::ON_NORMAL_FREELIST;
+    }
+    ClassRegion* region = RegionOf(s->start);
+    if (region != NULL) {
+      DeleteFromRegion(s, region);
+    } else {
+      MergeIntoFreeList(s);  // Coalesces if possible.
+    }
+  }
+  batch->count = 0;
+  batch->pages = 0;
+  return released_pages;
 }
 
 Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
+  return ReleasePages(num_pages, 0);
+}
+
+void PageHeap::AdvanceReleaseTick() {
+  ++release_tick_;
+  if (release_delay_ > 0 &&
+      ((release_tick_ - quick_reuse_tick_) & Span::kFreeTickMask) >
+      release_delay_) {
+    release_delay_ /= 2;
+    quick_reuse_tick_ = release_tick_;
+  }
+}
+
+void PageHeap::RecordReuse(const Span* span) {
+  const uint32 ticks = (release_tick_ - span->free_tick) & Span::kFreeTickMask;
+  ++stats_.reuse_count;
+  stats_.total_reuse_bytes += static_cast<uint64_t>(span->length) << kPageShift;
+  stats_.total_reuse_ticks += ticks;
+  if (ticks < kQuickReuseTicks) {
+    // Releasing the span only cost a system call and page faults; hold
+    // on to free spans for longer.
+    ++stats_.quick_reuse_count;
+    release_delay_ = 2 * release_delay_ + 1;
+    if (release_delay_ > kMaxReleaseDelayTicks) {
+      release_delay_ = kMaxReleaseDelayTicks;
+    }
+    quick_reuse_tick_ = release_tick_;
+  }
+}
+
+Length PageHeap::ReleaseIdlePages(double fraction) {
+  AdvanceReleaseTick();
+  const Length free_pages = stats_.free_bytes >> kPageShift;
+  if (fraction <= 0 || free_pages == 0) return 0;
+  Length num_pages = static_cast<Length>(free_pages * fraction);
+  if (num_pages == 0) num_pages = 1;
+  // Spans freed during the previous tick have been idle for less than
+  // a tick; leave them alone.
+  const Length released_pages = ReleasePages(num_pages, 2 + release_delay_);
+  if (released_pages > 0) ++stats_.scavenge_count;
+  return released_pages;
+}
+
+Length PageHeap::ReleasePages(Length num_pages, uint32 min_idle) {
   Length released_pages = 0;
+  if (hugepage_aware_) {
+    // Break up hugepages only when asked for every free page, which
+    // is what ReleaseFreeMemory() does.
+    const Length free_pages = stats_.free_bytes >> kPageShift;
+    released_pages = ReleaseAtLeastNHugePagePages(num_pages, min_idle);
+    if (released_pages >= num_pages || num_pages <= free_pages) {
+      return released_pages;
+    }
+  }
 
-  // Round robin through the lists of free spans, releasing a
-  // span from each list.  Stop after releasing at least num_pages
-  // or when there is nothing more to release.
-  while (released_pages < num_pages && stats_.free_bytes > 0) {
-    for (int i = 0; i < kMaxPages+1 && released_pages < num_pages;
+  // Round robin through the lists of free spans of all nodes,
+  // releasing a span from each list.  Stop after releasing at least
+  // num_pages or when there is nothing more to release.  Spans are
+  // released in batches, with lock_ dropped.
+  const int kListsPerNode = kMaxPages + 1;
+  const int num_lists = kListsPerNode * num_nodes_;
+  ReleaseBatch batch;
+  bool progress = true;
+  while (released_pages + batch.pages < num_pages &&
+         stats_.free_bytes > 0 && progress) {
+    progress = false;
+    for (int i = 0;
+         i < num_lists && released_pages + batch.pages < num_pages;
          i++, release_index_++) {
-      Span *s;
-      if (release_index_ > kMaxPages) release_index_ = 0;
-
-      if (release_index_ == kMaxPages) {
-        if (large_normal_.empty()) {
-          continue;
+      Span *s = NULL;
+      if (release_index_ >= num_lists) release_index_ = 0;
+      FreeLists* lists = lists_[release_index_ / kListsPerNode];
+      const int index = release_index_ % kListsPerNode;
+
+      if (index == kMaxPages) {
+        for (SpanSet::iterator it = lists->large_normal.begin();
+             it != lists->large_normal.end(); ++it) {
+          if (IdleFor(it->span, min_idle)) {
+            s = it->span;
+            break;
+          }
         }
-        s = (large_normal_.begin())->span;
       } else {
-        SpanList* slist = &free_[release_index_];
-        if (DLL_IsEmpty(&slist->normal)) {
-          continue;
+        // Spans are prepended when freed, so the last one has been
+        // free the longest.
+        SpanList* slist = &lists->free[index];
+        if (!DLL_IsEmpty(&slist->normal) &&
+            IdleFor(slist->normal.prev, min_idle)) {
+          s = slist->normal.prev;
         }
-        s = slist->normal.prev;
+      }
+      if (s == NULL) {
+        continue;
       }
       // TODO(todd) if the remaining number of pages to release
       // is significantly smaller than s->length, and s is on the
       // large freelist, should we carve s instead of releasing?
       // the whole thing?
-      Length released_len = ReleaseSpan(s);
+      AddToReleaseBatch(s, &batch);
+      progress = true;
+      if (batch.count == kReleaseBatchSize) {
+        Length released_len = FlushReleaseBatch(&batch);
+        // Some systems do not support release
+        if (released_len == 0) return released_pages;
+        released_pages += released_len;
+      }
+    }
+  }
+  released_pages += FlushReleaseBatch(&batch);
+  if (regions_ != NULL && released_pages < num_pages) {
+    released_pages += ReleaseRegionPages(num_pages - released_pages,
+                                         min_idle);
+  }
+  return released_pages;
+}
+
+void PageHeap::UpdateHugePageUsage(Span* span, int sign) {
+  const int kShift = kHugePageShift - kPageShift;
+  const PageID end = span->start + span->length;
+  PageID p = span->start;
+  while (p < end) {
+    const PageID hp_end = ((p >> kShift) + 1) << kShift;
+    const int n = static_cast<int>((hp_end < end ? hp_end : end) - p);
+    uint16* entry = hugepages_.Find(p >> kShift);
+    if (entry != NULL) {
+      const int used = (*entry & HugePageMap::kUsedMask) + sign * n;
+      ASSERT(0 <= used && used <= static_cast<int>(kPagesPerHugePage));
+      *entry = static_cast<uint16>((*entry & ~HugePageMap::kUsedMask) | used);
+    }
+    p += n;
+  }
+}
+
+int PageHeap::HugePageUsage(PageID p) const {
+  const uint16* entry = hugepages_.Find(p >> (kHugePageShift - kPageShift));
+  return entry == NULL ? 0 : (*entry & HugePageMap::kUsedMask);
+}
+
+Span* PageHeap::PickFullestSpan(Span* list) {
+  // Free lists can be long; a handful of candidates is enough to steer
+  // allocations away from empty hugepages, which can then be released.
+  static const int kMaxCandidates = 16;
+  ASSERT(!DLL_IsEmpty(list));
+  Span* best = list->next;
+  int best_used = HugePageUsage(best->start);
+  int seen = 1;
+  for (Span* s = best->next;
+       s != list && seen < kMaxCandidates &&
+           best_used < static_cast<int>(kPagesPerHugePage);
+       s = s->next, seen++) {
+    const int used = HugePageUsage(s->start);
+    if (used > best_used) {
+      best = s;
+      best_used = used;
+    }
+  }
+  return best;
+}
+
+void PageHeap::MarkHugePagesReleased(Span* s) {
+  const int kShift = kHugePageShift - kPageShift;
+  const uintptr_t first = (s->start + kPagesPerHugePage - 1) >> kShift;
+  const uintptr_t end = (s->start + s->length) >> kShift;
+  for (uintptr_t hp = first; hp < end; hp++) {
+    uint16* entry = hugepages_.Find(hp);
+    if (entry != NULL) *entry |= HugePageMap::kReleased;
+  }
+}
+
+Length PageHeap::AddHugePagesToReleaseBatch(Span* s, ReleaseBatch* batch) {
+  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  const PageID start = (s->start + kPagesPerHugePage - 1) &
+      ~static_cast<PageID>(kPagesPerHugePage - 1);
+  const PageID end = (s->start + s->length) &
+      ~static_cast<PageID>(kPagesPerHugePage - 1);
+  if (start >= end) return 0;
+
+  // Split off the unaligned head and tail; they stay on the normal
+  // free lists.  None of them can be coalesced with anything since s
+  // already was.
+  RemoveFromFreeList(s);
+  if (start > s->start) {
+    Span* head = NewSpan(s->start, start - s->start);
+    head->location = Span::ON_NORMAL_FREELIST;
+    head->free_tick = s->free_tick;
+    head->known_zero = s->known_zero;
+    head->node = s->node;
+    RecordSpan(head);
+    PrependToFreeList(head);
+    s->length -= head->length;
+    s->start = start;
+  }
+  if (s->start + s->length > end) {
+    Span* tail = NewSpan(end, s->start + s->length - end);
+    tail->location = Span::ON_NORMAL_FREELIST;
+    tail->free_tick = s->free_tick;
+    tail->known_zero = s->known_zero;
+    tail->node = s->node;
+    RecordSpan(tail);
+    PrependToFreeList(tail);
+    s->length = end - s->start;
+  }
+  RecordSpan(s);
+
+  // If the release fails, FlushReleaseBatch glues it back together
+  // with head and tail.
+  AddReleasingBytes(s, 1);
+  s->location = Span::BEING_RELEASED;
+  batch->spans[batch->count++] = s;
+  batch->pages += s->length;
+  return s->length;
+}
+
+Length PageHeap::ReleaseAtLeastNHugePagePages(Length num_pages,
+                                              uint32 min_idle) {
+  Length released_pages = 0;
+  ReleaseBatch batch;
+  while (released_pages + batch.pages < num_pages) {
+    // Only a free span of at least a hugepage can cover a whole one.
+    // Those are all on the large lists (kPagesPerHugePage > kMaxPages);
+    // start with the biggest.
+    Span* candidate = NULL;
+    for (int node = 0; node < num_nodes_; node++) {
+      SpanSet* large_normal = &lists_[node]->large_normal;
+      for (SpanSet::iterator it = large_normal->end();
+           it != large_normal->begin(); ) {
+        --it;
+        if (it->length < kPagesPerHugePage) break;
+        Span* s = it->span;
+        const PageID start = (s->start + kPagesPerHugePage - 1) &
+            ~static_cast<PageID>(kPagesPerHugePage - 1);
+        if (start + kPagesPerHugePage <= s->start + s->length &&
+            IdleFor(s, min_idle)) {
+          if (candidate == NULL || s->length > candidate->length) {
+            candidate = s;
+          }
+          break;
+        }
+      }
+    }
+    if (candidate == NULL) break;
+    AddHugePagesToReleaseBatch(candidate, &batch);
+    if (batch.count == kReleaseBatchSize) {
+      const Length released_len = FlushReleaseBatch(&batch);
       // Some systems do not support release
       if (released_len == 0) return released_pages;
       released_pages += released_len;
     }
   }
-  return released_pages;
+  return released_pages + FlushReleaseBatch(&batch);
+}
+
+void PageHeap::GetHugePageStats(HugePageStats* result) {
+  memset(result, 0, sizeof(*result));
+  for (int i = 0; i < HugePageMap::kRootLength; i++) {
+    const uint16* leaf = hugepages_.leaf(i);
+    if (leaf == NULL) continue;
+    for (int j = 0; j < HugePageMap::kLeafLength; j++) {
+      const uint16 entry = leaf[j];
+      if ((entry & HugePageMap::kOwned) == 0) continue;
+      result->hugepages++;
+      const int used = entry & HugePageMap::kUsedMask;
+      if (used == 0) {
+        result->free++;
+        if (entry & HugePageMap::kReleased) result->released++;
+      } else if (used == static_cast<int>(kPagesPerHugePage)) {
+        result->full++;
+      } else {
+        const int bucket = (used * 4 - 1) / static_cast<int>(kPagesPerHugePage);
+        result->partial[bucket]++;
+        result->partial_used_pages += used;
+      }
+    }
+  }
 }
 
 bool PageHeap::EnsureLimit(Length n, bool withRelease)
@@ -532,7 +1203,7 @@ bool PageHeap::EnsureLimit(Length n, bool withRelease)
 
   // We do not use stats_.system_bytes because it does not take
   // MetaDataAllocs into account.
-  Length takenPages = TCMalloc_SystemTaken >> kPageShift;
+  Length takenPages = (TCMalloc_SystemTaken >> kPageShift) + growing_pages_;
   //XXX takenPages may be slightly bigger than limit for two reasons:
   //* MetaDataAllocs ignore the limit (it is not easy to handle
   //  out of memory there)
@@ -563,8 +1234,22 @@ void PageHeap::RegisterSizeClass(Span* span, uint32 sc) {
 
 void PageHeap::GetSmallSpanStats(SmallSpanStats* result) {
   for (int i = 0; i < kMaxPages; i++) {
-    result->normal_length[i] = DLL_Length(&free_[i].normal);
-    result->returned_length[i] = DLL_Length(&free_[i].returned);
+    result->normal_length[i] = 0;
+    result->returned_length[i] = 0;
+    for (int node = 0; node < num_nodes_; node++) {
+      result->normal_length[i] += DLL_Length(&lists_[node]->free[i].normal);
+      result->returned_length[i] += DLL_Length(&lists_[node]->free[i].returned);
+    }
+  }
+  if (regions_ != NULL) {
+    for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+      const Length n = Static::sizemap()->class_to_pages(cl);
+      for (int node = 0; node < num_nodes_; node++) {
+        result->normal_length[n - 1] += DLL_Length(&regions_[cl].normal[node]);
+        result->returned_length[n - 1] +=
+            DLL_Length(&regions_[cl].returned[node]);
+      }
+    }
   }
 }
 
@@ -572,13 +1257,17 @@ void PageHeap::GetLargeSpanStats(LargeSpanStats* result) {
   result->spans = 0;
   result->normal_pages = 0;
   result->returned_pages = 0;
-  for (SpanSet::iterator it = large_normal_.begin(); it != large_normal_.end(); ++it) {
-    result->normal_pages += it->length;
-    result->spans++;
-  }
-  for (SpanSet::iterator it = large_returned_.begin(); it != large_returned_.end(); ++it) {
-    result->returned_pages += it->length;
-    result->spans++;
+  for (int node = 0; node < num_nodes_; node++) {
+    const SpanSet& normal = lists_[node]->large_normal;
+    const SpanSet& returned = lists_[node]->large_returned;
+    for (SpanSet::const_iterator it = normal.begin(); it != normal.end(); ++it) {
+      result->normal_pages += it->length;
+      result->spans++;
+    }
+    for (SpanSet::const_iterator it = returned.begin(); it != returned.end(); ++it) {
+      result->returned_pages += it->length;
+      result->spans++;
+    }
   }
 }
 
@@ -592,6 +1281,11 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
   r->fraction = 0;
   switch (span->location) {
     case Span::IN_USE:
+      if (span->cached) {
+        // Free, only kept for reuse by LargeSpanCache.
+        r->type = base::MallocRange::FREE;
+        break;
+      }
       r->type = base::MallocRange::INUSE;
       r->fraction = 1;
       if (span->sizeclass > 0) {
@@ -601,6 +1295,7 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
       }
       break;
     case Span::ON_NORMAL_FREELIST:
+    case Span::BEING_RELEASED:
       r->type = base::MallocRange::FREE;
       break;
     case Span::ON_RETURNED_FREELIST:
@@ -613,6 +1308,18 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
   return true;
 }
 
+bool PageHeap::EnsureHugePages(PageID p, Length n) {
+  if (!hugepage_aware_) return true;
+  const int kShift = kHugePageShift - kPageShift;
+  const uintptr_t first = p >> kShift;
+  const uintptr_t last = (p + n - 1) >> kShift;
+  if (!hugepages_.Ensure(first, last - first + 1)) return false;
+  for (uintptr_t hp = first; hp <= last; hp++) {
+    *hugepages_.Find(hp) |= HugePageMap::kOwned;
+  }
+  return true;
+}
+
 static void RecordGrowth(size_t growth) {
   StackTrace* t = Static::stacktrace_allocator()->New();
   t->depth = GetStackTrace(t->stack, kMaxStackDepth-1, 3);
@@ -621,21 +1328,54 @@ static void RecordGrowth(size_t growth) {
   Static::set_growth_stacks(t);
 }
 
-bool PageHeap::GrowHeap(Length n) {
+void* PageHeap::AllocFromSystem(Length n, size_t* actual_size,
+                                size_t alignment, int node) {
+  if (lock_ == NULL) {
+    void* ptr = TCMalloc_SystemAlloc(n << kPageShift, actual_size, alignment);
+    if (ptr != NULL) {
+      Static::numa_topology()->BindMemory(ptr, *actual_size, node);
+    }
+    return ptr;
+  }
+  // Reserve the pages against the heap limit, then let other threads
+  // use the heap while the system call (and the page faults of sbrk
+  // or of a SysAllocator that touches memory) is in progress.  The
+  // memory is published to the free lists by our caller once lock_
+  // is held again.
+  growing_pages_ += n;
+  lock_->Unlock();
+  void* ptr = TCMalloc_SystemAlloc(n << kPageShift, actual_size, alignment);
+  if (ptr != NULL) {
+    Static::numa_topology()->BindMemory(ptr, *actual_size, node);
+  }
+  lock_->Lock();
+  growing_pages_ -= n;
+  return ptr;
+}
+
+bool PageHeap::GrowHeap(Length n, int node) {
   ASSERT(kMaxPages >= kMinSystemAlloc);
   if (n > kMaxValidPages) return false;
+  size_t alignment = kPageSize;
+  if (hugepage_aware_) {
+    // Grow in whole, aligned hugepages so that the kernel can back them
+    // with huge pages.
+    if (n > kMaxValidPages - kPagesPerHugePage) return false;
+    n = (n + kPagesPerHugePage - 1) & ~static_cast<Length>(kPagesPerHugePage - 1);
+    alignment = kHugePageSize;
+  }
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
   size_t actual_size;
   void* ptr = NULL;
   if (EnsureLimit(ask)) {
-      ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+      ptr = AllocFromSystem(ask, &actual_size, alignment, node);
   }
   if (ptr == NULL) {
     if (n < ask) {
       // Try growing just "n" pages
       ask = n;
       if (EnsureLimit(ask)) {
-        ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+        ptr = AllocFromSystem(ask, &actual_size, alignment, node);
       }
     }
     if (ptr == NULL) return false;
@@ -649,6 +1389,7 @@ bool PageHeap::GrowHeap(Length n) {
   uint64_t old_system_bytes = stats_.system_bytes;
   stats_.system_bytes += (ask << kPageShift);
   stats_.committed_bytes += (ask << kPageShift);
+  node_stats_[node].system_bytes += (ask << kPageShift);
 
   stats_.total_commit_bytes += (ask << kPageShift);
   stats_.total_reserve_bytes += (ask << kPageShift);
@@ -668,12 +1409,17 @@ bool PageHeap::GrowHeap(Length n) {
   // Make sure pagemap_ has entries for all of the new pages.
   // Plus ensure one before and one after so coalescing code
   // does not need bounds-checking.
-  if (pagemap_.Ensure(p-1, ask+2)) {
+  if (pagemap_.Ensure(p-1, ask+2) && EnsureHugePages(p, ask)) {
     // Pretend the new area is allocated and then Delete() it to cause
     // any necessary coalescing to occur.
     Span* span = NewSpan(p, ask);
+    span->node = node;
     RecordSpan(span);
-    Delete(span);
+    if (hugepage_aware_) {
+      TCMalloc_SystemHugePageHint(ptr, ask << kPageShift);
+      UpdateHugePageUsage(span, 1);
+    }
+    FreeSpan(span, TCMalloc_SystemAllocZeroes());
     ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
     ASSERT(Check());
     return true;
@@ -690,11 +1436,30 @@ bool PageHeap::Check() {
 
 bool PageHeap::CheckExpensive() {
   bool result = Check();
-  CheckSet(&large_normal_, kMaxPages + 1, Span::ON_NORMAL_FREELIST);
-  CheckSet(&large_returned_, kMaxPages + 1, Span::ON_RETURNED_FREELIST);
-  for (int s = 1; s <= kMaxPages; s++) {
-    CheckList(&free_[s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
-    CheckList(&free_[s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+  for (int node = 0; node < num_nodes_; node++) {
+    FreeLists* lists = lists_[node];
+    CheckSet(&lists->large_normal, kMaxPages + 1, Span::ON_NORMAL_FREELIST);
+    CheckSet(&lists->large_returned, kMaxPages + 1, Span::ON_RETURNED_FREELIST);
+    for (int s = 1; s <= kMaxPages; s++) {
+      CheckList(&lists->free[s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
+      CheckList(&lists->free[s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+      CHECK_CONDITION(
+          (FindListBit(lists->normal_nonempty, s - 1) == s - 1) ==
+          !DLL_IsEmpty(&lists->free[s - 1].normal));
+      CHECK_CONDITION(
+          (FindListBit(lists->returned_nonempty, s - 1) == s - 1) ==
+          !DLL_IsEmpty(&lists->free[s - 1].returned));
+    }
+  }
+  if (regions_ != NULL) {
+    for (int cl = 1; cl < Static::num_size_classes(); cl++) {
+      const Length n = Static::sizemap()->class_to_pages(cl);
+      for (int node = 0; node < num_nodes_; node++) {
+        CheckList(&regions_[cl].normal[node], n, n, Span::ON_NORMAL_FREELIST);
+        CheckList(&regions_[cl].returned[node], n, n,
+                  Span::ON_RETURNED_FREELIST);
+      }
+    }
   }
   return result;
 }
@@ -712,14 +1477,22 @@ bool PageHeap::CheckList(Span* list, Length min_pages, Length max_pages,
 }
 
 bool PageHeap::CheckSet(SpanSet* spanset, Length min_pages,int freelist) {
+  const SpanSet::Entry* prev = NULL;
+  size_t count = 0;
   for (SpanSet::iterator it = spanset->begin(); it != spanset->end(); ++it) {
     Span* s = it->span;
     CHECK_CONDITION(s->length == it->length);
+    CHECK_CONDITION(s->start == it->start);
+    CHECK_CONDITION(prev == NULL || prev->length < it->length ||
+                    (prev->length == it->length && prev->start < it->start));
+    prev = &*it;
+    count++;
     CHECK_CONDITION(s->location == freelist);  // NORMAL or RETURNED
     CHECK_CONDITION(s->length >= min_pages);
     CHECK_CONDITION(GetDescriptor(s->start) == s);
     CHECK_CONDITION(GetDescriptor(s->start+s->length-1) == s);
   }
+  CHECK_CONDITION(count == spanset->size());
   return true;
 }
 
@@ -39,12 +39,14 @@
 #ifdef HAVE_STDINT_H
 #include <stdint.h>                     // for uint64_t, int64_t, uint16_t
 #endif
+#include <string.h>                     // for memset
 #include <gperftools/malloc_extension.h>
 #include "base/basictypes.h"
 #include "common.h"
 #include "packed-cache-inl.h"
 #include "pagemap.h"
 #include "span.h"
+#include "span_set.h"
 
 // We need to dllexport PageHeap just for the unittest.  MSVC complains
 // that we don't dllexport the PageHeap members, but we don't need to
@@ -69,6 +71,8 @@ namespace base {
 struct MallocRange;
 }
 
+class SpinLock;
+
 namespace tcmalloc {
 
 // -------------------------------------------------------------------------
@@ -85,7 +89,16 @@ template <int BITS> class MapSelector {
   typedef TCMalloc_PageMap3<BITS-kPageShift> Type;
 };
 
-#ifndef TCMALLOC_SMALL_BUT_SLOW
+#if defined(TCMALLOC_FLAT_PAGEMAP) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+// With TCMALLOC_FLAT_PAGEMAP, a lookup is a single load from an array
+// covering all 48 bits of address space, at the cost of reserving
+// (but not committing) 2^(51-kPageShift) bytes of address space.
+template <> class MapSelector<48> {
+ public:
+  typedef TCMalloc_PageMapFlat<48-kPageShift> Type;
+};
+
+#elif !defined(TCMALLOC_SMALL_BUT_SLOW)
 // x86-64 and arm64 are using 48 bits of address space. So we can use
 // just two level map, but since initial ram consumption of this mode
 // is a bit on the higher side, we opt-out of it in
@@ -97,12 +110,74 @@ template <> class MapSelector<48> {
 
 #endif // TCMALLOC_SMALL_BUT_SLOW
 
+// Bytes a pagemap holds that MetaDataAlloc did not count.
+template <class Map> inline size_t PageMapUncountedBytes(const Map& map) {
+  return 0;
+}
+template <int BITS>
+inline size_t PageMapUncountedBytes(const TCMalloc_PageMapFlat<BITS>& map) {
+  return map.committed_bytes();
+}
+
 // A two-level map for 32-bit machines
 template <> class MapSelector<32> {
  public:
   typedef TCMalloc_PageMap2<32-kPageShift> Type;
 };
 
+// -------------------------------------------------------------------------
+// Map from hugepage number to per-hugepage bookkeeping
+// -------------------------------------------------------------------------
+
+// Used by the hugepage-aware mode of PageHeap.  Each entry holds the number
+// of pages of the hugepage that are in use, plus the flags below.  Two
+// levels; leaves are allocated on demand by Ensure().
+class HugePageMap {
+ public:
+  static const uint16 kOwned = 0x8000;     // Hugepage belongs to the heap
+  static const uint16 kReleased = 0x4000;  // Whole hugepage was released
+  static const uint16 kUsedMask = 0x3fff;
+
+  static const int kBits = kAddressBits - kHugePageShift;
+  static const int kLeafBits = kBits < 15 ? kBits : 15;
+  static const int kRootBits = kBits - kLeafBits;
+  static const int kLeafLength = 1 << kLeafBits;
+  static const int kRootLength = 1 << kRootBits;
+
+  HugePageMap() {
+    memset(root_, 0, sizeof(root_));
+  }
+
+  // Returns the entry of hugepage hp, or NULL if it was never ensured.
+  uint16* Find(uintptr_t hp) const {
+    uint16* leaf = root_[hp >> kLeafBits];
+    return leaf == NULL ? NULL : &leaf[hp & (kLeafLength - 1)];
+  }
+
+  // Returns leaf i (kLeafLength entries), which may be NULL.
+  uint16* leaf(int i) const { return root_[i]; }
+
+  // Makes sure entries for hugepages [start, start+n) exist.
+  bool Ensure(uintptr_t start, size_t n) {
+    for (uintptr_t key = start; key < start + n; ) {
+      const uintptr_t i = key >> kLeafBits;
+      if (i >= kRootLength) return false;
+      if (root_[i] == NULL) {
+        const size_t bytes = sizeof(uint16) * kLeafLength;
+        uint16* leaf = reinterpret_cast<uint16*>(MetaDataAlloc(bytes));
+        if (leaf == NULL) return false;
+        memset(leaf, 0, bytes);
+        root_[i] = leaf;
+      }
+      key = (i + 1) << kLeafBits;
+    }
+    return true;
+  }
+
+ private:
+  uint16* root_[kRootLength];
+};
+
 // -------------------------------------------------------------------------
 // Page-level allocator
 //  * Eager coalescing
@@ -113,17 +188,31 @@ template <> class MapSelector<32> {
 
 class PERFTOOLS_DLL_DECL PageHeap {
  public:
-  PageHeap();
+  // "lock", if given, is the lock callers hold around every call.  It
+  // is dropped while asking the system for more memory.
+  explicit PageHeap(SpinLock* lock = NULL);
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
   // Caller should not pass "n == 0" -- instead, n should have
-  // been rounded up already.
-  Span* New(Length n);
+  // been rounded up already.  With several NUMA nodes the pages come
+  // from the free lists of "node", or from the other nodes' if no more
+  // memory can be had for it.
+  Span* New(Length n, int node = 0);
+
+  // Grows the heap of each node unless at least "watermark" free pages,
+  // mapped or not, are available on it already.  Used to grow ahead of
+  // demand.
+  void Pregrow(Length watermark);
 
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
-  void Delete(Span* span);
+  void Delete(Span* span) { FreeSpan(span, false); }
+
+  // Like New(n, node) followed by RegisterSizeClass(span, sc).  With
+  // size class regions, the span is taken from the region of "sc", and
+  // only while it has room; all spans of a class have the same length.
+  Span* NewForSizeClass(Length n, uint32 sc, int node = 0);
 
   // Mark an allocated span as being used for small objects of the
   // specified size-class.
@@ -141,6 +230,21 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // REQUIRES: span->sizeclass == 0
   Span* Split(Span* span, Length n);
 
+  // Grows the allocated span "span" to "n" pages in place, by taking
+  // the pages after it from the free span that follows it.  Returns
+  // false, leaving "span" unchanged, if those pages are not free.
+  //
+  // REQUIRES: "n > span->length"
+  // REQUIRES: span->location == IN_USE
+  // REQUIRES: span->sizeclass == 0
+  bool Extend(Span* span, Length n);
+
+  // Like Delete(span), for a span whose pages the caller has already
+  // given back to the system, e.g. by moving them elsewhere with
+  // TCMalloc_SystemMove().  The span goes to the returned free lists.
+  // REQUIRES: !GetHugePageAware() and span is not in a size class region
+  void DeleteReleased(Span* span);
+
   // Return the descriptor for the specified page.  Returns NULL if
   // this PageID was not allocated previously.
   inline ATTRIBUTE_ALWAYS_INLINE
@@ -157,9 +261,12 @@ class PERFTOOLS_DLL_DECL PageHeap {
     Stats() : system_bytes(0), free_bytes(0), unmapped_bytes(0), committed_bytes(0),
         scavenge_count(0), commit_count(0), total_commit_bytes(0),
         decommit_count(0), total_decommit_bytes(0),
-        reserve_count(0), total_reserve_bytes(0) {}
+        reserve_count(0), total_reserve_bytes(0),
+        reuse_count(0), quick_reuse_count(0), total_reuse_bytes(0),
+        total_reuse_ticks(0) {}
     uint64_t system_bytes;    // Total bytes allocated from system
     uint64_t free_bytes;      // Total bytes on normal freelists
+                              // or being released
     uint64_t unmapped_bytes;  // Total bytes on returned freelists
     uint64_t committed_bytes;  // Bytes committed, always <= system_bytes_.
 
@@ -172,9 +279,30 @@ class PERFTOOLS_DLL_DECL PageHeap {
 
     uint64_t reserve_count;         // Number of virtual memory reserves
     uint64_t total_reserve_bytes;   // Bytes reserved in lifetime of process
+
+    // Released spans taken off the returned free lists again.  A reuse
+    // is quick when it comes within kQuickReuseTicks of the release.
+    uint64_t reuse_count;           // Number of released spans reused
+    uint64_t quick_reuse_count;     // Number of those reused quickly
+    uint64_t total_reuse_bytes;     // Bytes reused in lifetime of process
+    uint64_t total_reuse_ticks;     // Release ticks from release to reuse
   };
   inline Stats stats() const { return stats_; }
 
+  // Bytes of the pagemap that are not included in metadata_system_bytes().
+  size_t pagemap_bytes() const { return PageMapUncountedBytes(pagemap_); }
+
+  // Part of Stats for the memory of one NUMA node.
+  struct NodeStats {
+    NodeStats() : system_bytes(0), free_bytes(0), unmapped_bytes(0) {}
+    uint64_t system_bytes;    // Bytes allocated from system for the node
+    uint64_t free_bytes;      // Bytes on the node's normal freelists
+                              // or being released
+    uint64_t unmapped_bytes;  // Bytes on the node's returned freelists
+  };
+  // REQUIRES: 0 <= node < GetNumaNodes()
+  NodeStats node_stats(int node) const { return node_stats_[node]; }
+
   struct SmallSpanStats {
     // For each free list of small spans, the length (in spans) of the
     // normal and returned free lists for that size.
@@ -193,6 +321,20 @@ class PERFTOOLS_DLL_DECL PageHeap {
   };
   void GetLargeSpanStats(LargeSpanStats* result);
 
+  // Occupancy of the hugepages backing the heap; only gathered in
+  // hugepage-aware mode.
+  struct HugePageStats {
+    int64 hugepages;   // Hugepages owned by the heap
+    int64 free;        // ... with no page in use
+    int64 released;    // ... of which wholly returned to the OS
+    int64 full;        // ... with every page in use
+    // Partially used hugepages, by fraction of pages in use:
+    // (0, 1/4], (1/4, 1/2], (1/2, 3/4], (3/4, 1).
+    int64 partial[4];
+    int64 partial_used_pages;  // Pages in use on partial hugepages
+  };
+  void GetHugePageStats(HugePageStats* result);
+
   bool Check();
   // Like Check() but does some more comprehensive checking.
   bool CheckExpensive();
@@ -205,11 +347,41 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // num_pages if there weren't enough pages to release. The result
   // may also be larger than num_pages since page_heap might decide to
   // release one large range instead of fragmenting it into two
-  // smaller released and unreleased ranges.
+  // smaller released and unreleased ranges.  In hugepage-aware mode
+  // only whole hugepages are released, unless num_pages exceeds the
+  // number of free pages.
   Length ReleaseAtLeastNPages(Length num_pages);
 
+  // Advances the release clock by one tick and releases about
+  // 'fraction' of the free pages, taking only spans that have been free
+  // for at least a whole tick plus GetReleaseDelay(), oldest first.
+  // Called periodically by the background release thread.  Returns the
+  // number of pages released.
+  Length ReleaseIdlePages(double fraction);
+
+  // A released span reused within this many release ticks was not
+  // worth releasing.
+  static const uint32 kQuickReuseTicks = 2;
+
+  // Extra release ticks a span must have been free before
+  // ReleaseIdlePages() or IncrementalScavenge() release it.  Raised
+  // when released spans are reused quickly, and lowered again when
+  // they are not.  ReleaseAtLeastNPages() and aggressive decommit do
+  // not wait.
+  uint32 GetReleaseDelay(void) const {return release_delay_;}
+
   // Reads and writes to pagemap_cache_ do not require locking.
   bool TryGetSizeClass(PageID p, uint32* out) const {
+    // The size class of a page in a size class region follows from its
+    // address, up to where the region has been carved into spans so
+    // far; next only grows.  Without regions, regions_pages_ is 0.
+    const PageID offset = p - regions_start_;
+    if (offset < regions_pages_) {
+      const uint32 cl = (offset >> kRegionPageShift) + 1;
+      if (p >= regions_[cl].next) return false;
+      *out = cl;
+      return true;
+    }
     return pagemap_cache_.TryGet(p, out);
   }
   void SetCachedSizeClass(PageID p, uint32 cl) {
@@ -230,6 +402,43 @@ class PERFTOOLS_DLL_DECL PageHeap {
     aggressive_decommit_ = aggressive_decommit;
   }
 
+  // In hugepage-aware mode the heap grows in whole, aligned hugepages,
+  // small spans are placed on the fullest hugepages available, and memory
+  // is only returned to the OS in whole hugepages (aggressive decommit is
+  // ignored).  Must be set before the first allocation.
+  bool GetHugePageAware(void) {return hugepage_aware_;}
+  void SetHugePageAware(bool hugepage_aware) {
+    ASSERT(stats_.system_bytes == 0);
+    hugepage_aware_ = hugepage_aware;
+  }
+
+  // With background release on, freeing memory never returns it to
+  // the OS: IncrementalScavenge() and aggressive decommit are skipped,
+  // and a background thread calls ReleaseIdlePages() instead.
+  bool GetBackgroundRelease(void) {return background_release_;}
+  void SetBackgroundRelease(bool background_release) {
+    background_release_ = background_release;
+  }
+
+  // With size class regions, every small size class gets an address
+  // range of its own, from which the spans of the class are carved, so
+  // that TryGetSizeClass() needs no lookup for them.  Free spans stay
+  // in the region of their class and are never coalesced.  Must be set
+  // before the first allocation.  Returns false if the address space
+  // could not be reserved.
+  bool GetSizeClassRegions(void) const {return regions_ != NULL;}
+  bool SetSizeClassRegions(bool enable);
+  bool InSizeClassRegion(PageID p) const {
+    return p - regions_start_ < regions_pages_;
+  }
+
+  // Number of NUMA nodes the free lists are partitioned into.  Spans
+  // are never coalesced across nodes, and memory grown for a node is
+  // bound to it (see NumaTopology).  Must be set before the first
+  // allocation.  Returns false if the lists could not be allocated.
+  int GetNumaNodes(void) const {return num_nodes_;}
+  bool SetNumaNodes(int nodes);
+
  private:
   // Allocates a big block of memory for the pagemap once we reach more than
   // 128MB
@@ -253,6 +462,10 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // scavenging again.  With 4K pages, this comes to 1GB of memory.
   static const int kDefaultReleaseDelay = 1 << 18;
 
+  // Bound on release_delay_.  With background release, this comes to
+  // 6.4 seconds.
+  static const uint32 kMaxReleaseDelayTicks = 64;
+
   // Pick the appropriate map and cache types based on pointer size
   typedef MapSelector<kAddressBits>::Type PageMap;
   typedef PackedCache<kAddressBits - kPageShift> PageMapCache;
@@ -267,24 +480,62 @@ class PERFTOOLS_DLL_DECL PageHeap {
     Span        returned;
   };
 
-  // Sets of spans with length > kMaxPages.
-  //
-  // Rather than using a linked list, we use sets here for efficient
-  // best-fit search.
-  SpanSet large_normal_;
-  SpanSet large_returned_;
+  // The free spans of one NUMA node.
+  struct FreeLists {
+    // Sets of spans with length > kMaxPages.
+    //
+    // Rather than using a linked list, we use sets here for efficient
+    // best-fit search.
+    SpanSet large_normal;
+    SpanSet large_returned;
 
-  // Array mapping from span length to a doubly linked list of free spans
-  //
-  // NOTE: index 'i' stores spans of length 'i + 1'.
-  SpanList free_[kMaxPages];
+    // Array mapping from span length to a doubly linked list of free spans
+    //
+    // NOTE: index 'i' stores spans of length 'i + 1'.
+    SpanList free[kMaxPages];
+
+    // Bit i is set iff free[i].normal (resp. free[i].returned) is not
+    // empty, so the smallest fitting list is found a word at a time
+    // instead of by looking at every list.
+    static const int kBitmapWords = (kMaxPages + 63) / 64;
+    uint64 normal_nonempty[kBitmapWords];
+    uint64 returned_nonempty[kBitmapWords];
+
+    FreeLists();
+  };
+
+  // Lists of node 0 are kept inline, the others' are allocated by
+  // SetNumaNodes.
+  FreeLists node0_lists_;
+  FreeLists* lists_[kMaxNumaNodes];
+  int num_nodes_;
 
   // Statistics on system, free, and unmapped bytes
   Stats stats_;
+  NodeStats node_stats_[kMaxNumaNodes];
+
+  Span* SearchFreeAndLargeLists(Length n, int node);
+
+  // Most spans returned to the system in one go.
+  static const int kReleaseBatchSize = 64;
+
+  // Free spans taken off the free lists to be returned to the system
+  // together.  Since they can not be allocated meanwhile, nobody
+  // touches them while lock_ is dropped for the release.
+  struct ReleaseBatch {
+    Span* spans[kReleaseBatchSize];
+    int count;
+    Length pages;
+
+    ReleaseBatch() : count(0), pages(0) { }
+  };
 
-  Span* SearchFreeAndLargeLists(Length n);
+  bool GrowHeap(Length n, int node);
 
-  bool GrowHeap(Length n);
+  // Gets "n" pages for "node" from the system, dropping lock_ meanwhile.
+  // Pages being allocated count against the heap limit.
+  void* AllocFromSystem(Length n, size_t* actual_size, size_t alignment,
+                        int node);
 
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
@@ -302,13 +553,21 @@ class PERFTOOLS_DLL_DECL PageHeap {
     }
   }
 
-  // Allocate a large span of length == n.  If successful, returns a
-  // span of exactly the specified length.  Else, returns NULL.
-  Span* AllocLarge(Length n);
+  // Allocate a large span of length == n from the lists of "node".  If
+  // successful, returns a span of exactly the specified length.  Else,
+  // returns NULL.
+  Span* AllocLarge(Length n, int node);
+
+  // Delete(span), where "known_zero" says whether the pages of span
+  // are known to read as zero because they are fresh from the system.
+  void FreeSpan(Span* span, bool known_zero);
 
   // Coalesce span with neighboring spans if possible, prepend to
-  // appropriate free list, and adjust stats.
-  void MergeIntoFreeList(Span* span);
+  // appropriate free list, and adjust stats.  The result is known to
+  // be zero only if all the merged spans were.  With "keep_zero", a
+  // span known to be zero is not coalesced with neighbours that are
+  // not.
+  void MergeIntoFreeList(Span* span, bool keep_zero = false);
 
   // Commit the span.
   void CommitSpan(Span* span);
@@ -319,26 +578,83 @@ class PERFTOOLS_DLL_DECL PageHeap {
   // Prepends span to appropriate free list, and adjusts stats.
   void PrependToFreeList(Span* span);
 
+  // Hugepage-aware mode helpers.
+
+  // Adds delta to the in-use page counts of the hugepages span covers.
+  void UpdateHugePageUsage(Span* span, int delta);
+
+  // Returns the number of in-use pages of the hugepage containing page p.
+  int HugePageUsage(PageID p) const;
+
+  // Returns the span of free list 'list' sitting on the fullest hugepage,
+  // looking at the first few spans only.  REQUIRES: list is not empty.
+  Span* PickFullestSpan(Span* list);
+
+  // Marks the hugepages entirely inside span s as released.
+  void MarkHugePagesReleased(Span* s);
+
+  // Adds the whole hugepages inside free span s to batch, leaving any
+  // unaligned head and tail on the normal free lists.  Returns the
+  // number of pages added.
+  Length AddHugePagesToReleaseBatch(Span* s, ReleaseBatch* batch);
+
+  // Like ReleasePages for hugepage-aware mode.
+  Length ReleaseAtLeastNHugePagePages(Length num_pages, uint32 min_idle);
+
+  // Makes sure hugepages_ covers pages [p, p+n) and marks those hugepages
+  // as owned.  Always succeeds outside hugepage-aware mode.
+  bool EnsureHugePages(PageID p, Length n);
+
   // Removes span from its free list, and adjust stats.
   void RemoveFromFreeList(Span* span);
 
+  // Like ReleaseAtLeastNPages, but only considers spans that have been
+  // free for at least min_idle release ticks.
+  Length ReleasePages(Length num_pages, uint32 min_idle);
+
+  // Returns true if free span s was freed (or, on the returned free
+  // lists, released) at least 'ticks' release ticks ago.
+  bool IdleFor(const Span* s, uint32 ticks) const {
+    return ((release_tick_ - s->free_tick) & Span::kFreeTickMask) >= ticks;
+  }
+
+  // Whether freed spans are decommitted right away.
+  bool DecommitAggressively() const {
+    return aggressive_decommit_ && !hugepage_aware_ && !background_release_;
+  }
+
+  // Advances release_tick_, and lowers release_delay_ once it has gone
+  // that many ticks without a quick reuse.
+  void AdvanceReleaseTick();
+
+  // Accounts for span, which was on the returned free lists, being
+  // allocated again, and raises release_delay_ if that came quickly.
+  void RecordReuse(const Span* span);
+
   // Incrementally release some memory to the system.
   // IncrementalScavenge(n) is called whenever n pages are freed.
   void IncrementalScavenge(Length n);
 
-  // Attempts to decommit 's' and move it to the returned freelist.
-  //
-  // Returns the length of the Span or zero if release failed.
-  //
-  // REQUIRES: 's' must be on the NORMAL freelist.
-  Length ReleaseSpan(Span *s);
+  // Adds (sign > 0) or subtracts the bytes of s, which is being
+  // released, to or from free_bytes.  Such spans still count as free
+  // until FlushReleaseBatch settles them.
+  void AddReleasingBytes(const Span* s, int sign);
+
+  // Takes 's' off the NORMAL freelist, or that of its size class
+  // region, and adds it to batch.  The batch must not be full.
+  void AddToReleaseBatch(Span* s, ReleaseBatch* batch);
+
+  // Returns the spans in batch to the system, with lock_ dropped, and
+  // puts them back on the free lists; on the returned ones if that
+  // worked.  Returns the number of pages released and empties batch.
+  Length FlushReleaseBatch(ReleaseBatch* batch);
 
   // Checks if we are allowed to take more memory from the system.
   // If limit is reached and allowRelease is true, tries to release
   // some unused spans.
   bool EnsureLimit(Length n, bool allowRelease = true);
 
-  Span* CheckAndHandlePreMerge(Span *span, Span *other);
+  Span* CheckAndHandlePreMerge(Span *span, Span *other, bool keep_zero);
 
   // Number of pages to deallocate before doing more scavenging
   int64_t scavenge_counter_;
@@ -347,6 +663,67 @@ class PERFTOOLS_DLL_DECL PageHeap {
   int release_index_;
 
   bool aggressive_decommit_;
+
+  bool hugepage_aware_;
+  HugePageMap hugepages_;
+
+  bool background_release_;
+
+  SpinLock* const lock_;
+
+  // Pages being allocated from the system with lock_ dropped.
+  Length growing_pages_;
+
+  // Advanced by ReleaseIdlePages, or by IncrementalScavenge without
+  // background release; free spans are stamped with it when freed,
+  // and again when released.
+  uint32 release_tick_;
+
+  // See GetReleaseDelay().
+  uint32 release_delay_;
+  // release_tick_ of the last quick reuse, or of the last change of
+  // release_delay_ since.
+  uint32 quick_reuse_tick_;
+
+  // Size class regions: the region of class cl starts at page
+  // regions_start_ + ((cl - 1) << kRegionPageShift).
+  static const int kRegionPageShift = 32 - kPageShift;
+  // Regions are made writable this many pages at a time.
+  static const Length kRegionCommitPages = kMaxPages;
+
+  struct ClassRegion {
+    PageID next;              // First page not carved into a span yet
+    PageID committed;         // First page not writable yet
+    PageID end;
+    // Indexed by NUMA node, num_nodes_ entries each.
+    Span* normal;             // Free spans
+    Span* returned;           // Free spans released to the system
+  };
+
+  ClassRegion* regions_;      // Indexed by size class, or NULL
+  PageID regions_start_;
+  Length regions_pages_;
+
+  // Carves a new span of n pages for class sc from its region.  Returns
+  // NULL if the region is full or the memory could not be had.
+  Span* GrowClassRegion(Length n, uint32 sc, int node);
+
+  // Returns the region holding page p, or NULL.
+  ClassRegion* RegionOf(PageID p) const {
+    if (!InSizeClassRegion(p)) return NULL;
+    return &regions_[((p - regions_start_) >> kRegionPageShift) + 1];
+  }
+
+  // Puts span, from a size class region, on the free list of its region
+  // for its location and node.
+  void DeleteFromRegion(Span* span, ClassRegion* region);
+
+  // Takes span off the free list of its region.
+  void RemoveFromRegion(Span* span);
+
+  // Releases up to num_pages of the free spans of the size class
+  // regions that have been free for min_idle ticks.
+  Length ReleaseRegionPages(Length num_pages, uint32 min_idle);
 };
 
 }  // namespace tcmalloc
@@ -37,7 +37,9 @@
 // addresses.  Both representations provide the same interface.  The
 // first representation is implemented as a flat array, the seconds as
 // a three-level radix tree that strips away approximately 1/3rd of
-// the bits every time.
+// the bits every time.  A third one, for 64-bit systems that can spare
+// the address space, is a flat array in a virtual memory reservation
+// that is committed as the heap grows.
 //
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
@@ -58,6 +60,7 @@
 #include <sys/types.h>
 #endif
 #include "internal_logging.h"  // for ASSERT
+#include "system-alloc.h"      // for TCMalloc_SystemReserve
 
 // Single-level array
 template <int BITS>
@@ -325,4 +328,101 @@ class TCMalloc_PageMap3 {
   }
 };
 
+// Single-level array in one address space reservation.  Entries read
+// as NULL until the part of the array holding them is committed by
+// Ensure(), so get() is a single load for any page number, and only
+// the parts of the array covering the heap take memory.
+template <int BITS>
+class TCMalloc_PageMapFlat {
+ private:
+  // The array is committed in chunks of this many entries.
+  static const int CHUNK_BITS = BITS < 15 ? BITS : 15;
+  static const int CHUNK_LENGTH = 1 << CHUNK_BITS;
+  static const size_t CHUNKS = size_t(1) << (BITS - CHUNK_BITS);
+  static const size_t COMMITTED_WORDS = (CHUNKS + 63) / 64;
+
+  void** array_;
+  uint64_t committed_[COMMITTED_WORDS];  // Bit per committed chunk
+  size_t committed_bytes_;
+
+  bool IsCommitted(size_t chunk) const {
+    return (committed_[chunk / 64] >> (chunk % 64)) & 1;
+  }
+
+ public:
+  typedef uintptr_t Number;
+
+  // The allocator is not used: the array is reserved up front.
+  explicit TCMalloc_PageMapFlat(void* (*allocator)(size_t)) {
+    array_ = reinterpret_cast<void**>(
+        TCMalloc_SystemReserve(sizeof(void*) << BITS));
+    if (array_ == NULL) {
+      tcmalloc::Log(tcmalloc::kCrash, __FILE__, __LINE__,
+                    "cannot reserve address space for the pagemap");
+    }
+    memset(committed_, 0, sizeof(committed_));
+    committed_bytes_ = 0;
+  }
+
+  ATTRIBUTE_ALWAYS_INLINE
+  void* get(Number k) const {
+    if ((k >> BITS) > 0) {
+      return NULL;
+    }
+    return array_[k];
+  }
+
+  // REQUIRES "k" is in range "[0,2^BITS-1]".
+  // REQUIRES "k" has been ensured before.
+  void set(Number k, void* v) {
+    ASSERT(k >> BITS == 0);
+    ASSERT(IsCommitted(k >> CHUNK_BITS));
+    array_[k] = v;
+  }
+
+  bool Ensure(Number start, size_t n) {
+    if (n > (Number(1) << BITS) - start) return false;
+    const size_t last = (start + n - 1) >> CHUNK_BITS;
+    for (size_t chunk = start >> CHUNK_BITS; chunk <= last; chunk++) {
+      if (IsCommitted(chunk)) continue;
+      // Commit the whole run of uncommitted chunks at once.
+      size_t end = chunk + 1;
+      while (end <= last && !IsCommitted(end)) end++;
+      const size_t bytes = (end - chunk) * CHUNK_LENGTH * sizeof(void*);
+      if (!TCMalloc_SystemCommitReserved(array_ + chunk * CHUNK_LENGTH,
+                                         bytes)) {
+        return false;
+      }
+      for (; chunk < end; chunk++) {
+        committed_[chunk / 64] |= uint64_t(1) << (chunk % 64);
+      }
+      committed_bytes_ += bytes;
+    }
+    return true;
+  }
+
+  void PreallocateMoreMemory() {}
+
+  // Bytes of the array committed so far.
+  size_t committed_bytes() const { return committed_bytes_; }
+
+  void* Next(Number k) const {
+    while (k < (Number(1) << BITS)) {
+      const size_t chunk = k >> CHUNK_BITS;
+      if (committed_[chunk / 64] == 0) {
+        // Skip to the next word of the bitmap
+        k = Number((chunk / 64 + 1) * 64) << CHUNK_BITS;
+        continue;
+      }
+      if (IsCommitted(chunk)) {
+        for (Number end = Number(chunk + 1) << CHUNK_BITS; k < end; k++) {
+          if (array_[k] != NULL) return array_[k];
+        }
+      }
+      k = Number(chunk + 1) << CHUNK_BITS;
+    }
+    return NULL;
+  }
+};
+
 #endif  // TCMALLOC_PAGEMAP_H_
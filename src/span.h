@@ -37,32 +37,22 @@
 #define TCMALLOC_SPAN_H_
 
 #include <config.h>
-#include <set>
 #include "common.h"
 #include "base/logging.h"
-#include "page_heap_allocator.h"
 
 namespace tcmalloc {
 
-struct SpanBestFitLess;
-struct Span;
-
-// Store a pointer to a span along with a cached copy of its length.
-// These are used as set elements to improve the performance of
-// comparisons during tree traversal: the lengths are inline with the
-// tree nodes and thus avoid expensive cache misses to dereference
-// the actual Span objects in most cases.
-struct SpanPtrWithLength {
-  explicit SpanPtrWithLength(Span* s);
-
-  Span* span;
-  Length length;
-};
-typedef std::set<SpanPtrWithLength, SpanBestFitLess, STLPageHeapAllocator<SpanPtrWithLength, void> > SpanSet;
-
-// Comparator for best-fit search, with address order as a tie-breaker.
-struct SpanBestFitLess {
-  bool operator()(SpanPtrWithLength a, SpanPtrWithLength b) const;
+// Free objects of a span whose size class keeps them in bitmaps (see
+// CentralFreeList::SetSpanBitmaps()).  The bitmaps live outside the
+// span, so freeing an object, or looking for the free pages of the
+// span, does not touch the memory of the objects.
+struct SpanBitmap {
+  static const int kMaxObjects = 1024;
+
+  uint64 free[kMaxObjects / 64];           // Set for free objects
+  uint64 released[(kMaxPages + 63) / 64];  // Set for pages given back
+  uint16 free_count;                       // Number of bits set in free
+  uint16 released_count;                   // Number of bits set in released
 };
 
 // Information kept for a span (a contiguous run of pages).
@@ -72,26 +62,22 @@ struct Span {
   Span*         next;           // Used when in link list
   Span*         prev;           // Used when in link list
   union {
-    void* objects;              // Linked list of free objects
-
-    // Span may contain iterator pointing back at SpanSet entry of
-    // this span into set of large spans. It is used to quickly delete
-    // spans from those sets. span_iter_space is space for such
-    // iterator which lifetime is controlled explicitly.
-    char span_iter_space[sizeof(SpanSet::iterator)];
+    void*       objects;        // Linked list of free objects
+    SpanBitmap* bitmap;         // Or free objects, for bitmap size classes
   };
+  char*         untouched;      // First object never handed out, or NULL
   unsigned int  refcount : 16;  // Number of non-free objects
   unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
   unsigned int  location : 2;   // Is the span on a freelist, and if so, which?
   unsigned int  sample : 1;     // Sampled object?
-  bool          has_span_iter : 1; // Iff span_iter_space has valid
-                                   // iterator. Only for debug builds.
+  unsigned int  central_shard : 4; // Central free list shard owning the span
+  unsigned int  cached : 1;     // Freed large span kept in LargeSpanCache
+  unsigned int  free_tick : 27; // PageHeap release tick when last freed
+  unsigned int  known_zero : 1; // Free span whose pages all read as zero
+  unsigned int  node : 4;       // NUMA node whose page heap lists own the span
 
-  // Sets iterator stored in span_iter_space.
-  // Requires has_span_iter == 0.
-  void SetSpanSetIterator(const SpanSet::iterator& iter);
-  // Copies out and destroys iterator stored in span_iter_space.
-  SpanSet::iterator ExtractSpanSetIterator();
+  // free_tick wraps around; compare ticks modulo this.
+  static const uint32 kFreeTickMask = (1u << 27) - 1;
 
 #undef SPAN_HISTORY
 #ifdef SPAN_HISTORY
@@ -101,8 +87,10 @@ struct Span {
   int value[64];
 #endif
 
-  // What freelist the span is on: IN_USE if on none, or normal or returned
-  enum { IN_USE, ON_NORMAL_FREELIST, ON_RETURNED_FREELIST };
+  // What freelist the span is on: IN_USE if on none, or normal or
+  // returned.  BEING_RELEASED spans are free but off the free lists
+  // while they are being returned to the system.
+  enum { IN_USE, ON_NORMAL_FREELIST, ON_RETURNED_FREELIST, BEING_RELEASED };
 };
 
 #ifdef SPAN_HISTORY
@@ -111,39 +99,6 @@ void Event(Span* span, char op, int v = 0);
 #define Event(s,o,v) ((void) 0)
 #endif
 
-inline SpanPtrWithLength::SpanPtrWithLength(Span* s)
-    : span(s),
-      length(s->length) {
-}
-
-inline bool SpanBestFitLess::operator()(SpanPtrWithLength a, SpanPtrWithLength b) const {
-  if (a.length < b.length)
-    return true;
-  if (a.length > b.length)
-    return false;
-  return a.span->start < b.span->start;
-}
-
-inline void Span::SetSpanSetIterator(const SpanSet::iterator& iter) {
-  ASSERT(!has_span_iter);
-  has_span_iter = 1;
-
-  new (span_iter_space) SpanSet::iterator(iter);
-}
-
-inline SpanSet::iterator Span::ExtractSpanSetIterator() {
-  typedef SpanSet::iterator iterator_type;
-
-  ASSERT(has_span_iter);
-  has_span_iter = 0;
-
-  iterator_type* this_iter =
-    reinterpret_cast<iterator_type*>(span_iter_space);
-  iterator_type retval = *this_iter;
-  this_iter->~iterator_type();
-  return retval;
-}
-
 // Allocator/deallocator for spans
 Span* NewSpan(PageID p, Length len);
 void DeleteSpan(Span* span);
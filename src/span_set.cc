@@ -0,0 +1,475 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <config.h>
+#include "span_set.h"
+
+#include <string.h>                     // for memmove
+
+#include "internal_logging.h"           // for ASSERT
+#include "page_heap_allocator.h"        // for PageHeapAllocator
+#include "span.h"
+
+namespace tcmalloc {
+
+// Entries of a leaf, or separating keys of an inner node.
+struct SpanSet::Node {
+  int count;
+};
+
+struct SpanSet::Leaf : public SpanSet::Node {
+  static const int kSlots = 16;
+  // Merging only below a quarter full, not half, keeps a span that is
+  // erased and inserted again from merging and splitting the same leaf.
+  static const int kMinCount = kSlots / 4;
+
+  Leaf* prev;
+  Leaf* next;
+  Entry entries[kSlots];
+};
+
+// children[i] holds the entries below keys[i], children[i + 1] those at
+// or above it.  Only the length and start of a key are used.
+struct SpanSet::Inner : public SpanSet::Node {
+  static const int kSlots = 15;
+  static const int kMinCount = kSlots / 4;
+
+  Entry keys[kSlots];
+  Node* children[kSlots + 1];
+};
+
+bool SpanSet::allocators_initialized_;
+PageHeapAllocator<SpanSet::Leaf> SpanSet::leaf_allocator_;
+PageHeapAllocator<SpanSet::Inner> SpanSet::inner_allocator_;
+
+// Orders by length, then by start.  Written as one wide comparison, or
+// without && and ||, so that it compiles to flag arithmetic rather than
+// branches, which the searches below would mispredict a lot.
+static inline bool Less(Length a_length, PageID a_start,
+                        Length b_length, PageID b_start) {
+#ifdef __SIZEOF_INT128__
+  typedef unsigned __int128 Key;
+  return ((static_cast<Key>(a_length) << 64) | a_start) <
+      ((static_cast<Key>(b_length) << 64) | b_start);
+#else
+  return (a_length < b_length) |
+      ((a_length == b_length) & (a_start < b_start));
+#endif
+}
+
+static inline bool Less(const SpanSet::Entry& a, const SpanSet::Entry& b) {
+  return Less(a.length, a.start, b.length, b.start);
+}
+
+// Returns the number of keys[0, count) that are below (length, start).
+// Nodes are small, so counting every key is cheaper than a search that
+// stops early: the loop has no data-dependent branches.
+static inline int LowerBound(const SpanSet::Entry* keys, int count,
+                             Length length, PageID start) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    n += Less(keys[i].length, keys[i].start, length, start);
+  }
+  return n;
+}
+
+// Returns the number of keys[0, count) that are not above (length, start).
+static inline int UpperBound(const SpanSet::Entry* keys, int count,
+                             Length length, PageID start) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    n += !Less(length, start, keys[i].length, keys[i].start);
+  }
+  return n;
+}
+
+SpanSet::Leaf* SpanSet::NewLeaf() {
+  if (!allocators_initialized_) {
+    leaf_allocator_.Init();
+    inner_allocator_.Init();
+    allocators_initialized_ = true;
+  }
+  Leaf* leaf = leaf_allocator_.New();
+  leaf->count = 0;
+  leaf->prev = NULL;
+  leaf->next = NULL;
+  return leaf;
+}
+
+SpanSet::Inner* SpanSet::NewInner() {
+  ASSERT(allocators_initialized_);
+  Inner* inner = inner_allocator_.New();
+  inner->count = 0;
+  return inner;
+}
+
+SpanSet::Leaf* SpanSet::FindLeaf(Length length, PageID start,
+                                 PathElement* path) const {
+  Node* node = root_;
+  for (int level = 0; level < height_; level++) {
+    Inner* inner = static_cast<Inner*>(node);
+    const int i = UpperBound(inner->keys, inner->count, length, start);
+    path[level].node = inner;
+    path[level].child = i;
+    node = inner->children[i];
+  }
+  return static_cast<Leaf*>(node);
+}
+
+SpanSet::Leaf* SpanSet::FirstLeaf() const {
+  Node* node = root_;
+  for (int level = 0; level < height_; level++) {
+    node = static_cast<Inner*>(node)->children[0];
+  }
+  return static_cast<Leaf*>(node);
+}
+
+SpanSet::Leaf* SpanSet::LastLeaf() const {
+  Node* node = root_;
+  for (int level = 0; level < height_; level++) {
+    Inner* inner = static_cast<Inner*>(node);
+    node = inner->children[inner->count];
+  }
+  return static_cast<Leaf*>(node);
+}
+
+void SpanSet::insert(Span* span) {
+  Entry e;
+  e.length = span->length;
+  e.start = span->start;
+  e.span = span;
+  size_++;
+  found_span_ = NULL;
+
+  if (root_ == NULL) {
+    Leaf* leaf = NewLeaf();
+    leaf->entries[0] = e;
+    leaf->count = 1;
+    root_ = leaf;
+    return;
+  }
+
+  // The path is kept as the finger when the leaf has room: a span just
+  // inserted is often the next one erased, when a span carved from it
+  // is freed and coalesces with it again.
+  PathElement* path = found_path_;
+  Leaf* leaf = FindLeaf(e.length, e.start, path);
+  int pos = LowerBound(leaf->entries, leaf->count, e.length, e.start);
+  ASSERT(pos == leaf->count || Less(e, leaf->entries[pos]));
+
+  if (leaf->count < Leaf::kSlots) {
+    memmove(&leaf->entries[pos + 1], &leaf->entries[pos],
+            (leaf->count - pos) * sizeof(Entry));
+    leaf->entries[pos] = e;
+    leaf->count++;
+    found_span_ = span;
+    found_leaf_ = leaf;
+    return;
+  }
+
+  // Split the full leaf in half and put 'e' in the half it belongs to.
+  Leaf* right = NewLeaf();
+  const int half = Leaf::kSlots / 2;
+  memcpy(right->entries, &leaf->entries[half],
+         (Leaf::kSlots - half) * sizeof(Entry));
+  right->count = Leaf::kSlots - half;
+  leaf->count = half;
+  right->next = leaf->next;
+  right->prev = leaf;
+  if (leaf->next != NULL) leaf->next->prev = right;
+  leaf->next = right;
+
+  Leaf* target = leaf;
+  if (pos > half) {
+    target = right;
+    pos -= half;
+  }
+  memmove(&target->entries[pos + 1], &target->entries[pos],
+          (target->count - pos) * sizeof(Entry));
+  target->entries[pos] = e;
+  target->count++;
+
+  InsertIntoParent(path, height_ - 1, right->entries[0], right);
+}
+
+void SpanSet::InsertIntoParent(PathElement* path, int level,
+                               const Entry& key, Node* right) {
+  if (level < 0) {
+    // The root was split.
+    CHECK_CONDITION(height_ + 1 < kMaxHeight);
+    Inner* root = NewInner();
+    root->keys[0] = key;
+    root->children[0] = root_;
+    root->children[1] = right;
+    root->count = 1;
+    root_ = root;
+    height_++;
+    return;
+  }
+
+  Inner* inner = path[level].node;
+  const int pos = path[level].child;
+  if (inner->count < Inner::kSlots) {
+    memmove(&inner->keys[pos + 1], &inner->keys[pos],
+            (inner->count - pos) * sizeof(Entry));
+    memmove(&inner->children[pos + 2], &inner->children[pos + 1],
+            (inner->count - pos) * sizeof(Node*));
+    inner->keys[pos] = key;
+    inner->children[pos + 1] = right;
+    inner->count++;
+    return;
+  }
+
+  // Lay out the kSlots + 1 keys and kSlots + 2 children the node would
+  // have, then keep the lower half, move the upper half to a new node
+  // and pass the middle key up.
+  Entry keys[Inner::kSlots + 1];
+  Node* children[Inner::kSlots + 2];
+  memcpy(keys, inner->keys, pos * sizeof(Entry));
+  keys[pos] = key;
+  memcpy(&keys[pos + 1], &inner->keys[pos],
+         (Inner::kSlots - pos) * sizeof(Entry));
+  memcpy(children, inner->children, (pos + 1) * sizeof(Node*));
+  children[pos + 1] = right;
+  memcpy(&children[pos + 2], &inner->children[pos + 1],
+         (Inner::kSlots - pos) * sizeof(Node*));
+
+  const int left_count = (Inner::kSlots + 1) / 2;
+  const int right_count = Inner::kSlots - left_count;
+  Inner* sibling = NewInner();
+  memcpy(inner->keys, keys, left_count * sizeof(Entry));
+  memcpy(inner->children, children, (left_count + 1) * sizeof(Node*));
+  inner->count = left_count;
+  memcpy(sibling->keys, &keys[left_count + 1], right_count * sizeof(Entry));
+  memcpy(sibling->children, &children[left_count + 1],
+         (right_count + 1) * sizeof(Node*));
+  sibling->count = right_count;
+
+  InsertIntoParent(path, level - 1, keys[left_count], sibling);
+}
+
+void SpanSet::erase(Span* span) {
+  ASSERT(root_ != NULL);
+  PathElement local_path[kMaxHeight];
+  PathElement* path = found_path_;
+  Leaf* leaf = found_leaf_;
+  if (span != found_span_) {
+    path = local_path;
+    leaf = FindLeaf(span->length, span->start, path);
+  }
+  found_span_ = NULL;
+  const int pos = LowerBound(leaf->entries, leaf->count,
+                             span->length, span->start);
+  CHECK_CONDITION(pos < leaf->count && leaf->entries[pos].span == span);
+  memmove(&leaf->entries[pos], &leaf->entries[pos + 1],
+          (leaf->count - pos - 1) * sizeof(Entry));
+  leaf->count--;
+  size_--;
+
+  // Separators above need not change: they still bound the entries
+  // on either side of them.
+  if (height_ == 0) {
+    if (leaf->count == 0) {
+      leaf_allocator_.Delete(leaf);
+      root_ = NULL;
+    }
+    return;
+  }
+  if (leaf->count >= Leaf::kMinCount) return;
+
+  Inner* parent = path[height_ - 1].node;
+  const int i = path[height_ - 1].child;
+  Leaf* left = i > 0 ? static_cast<Leaf*>(parent->children[i - 1]) : NULL;
+  Leaf* right = i < parent->count ?
+      static_cast<Leaf*>(parent->children[i + 1]) : NULL;
+
+  if (left != NULL && left->count > Leaf::kMinCount) {
+    // Take the last entry of the left sibling.
+    memmove(&leaf->entries[1], &leaf->entries[0],
+            leaf->count * sizeof(Entry));
+    leaf->entries[0] = left->entries[--left->count];
+    leaf->count++;
+    parent->keys[i - 1] = leaf->entries[0];
+    return;
+  }
+  if (right != NULL && right->count > Leaf::kMinCount) {
+    // Take the first entry of the right sibling.
+    leaf->entries[leaf->count++] = right->entries[0];
+    memmove(&right->entries[0], &right->entries[1],
+            (right->count - 1) * sizeof(Entry));
+    right->count--;
+    parent->keys[i] = right->entries[0];
+    return;
+  }
+
+  // Both siblings are at their minimum: merge with one of them, and
+  // drop the key and child pointer that separated the two.
+  int removed;
+  if (left != NULL) {
+    right = leaf;
+    removed = i - 1;
+  } else {
+    left = leaf;
+    removed = i;
+  }
+  memcpy(&left->entries[left->count], right->entries,
+         right->count * sizeof(Entry));
+  left->count += right->count;
+  left->next = right->next;
+  if (right->next != NULL) right->next->prev = left;
+  leaf_allocator_.Delete(right);
+
+  memmove(&parent->keys[removed], &parent->keys[removed + 1],
+          (parent->count - removed - 1) * sizeof(Entry));
+  memmove(&parent->children[removed + 1], &parent->children[removed + 2],
+          (parent->count - removed - 1) * sizeof(Node*));
+  parent->count--;
+  RebalanceInner(path, height_ - 1);
+}
+
+void SpanSet::RebalanceInner(PathElement* path, int level) {
+  Inner* inner = path[level].node;
+  if (level == 0) {
+    // The root only has to keep one child.
+    if (inner->count == 0) {
+      root_ = inner->children[0];
+      height_--;
+      inner_allocator_.Delete(inner);
+    }
+    return;
+  }
+  if (inner->count >= Inner::kMinCount) return;
+
+  Inner* parent = path[level - 1].node;
+  const int i = path[level - 1].child;
+  Inner* left = i > 0 ? static_cast<Inner*>(parent->children[i - 1]) : NULL;
+  Inner* right = i < parent->count ?
+      static_cast<Inner*>(parent->children[i + 1]) : NULL;
+
+  if (left != NULL && left->count > Inner::kMinCount) {
+    // Rotate the last child of the left sibling over to us.
+    memmove(&inner->keys[1], &inner->keys[0], inner->count * sizeof(Entry));
+    memmove(&inner->children[1], &inner->children[0],
+            (inner->count + 1) * sizeof(Node*));
+    inner->keys[0] = parent->keys[i - 1];
+    inner->children[0] = left->children[left->count];
+    inner->count++;
+    parent->keys[i - 1] = left->keys[left->count - 1];
+    left->count--;
+    return;
+  }
+  if (right != NULL && right->count > Inner::kMinCount) {
+    // Rotate the first child of the right sibling over to us.
+    inner->keys[inner->count] = parent->keys[i];
+    inner->children[inner->count + 1] = right->children[0];
+    inner->count++;
+    parent->keys[i] = right->keys[0];
+    memmove(&right->keys[0], &right->keys[1],
+            (right->count - 1) * sizeof(Entry));
+    memmove(&right->children[0], &right->children[1],
+            right->count * sizeof(Node*));
+    right->count--;
+    return;
+  }
+
+  // Merge with a sibling, pulling the separating key down between them.
+  int removed;
+  if (left != NULL) {
+    right = inner;
+    removed = i - 1;
+  } else {
+    left = inner;
+    removed = i;
+  }
+  left->keys[left->count] = parent->keys[removed];
+  memcpy(&left->keys[left->count + 1], right->keys,
+         right->count * sizeof(Entry));
+  memcpy(&left->children[left->count + 1], right->children,
+         (right->count + 1) * sizeof(Node*));
+  left->count += right->count + 1;
+  inner_allocator_.Delete(right);
+
+  memmove(&parent->keys[removed], &parent->keys[removed + 1],
+          (parent->count - removed - 1) * sizeof(Entry));
+  memmove(&parent->children[removed + 1], &parent->children[removed + 2],
+          (parent->count - removed - 1) * sizeof(Node*));
+  parent->count--;
+  RebalanceInner(path, level - 1);
+}
+
+Span* SpanSet::BestFit(Length n) const {
+  if (root_ == NULL) return NULL;
+  // No span starts at page 0, so this finds the first entry of length
+  // at least n; it is in this leaf or, if all of this leaf's entries
+  // are shorter, first in the next one.
+  Leaf* leaf = FindLeaf(n, 0, found_path_);
+  const int i = LowerBound(leaf->entries, leaf->count, n, 0);
+  if (i < leaf->count) {
+    found_span_ = leaf->entries[i].span;
+    found_leaf_ = leaf;
+    return found_span_;
+  }
+  found_span_ = NULL;
+  return leaf->next != NULL ? leaf->next->entries[0].span : NULL;
+}
+
+SpanSet::iterator SpanSet::begin() const {
+  if (root_ == NULL) return end();
+  return iterator(this, FirstLeaf(), 0);
+}
+
+const SpanSet::Entry& SpanSet::iterator::operator*() const {
+  ASSERT(leaf_ != NULL && index_ < leaf_->count);
+  return leaf_->entries[index_];
+}
+
+SpanSet::iterator& SpanSet::iterator::operator++() {
+  ASSERT(leaf_ != NULL);
+  if (++index_ == leaf_->count) {
+    leaf_ = leaf_->next;
+    index_ = 0;
+  }
+  return *this;
+}
+
+SpanSet::iterator& SpanSet::iterator::operator--() {
+  if (leaf_ == NULL) {
+    leaf_ = set_->LastLeaf();
+    index_ = leaf_->count;
+  } else if (index_ == 0) {
+    leaf_ = leaf_->prev;
+    index_ = leaf_->count;
+  }
+  ASSERT(leaf_ != NULL && index_ > 0);
+  index_--;
+  return *this;
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,160 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright (c) 2026, gperftools Contributors
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Set of free spans for best-fit search, ordered by length and then by
+// address.  It is a B+-tree whose leaves hold the lengths and start
+// pages of the spans inline, so searches, inserts and erases touch a
+// few cache lines per level instead of one Span and one tree node per
+// comparison, as a std::set of span pointers did.  Leaves are linked,
+// for iteration in either direction.
+//
+// Nodes come from a PageHeapAllocator shared by all sets; as for the
+// page heap, external locking is required.
+
+#ifndef TCMALLOC_SPAN_SET_H_
+#define TCMALLOC_SPAN_SET_H_
+
+#include <config.h>
+#include <stddef.h>                     // for NULL, size_t
+#include "common.h"
+
+namespace tcmalloc {
+
+struct Span;
+template <class T> class PageHeapAllocator;
+
+class SpanSet {
+ public:
+  // An element of the set.  The span's length and start are copied so
+  // that comparisons need not look at the Span.
+  struct Entry {
+    Length length;
+    PageID start;
+    Span* span;
+  };
+
+ private:
+  struct Node;
+  struct Leaf;
+  struct Inner;
+
+ public:
+  class iterator {
+   public:
+    iterator() : set_(NULL), leaf_(NULL), index_(0) {}
+
+    const Entry& operator*() const;
+    const Entry* operator->() const { return &**this; }
+    iterator& operator++();
+    iterator& operator--();
+    bool operator==(const iterator& other) const {
+      return leaf_ == other.leaf_ && index_ == other.index_;
+    }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+   private:
+    friend class SpanSet;
+    iterator(const SpanSet* set, Leaf* leaf, int index)
+        : set_(set), leaf_(leaf), index_(index) {}
+
+    const SpanSet* set_;
+    Leaf* leaf_;                        // NULL at end()
+    int index_;
+  };
+  typedef iterator const_iterator;
+
+  SpanSet() : root_(NULL), height_(0), size_(0), found_span_(NULL) {}
+
+  // Adds 'span', which must not be in the set, under its current length.
+  void insert(Span* span);
+
+  // Removes 'span', which must be in the set under its current length.
+  void erase(Span* span);
+
+  // Returns the shortest span of at least 'n' pages, the lowest one
+  // among those of that length, or NULL if there is none.
+  Span* BestFit(Length n) const;
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  // Iterates in best-fit order: shortest first, by address within a
+  // length.  Iterators are invalidated by insert and erase.
+  iterator begin() const;
+  iterator end() const { return iterator(this, NULL, 0); }
+
+ private:
+  // The tree never gets higher than this: nodes are at least a
+  // quarter full, so this is good for far more spans than fit in memory.
+  static const int kMaxHeight = 16;
+
+  // Position in an inner node, recorded on the way down to a leaf.
+  struct PathElement {
+    Inner* node;
+    int child;
+  };
+
+  // Walks down to the leaf that holds, or would hold, the entry
+  // (length, start), recording the inner nodes passed in 'path'.
+  Leaf* FindLeaf(Length length, PageID start, PathElement* path) const;
+
+  Leaf* FirstLeaf() const;
+  Leaf* LastLeaf() const;
+
+  static Leaf* NewLeaf();
+  static Inner* NewInner();
+
+  // Adds 'right' to the node at 'level' of 'path', following the child
+  // it was split from, with 'key' separating them.
+  void InsertIntoParent(PathElement* path, int level, const Entry& key,
+                        Node* right);
+
+  // Restores the minimum fill of the inner node at 'level' of 'path'
+  // after a child of it was removed.
+  void RebalanceInner(PathElement* path, int level);
+
+  Node* root_;
+  int height_;                          // Number of inner levels
+  size_t size_;
+
+  // Where BestFit found, or insert put, its span, since the page heap
+  // often erases that span next.  Forgotten on any other change.
+  mutable Span* found_span_;
+  mutable Leaf* found_leaf_;
+  mutable PathElement found_path_[kMaxHeight];
+
+  static bool allocators_initialized_;
+  static PageHeapAllocator<Leaf> leaf_allocator_;
+  static PageHeapAllocator<Inner> inner_allocator_;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_SPAN_SET_H_
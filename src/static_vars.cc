@@ -34,13 +34,17 @@
 #include <config.h>
 #include "static_vars.h"
 #include <stddef.h>                     // for NULL
+#include <stdlib.h>                     // for strtol
 #include <new>                          // for operator new
 #ifdef HAVE_PTHREAD
 #include <pthread.h>                    // for pthread_atfork
 #endif
 #include "internal_logging.h"  // for CHECK_CONDITION
 #include "common.h"
+#include "cpu_cache.h"           // for CpuCache
+#include "large_span_cache.h"    // for LargeSpanCache
 #include "sampler.h"           // for Sampler
+#include "system-alloc.h"      // for TCMalloc_SystemAllocLockAll
 #include "getenv_safe.h"       // TCMallocGetenvSafe
 #include "base/googleinit.h"
 #include "maybe_threads.h"
@@ -56,13 +60,19 @@ void CentralCacheLockAll()
 {
   Static::pageheap_lock()->Lock();
   for (int i = 0; i < Static::num_size_classes(); ++i)
-    Static::central_cache()[i].Lock();
+    for (int s = 0; s < Static::num_central_shards(i); ++s)
+      Static::central_shard(s, i)->Lock();
+  MetaDataAllocLockAll();
+  TCMalloc_SystemAllocLockAll();
 }
 
 void CentralCacheUnlockAll()
 {
+  TCMalloc_SystemAllocUnlockAll();
+  MetaDataAllocUnlockAll();
   for (int i = 0; i < Static::num_size_classes(); ++i)
-    Static::central_cache()[i].Unlock();
+    for (int s = 0; s < Static::num_central_shards(i); ++s)
+      Static::central_shard(s, i)->Unlock();
   Static::pageheap_lock()->Unlock();
 }
 #endif
@@ -71,6 +81,12 @@ bool Static::inited_;
 SpinLock Static::pageheap_lock_(SpinLock::LINKER_INITIALIZED);
 SizeMap Static::sizemap_;
 CentralFreeListPadded Static::central_cache_[kClassSizesMax];
+CentralFreeListPadded* Static::central_shards_;
+CentralFreeListPadded* Static::central_node_lists_;
+int Static::num_central_shards_ = 1;
+int Static::num_sharded_classes_;
+int Static::num_numa_nodes_ = 1;
+NumaTopology Static::numa_topology_;
 PageHeapAllocator<Span> Static::span_allocator_;
 PageHeapAllocator<StackTrace> Static::stacktrace_allocator_;
 Span Static::sampled_objects_;
@@ -87,11 +103,21 @@ void Static::InitStaticVars() {
   bucket_allocator_.Init();
   // Do a bit of sanitizing: make sure central_cache is aligned properly
   CHECK_CONDITION((sizeof(central_cache_[0]) % 64) == 0);
+  CentralFreeList::SetSpanBitmaps(
+      tcmalloc::commandlineflags::StringToBool(
+          TCMallocGetenvSafe("TCMALLOC_SPAN_BITMAPS"), false));
   for (int i = 0; i < num_size_classes(); ++i) {
-    central_cache_[i].Init(i);
+    central_cache_[i].Init(i, 0, 0);
   }
+  numa_topology_.Init();
+  InitCentralShards();
 
-  new (&pageheap_.memory) PageHeap;
+  new (&pageheap_.memory) PageHeap(&pageheap_lock_);
+
+  if (num_numa_nodes_ > 1 && !pageheap()->SetNumaNodes(num_numa_nodes_)) {
+    // Should not happen this early; carry on with a single partition.
+    num_numa_nodes_ = 1;
+  }
 
   bool aggressive_decommit =
     tcmalloc::commandlineflags::StringToBool(
@@ -99,11 +125,87 @@ void Static::InitStaticVars() {
 
   pageheap()->SetAggressiveDecommit(aggressive_decommit);
 
+  bool hugepage_aware =
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_HUGEPAGE_AWARE"), false);
+
+  pageheap()->SetHugePageAware(hugepage_aware);
+
+  bool background_release =
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_BACKGROUND_RELEASE"), false);
+
+  pageheap()->SetBackgroundRelease(background_release);
+
+  bool size_class_regions =
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_SIZE_CLASS_REGIONS"), false);
+
+  // Carry on without the regions if they can not be reserved.
+  pageheap()->SetSizeClassRegions(size_class_regions);
+
+  CpuCache::InitModule();
+  LargeSpanCache::InitModule();
+
   inited_ = true;
 
   DLL_Init(&sampled_objects_);
 }
 
+// Size classes up to this size are sharded when
+// TCMALLOC_CENTRAL_FREELIST_SHARDS is above 1.  Those see the bulk of
+// the traffic; larger classes keep a single free list so the extra
+// transfer cache capacity stays small.
+static const size_t kMaxShardedClassSize = 4096;
+
+void Static::InitCentralShards() {
+  num_central_shards_ = 1;
+  num_sharded_classes_ = 0;
+  num_numa_nodes_ = 1;
+  const int nodes = numa_topology_.num_nodes();
+  const char* e = TCMallocGetenvSafe("TCMALLOC_CENTRAL_FREELIST_SHARDS");
+  int shards = e ? strtol(e, NULL, 10) : 1;
+  if (shards < 1) shards = 1;
+  if (shards * nodes > CentralFreeList::kMaxShards) {
+    shards = CentralFreeList::kMaxShards / nodes;
+  }
+  if (shards <= 1 && nodes <= 1) return;
+
+  int classes = 0;
+  if (shards > 1) {
+    classes = 1;
+    while (classes < num_size_classes() &&
+           sizemap_.ByteSizeForClass(classes) <= kMaxShardedClassSize) {
+      classes++;
+    }
+  }
+  const int other_classes = num_size_classes() - classes;
+  const size_t sharded_lists = (shards * nodes - 1) * classes;
+  const size_t node_lists = (nodes - 1) * other_classes;
+  void* space = MetaDataAlloc(
+      sizeof(CentralFreeListPadded) * (sharded_lists + node_lists));
+  if (space == NULL) return;
+  central_shards_ = reinterpret_cast<CentralFreeListPadded*>(space);
+  central_node_lists_ = central_shards_ + sharded_lists;
+  for (int s = 1; s < shards * nodes; ++s) {
+    for (int i = 0; i < classes; ++i) {
+      CentralFreeListPadded* list =
+          new (&central_shards_[(s - 1) * classes + i]) CentralFreeListPadded;
+      list->Init(i, s, s / shards);
+    }
+  }
+  for (int node = 1; node < nodes; ++node) {
+    for (int i = classes; i < num_size_classes(); ++i) {
+      CentralFreeListPadded* list = new (&central_node_lists_[
+          (node - 1) * other_classes + (i - classes)]) CentralFreeListPadded;
+      list->Init(i, node, node);
+    }
+  }
+  num_sharded_classes_ = classes;
+  num_central_shards_ = shards;
+  num_numa_nodes_ = nodes;
+}
+
 void Static::InitLateMaybeRecursive() {
 #if defined(HAVE_FORK) && defined(HAVE_PTHREAD) \
   && !defined(__APPLE__) && !defined(TCMALLOC_NO_ATFORK)
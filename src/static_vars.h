@@ -41,6 +41,7 @@
 #include "base/spinlock.h"
 #include "central_freelist.h"
 #include "common.h"
+#include "numa.h"
 #include "page_heap.h"
 #include "page_heap_allocator.h"
 #include "span.h"
@@ -61,6 +62,53 @@ class Static {
   // We have a separate lock per free-list to reduce contention.
   static CentralFreeListPadded* central_cache() { return central_cache_; }
 
+  // Small size classes may additionally be split into several shards
+  // (TCMALLOC_CENTRAL_FREELIST_SHARDS), each with its own lock, spans
+  // and transfer cache.  With several NUMA nodes every size class also
+  // has a set of shards per node: shards [node * n, (node + 1) * n)
+  // belong to node, n being central_shards_per_node(cl).
+  // central_cache()[cl] is always shard 0.
+  static int central_shards_per_node(int cl) {
+    return cl < num_sharded_classes_ ? num_central_shards_ : 1;
+  }
+
+  static int num_central_shards(int cl) {
+    return central_shards_per_node(cl) * num_numa_nodes_;
+  }
+
+  // REQUIRES: 0 <= shard < num_central_shards(cl)
+  static CentralFreeListPadded* central_shard(int shard, int cl) {
+    if (shard == 0) return &central_cache_[cl];
+    if (cl < num_sharded_classes_) {
+      return &central_shards_[(shard - 1) * num_sharded_classes_ + cl];
+    }
+    return &central_node_lists_[
+        (shard - 1) * (num_size_classes() - num_sharded_classes_) +
+        (cl - num_sharded_classes_)];
+  }
+
+  // Returns the free list a caller running on NUMA node 'node' should
+  // use for size class cl.  hint identifies the caller (a CPU or a
+  // thread) and is spread over the shards of sharded classes.
+  static CentralFreeList* central_freelist(int cl, unsigned hint, int node) {
+    if (cl >= num_sharded_classes_) return central_shard(node, cl);
+    return central_shard(
+        node * num_central_shards_ + hint % num_central_shards_, cl);
+  }
+
+  static const NumaTopology* numa_topology() { return &numa_topology_; }
+
+  // Number of NUMA nodes the central free lists are partitioned into.
+  static int num_numa_nodes() { return num_numa_nodes_; }
+
+  // NUMA node of the CPU the calling thread runs on, or of CPU cpu.
+  static int CurrentNumaNode() {
+    return num_numa_nodes_ > 1 ? numa_topology_.CurrentNode() : 0;
+  }
+  static int NumaNodeOfCpu(unsigned cpu) {
+    return num_numa_nodes_ > 1 ? numa_topology_.NodeOfCpu(cpu) : 0;
+  }
+
   static SizeMap* sizemap() { return &sizemap_; }
 
   static unsigned num_size_classes() { return sizemap_.num_size_classes; }
@@ -91,6 +139,10 @@ class Static {
   static bool IsInited() { return inited_; }
 
  private:
+  // Sets up the extra central free list shards and the central free
+  // lists of NUMA nodes other than 0, if requested.
+  static void InitCentralShards();
+
   // some unit tests depend on this and link to static vars
   // imperfectly. Thus we keep those unhidden for now. Thankfully
   // they're not performance-critical.
@@ -104,6 +156,16 @@ class Static {
 
   ATTRIBUTE_HIDDEN static SizeMap sizemap_;
   ATTRIBUTE_HIDDEN static CentralFreeListPadded central_cache_[kClassSizesMax];
+  // Shards 1..num_central_shards(cl)-1 of the first num_sharded_classes_
+  // size classes.
+  ATTRIBUTE_HIDDEN static CentralFreeListPadded* central_shards_;
+  // Free lists of the other classes for NUMA nodes 1..num_numa_nodes_-1.
+  ATTRIBUTE_HIDDEN static CentralFreeListPadded* central_node_lists_;
+  // Shards per NUMA node of sharded classes.
+  ATTRIBUTE_HIDDEN static int num_central_shards_;
+  ATTRIBUTE_HIDDEN static int num_sharded_classes_;
+  ATTRIBUTE_HIDDEN static int num_numa_nodes_;
+  ATTRIBUTE_HIDDEN static NumaTopology numa_topology_;
   ATTRIBUTE_HIDDEN static PageHeapAllocator<Span> span_allocator_;
   ATTRIBUTE_HIDDEN static PageHeapAllocator<StackTrace> stacktrace_allocator_;
   ATTRIBUTE_HIDDEN static Span sampled_objects_;
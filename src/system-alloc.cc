@@ -35,6 +35,7 @@
 #include <errno.h>                      // for EAGAIN, errno
 #include <fcntl.h>                      // for open, O_RDWR
 #include <stddef.h>                     // for size_t, NULL, ptrdiff_t
+#include <string.h>                     // for memset
 #if defined HAVE_STDINT_H
 #include <stdint.h>                     // for uintptr_t, intptr_t
 #elif defined HAVE_INTTYPES_H
@@ -48,6 +49,10 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>                     // for sbrk, getpagesize, off_t
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>                // for SYS_process_madvise, SYS_mbind
+#include <sys/uio.h>                    // for iovec
+#endif
 #include <new>                          // for operator new
 #include <gperftools/malloc_extension.h>
 #include "base/basictypes.h"
@@ -55,6 +60,7 @@
 #include "base/spinlock.h"              // for SpinLockHolder, SpinLock, etc
 #include "common.h"
 #include "internal_logging.h"
+#include "system-alloc.h"
 
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
 // form of the name instead.
@@ -62,11 +68,16 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
-// Linux added support for MADV_FREE in 4.5 but we aren't ready to use it
-// yet. Among other things, using compile-time detection leads to poor
-// results when compiling on a system with MADV_FREE and running on a
-// system without it. See https://github.com/gperftools/gperftools/issues/780.
-#if defined(__linux__) && defined(MADV_FREE) && !defined(TCMALLOC_USE_MADV_FREE)
+// Linux added support for MADV_FREE in 4.5.  Compile-time detection
+// leads to poor results when compiling on a system with MADV_FREE and
+// running on a system without it (see
+// https://github.com/gperftools/gperftools/issues/780), so on Linux it
+// is chosen at run time, through FLAGS_malloc_release_madv_free, and
+// given up on if the kernel rejects it.  MADV_FREE below then stands
+// for MADV_DONTNEED.
+#if defined(__linux__) && defined(MADV_FREE)
+static const int kLinuxMadvFree = MADV_FREE;
+# define HAVE_LINUX_MADV_FREE 1
 # undef MADV_FREE
 #endif
 
@@ -77,6 +88,12 @@
 # define MADV_FREE  MADV_DONTNEED
 #endif
 
+// process_madvise() (Linux 5.10) releases many ranges in one system call.
+#if defined(__linux__) && defined(MADV_FREE) && \
+    defined(SYS_process_madvise) && defined(SYS_pidfd_open)
+# define HAVE_PROCESS_MADVISE 1
+#endif
+
 // Solaris has a bug where it doesn't declare madvise() for C++.
 //    http://www.opensolaris.org/jive/thread.jspa?threadID=21035&tstart=0
 #if defined(__sun) && defined(__SVR4)
@@ -140,6 +157,15 @@ DEFINE_bool(malloc_disable_memory_release,
             EnvToBool("TCMALLOC_DISABLE_MEMORY_RELEASE", false),
             "Whether MADV_FREE/MADV_DONTNEED should be used"
             " to return unused memory to the system.");
+#ifdef TCMALLOC_USE_MADV_FREE
+static const bool kDefaultReleaseMadvFree = true;
+#else
+static const bool kDefaultReleaseMadvFree = false;
+#endif
+DEFINE_bool(malloc_release_madv_free,
+            EnvToBool("TCMALLOC_RELEASE_MADV_FREE", kDefaultReleaseMadvFree),
+            "Whether memory is returned to the system with MADV_FREE rather"
+            " than MADV_DONTNEED, where the kernel supports it (Linux only).");
 
 // static allocators
 class SbrkSysAllocator : public SysAllocator {
@@ -510,46 +536,330 @@ void* TCMalloc_SystemAlloc(size_t size, size_t *actual_size,
   return result;
 }
 
-bool TCMalloc_SystemRelease(void* start, size_t length) {
 #ifdef MADV_FREE
-  if (FLAGS_malloc_devmem_start) {
-    // It's not safe to use MADV_FREE/MADV_DONTNEED if we've been
-    // mapping /dev/mem for heap memory.
-    return false;
-  }
-  if (FLAGS_malloc_disable_memory_release) return false;
+// Returns false if it's not safe or not wanted to release memory.
+static bool MayReleaseMemory() {
+  // It's not safe to use MADV_FREE/MADV_DONTNEED if we've been
+  // mapping /dev/mem for heap memory.
+  return !FLAGS_malloc_devmem_start && !FLAGS_malloc_disable_memory_release;
+}
+
+// Returns the advice to give madvise() for releasing memory.
+static int ReleaseAdvice() {
+#ifdef HAVE_LINUX_MADV_FREE
+  if (FLAGS_malloc_release_madv_free) return kLinuxMadvFree;
+#endif
+  return MADV_FREE;
+}
+
+// Returns true if pages released with advice read as zero until they
+// are written again.  Only private anonymous memory, which is what the
+// default allocators map, is zero-filled after MADV_DONTNEED on Linux.
+static bool ReleaseZeroes(int advice) {
+#if defined(__linux__) && defined(MADV_DONTNEED)
+  return advice == MADV_DONTNEED && TCMalloc_SystemAllocZeroes();
+#else
+  return false;
+#endif
+}
+
+// Shrinks [start, start+length) to the whole system pages it covers.
+// Returns false if there are none.
+static bool PageAlignedRange(void* start, size_t length,
+                             size_t* new_start, size_t* new_end) {
   if (pagesize == 0) pagesize = getpagesize();
   const size_t pagemask = pagesize - 1;
 
-  size_t new_start = reinterpret_cast<size_t>(start);
-  size_t end = new_start + length;
-  size_t new_end = end;
+  const size_t end = reinterpret_cast<size_t>(start) + length;
 
   // Round up the starting address and round down the ending address
   // to be page aligned:
-  new_start = (new_start + pagesize - 1) & ~pagemask;
-  new_end = new_end & ~pagemask;
+  *new_start = (reinterpret_cast<size_t>(start) + pagesize - 1) & ~pagemask;
+  *new_end = end & ~pagemask;
 
-  ASSERT((new_start & pagemask) == 0);
-  ASSERT((new_end & pagemask) == 0);
-  ASSERT(new_start >= reinterpret_cast<size_t>(start));
-  ASSERT(new_end <= end);
+  ASSERT((*new_start & pagemask) == 0);
+  ASSERT((*new_end & pagemask) == 0);
+  ASSERT(*new_start >= reinterpret_cast<size_t>(start));
+  ASSERT(*new_end <= end);
+
+  return *new_end > *new_start;
+}
+#endif
 
-  if (new_end > new_start) {
+bool TCMalloc_SystemRelease(void* start, size_t length, bool* zeroed) {
+  if (zeroed != NULL) *zeroed = false;
+#ifdef MADV_FREE
+  if (!MayReleaseMemory()) return false;
+
+  size_t new_start, new_end;
+  if (PageAlignedRange(start, length, &new_start, &new_end)) {
+    const int advice = ReleaseAdvice();
     int result;
     do {
       result = madvise(reinterpret_cast<char*>(new_start),
-          new_end - new_start, MADV_FREE);
+          new_end - new_start, advice);
     } while (result == -1 && errno == EAGAIN);
 
-    return result != -1;
+#ifdef HAVE_LINUX_MADV_FREE
+    if (result == -1 && errno == EINVAL && advice == kLinuxMadvFree) {
+      // The kernel predates MADV_FREE; stick to MADV_DONTNEED.
+      FLAGS_malloc_release_madv_free = false;
+      return TCMalloc_SystemRelease(start, length, zeroed);
+    }
+#endif
+    if (result == -1) return false;
+    if (zeroed != NULL) *zeroed = ReleaseZeroes(advice);
+    return true;
   }
 #endif
   return false;
 }
 
+#ifdef HAVE_PROCESS_MADVISE
+// Set once process_madvise() has failed in a way that will not go
+// away, e.g. because the kernel does not accept this advice there.
+static volatile bool process_madvise_unusable = false;
+#ifdef HAVE_LINUX_MADV_FREE
+// Likewise, for MADV_FREE only.
+static volatile bool process_madvise_free_unusable = false;
+#endif
+
+static SpinLock pidfd_lock(SpinLock::LINKER_INITIALIZED);
+static int self_pidfd = -1;
+static pid_t self_pidfd_owner;
+
+// Returns a pidfd referring to the calling process, or -1.  A pidfd
+// inherited over fork refers to the parent, so the child opens its own.
+static int SelfPidfd() {
+  const pid_t pid = getpid();
+  SpinLockHolder h(&pidfd_lock);
+  if (self_pidfd >= 0 && self_pidfd_owner != pid) {
+    close(self_pidfd);
+    self_pidfd = -1;
+  }
+  if (self_pidfd < 0) {
+    self_pidfd = syscall(SYS_pidfd_open, pid, 0);
+    self_pidfd_owner = pid;
+  }
+  return self_pidfd;
+}
+
+// Releases ranges with as few process_madvise() calls as possible.
+// Returns the number of leading ranges dealt with; the caller releases
+// the others one by one.
+static int ProcessMadviseRanges(SystemReleaseRange* ranges, int n) {
+  static const int kMaxIovecs = 64;
+  if (process_madvise_unusable) return 0;
+  const int advice = ReleaseAdvice();
+#ifdef HAVE_LINUX_MADV_FREE
+  const bool madv_free = (advice == kLinuxMadvFree);
+  if (madv_free && process_madvise_free_unusable) return 0;
+#endif
+  const int pidfd = SelfPidfd();
+  if (pidfd < 0) {
+    process_madvise_unusable = true;
+    return 0;
+  }
+
+  int done = 0;
+  while (done < n) {
+    struct iovec iov[kMaxIovecs];
+    int owner[kMaxIovecs];
+    int count = 0;
+    int next = done;
+    for (; next < n && count < kMaxIovecs; next++) {
+      size_t new_start, new_end;
+      ranges[next].released = false;
+      ranges[next].zeroed = false;
+      if (PageAlignedRange(ranges[next].start, ranges[next].length,
+                           &new_start, &new_end)) {
+        iov[count].iov_base = reinterpret_cast<void*>(new_start);
+        iov[count].iov_len = new_end - new_start;
+        owner[count] = next;
+        count++;
+      }
+    }
+
+    if (count > 0) {
+      const long result = syscall(SYS_process_madvise, pidfd, iov, count,
+                                  advice, 0);
+      if (result < 0) {
+        if (errno != EAGAIN && errno != EINTR && errno != ENOMEM) {
+#ifdef HAVE_LINUX_MADV_FREE
+          if (madv_free) {
+            process_madvise_free_unusable = true;
+            return done;
+          }
+#endif
+          process_madvise_unusable = true;
+        }
+        return done;
+      }
+      // The kernel goes through the ranges in order and stops at the
+      // first failure.
+      size_t left = result;
+      for (int i = 0; i < count; i++) {
+        if (left < iov[i].iov_len) return owner[i];
+        left -= iov[i].iov_len;
+        ranges[owner[i]].released = true;
+        ranges[owner[i]].zeroed = ReleaseZeroes(advice);
+      }
+    }
+    done = next;
+  }
+  return n;
+}
+#endif  // HAVE_PROCESS_MADVISE
+
+void TCMalloc_SystemReleaseBatch(SystemReleaseRange* ranges, int n) {
+  int done = 0;
+#ifdef HAVE_PROCESS_MADVISE
+  if (MayReleaseMemory()) {
+    done = ProcessMadviseRanges(ranges, n);
+  }
+#endif
+  for (int i = done; i < n; i++) {
+    ranges[i].released = TCMalloc_SystemRelease(ranges[i].start,
+                                                 ranges[i].length,
+                                                 &ranges[i].zeroed);
+  }
+}
+
 void TCMalloc_SystemCommit(void* start, size_t length) {
   // Nothing to do here.  TCMalloc_SystemRelease does not alter pages
   // such that they need to be re-committed before they can be used by the
   // application.
 }
+
+bool TCMalloc_SystemAllocZeroes() {
+  return !FLAGS_malloc_devmem_start &&
+      tcmalloc_sys_alloc == reinterpret_cast<SysAllocator*>(default_space.buf);
+}
+
+bool TCMalloc_SystemSetReleaseMadvFree(bool madv_free) {
+#ifdef HAVE_LINUX_MADV_FREE
+  FLAGS_malloc_release_madv_free = madv_free;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool TCMalloc_SystemReleaseMadvFree() {
+#if defined(HAVE_LINUX_MADV_FREE)
+  return FLAGS_malloc_release_madv_free;
+#elif defined(MADV_FREE) && defined(MADV_DONTNEED)
+  return MADV_FREE != MADV_DONTNEED;
+#else
+  return false;
+#endif
+}
+
+bool TCMalloc_SystemMove(void* from, void* to, size_t length) {
+#if defined(__linux__) && defined(HAVE_MMAP) && defined(MREMAP_FIXED)
+  // Pages from an allocator installed by the application, or from
+  // /dev/mem, are not ours to move around.
+  if (FLAGS_malloc_devmem_start) return false;
+  if (tcmalloc_sys_alloc != reinterpret_cast<SysAllocator*>(default_space.buf)) {
+    return false;
+  }
+  if (pagesize == 0) pagesize = getpagesize();
+  const uintptr_t pagemask = pagesize - 1;
+  if (((reinterpret_cast<uintptr_t>(from) | reinterpret_cast<uintptr_t>(to) |
+        length) & pagemask) != 0) {
+    return false;
+  }
+
+  if (mremap(from, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, to)
+      == MAP_FAILED) {
+    return false;
+  }
+  // The page heap still owns [from, from+length), so it must not be
+  // left unmapped.
+  if (mmap(from, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+    return true;
+  }
+  if (mremap(to, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, from)
+      == MAP_FAILED ||
+      mmap(to, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    Log(tcmalloc::kCrash, __FILE__, __LINE__,
+        "tcmalloc: cannot remap pages after a failed move", errno);
+  }
+#endif
+  return false;
+}
+
+void TCMalloc_SystemHugePageHint(void* start, size_t length) {
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  if (FLAGS_malloc_devmem_start) return;
+  madvise(start, length, MADV_HUGEPAGE);
+#endif
+}
+
+void* TCMalloc_SystemReserve(size_t bytes) {
+#if defined(HAVE_MMAP) && defined(MAP_NORESERVE)
+  // Read-only private mappings are not charged against the commit
+  // limit; the parts made writable later are.
+  void* result = mmap(NULL, bytes, PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return result == MAP_FAILED ? NULL : result;
+#else
+  return NULL;
+#endif
+}
+
+bool TCMalloc_SystemCommitReserved(void* start, size_t length) {
+#ifdef HAVE_MMAP
+  // Round outwards: the reservation covers whole pages.
+  const uintptr_t pagemask = getpagesize() - 1;
+  const uintptr_t new_start = reinterpret_cast<uintptr_t>(start) & ~pagemask;
+  const uintptr_t new_end =
+      (reinterpret_cast<uintptr_t>(start) + length + pagemask) & ~pagemask;
+  if (mprotect(reinterpret_cast<void*>(new_start), new_end - new_start,
+               PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+  SpinLockHolder lock_holder(&spinlock);
+  TCMalloc_SystemTaken += new_end - new_start;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool TCMalloc_SystemBindToNode(void* start, size_t length, int node) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(MADV_FREE)
+  // From <numaif.h>, which we do not want to depend upon.
+  static const int kMpolPreferred = 1;
+  static const int kMaxNodeId = 1024;
+  if (FLAGS_malloc_devmem_start) return false;
+  if (node < 0 || node >= kMaxNodeId) return false;
+
+  size_t new_start, new_end;
+  if (!PageAlignedRange(start, length, &new_start, &new_end)) return false;
+  unsigned long mask[kMaxNodeId / (8 * sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] =
+      1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, new_start, new_end - new_start, kMpolPreferred,
+                 mask, kMaxNodeId, 0) == 0;
+#else
+  return false;
+#endif
+}
+
+void TCMalloc_SystemAllocLockAll() {
+  spinlock.Lock();
+#ifdef HAVE_PROCESS_MADVISE
+  pidfd_lock.Lock();
+#endif
+}
+
+void TCMalloc_SystemAllocUnlockAll() {
+#ifdef HAVE_PROCESS_MADVISE
+  pidfd_lock.Unlock();
+#endif
+  spinlock.Unlock();
+}
@@ -72,9 +72,26 @@ void* TCMalloc_SystemAlloc(size_t bytes, size_t *actual_bytes,
 // performance.  (Only pages fully covered by the memory region will
 // be released, partial pages will not.)
 //
-// Returns false if release failed or not supported.
+// Returns false if release failed or not supported.  If zeroed is
+// not NULL, sets *zeroed to whether the released pages read as zero
+// until they are written again, as after MADV_DONTNEED on Linux.
 extern PERFTOOLS_DLL_DECL
-bool TCMalloc_SystemRelease(void* start, size_t length);
+bool TCMalloc_SystemRelease(void* start, size_t length, bool* zeroed = NULL);
+
+// A range for TCMalloc_SystemReleaseBatch.
+struct SystemReleaseRange {
+  void* start;
+  size_t length;
+  bool released;                // Set by TCMalloc_SystemReleaseBatch
+  bool zeroed;                  // Likewise, as for TCMalloc_SystemRelease
+};
+
+// Like TCMalloc_SystemRelease, for "n" ranges at once.  Sets
+// ranges[i].released to whether range i was released.  On Linux a
+// single process_madvise() call covers the whole batch where the kernel
+// supports it.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemReleaseBatch(SystemReleaseRange* ranges, int n);
 
 // Called to ressurect memory which has been previously released
 // to the system via TCMalloc_SystemRelease.  An attempt to
@@ -83,6 +100,68 @@ bool TCMalloc_SystemRelease(void* start, size_t length);
 extern PERFTOOLS_DLL_DECL
 void TCMalloc_SystemCommit(void* start, size_t length);
 
+// Returns true if memory from TCMalloc_SystemAlloc reads as zero, as
+// fresh anonymous mappings and sbrk memory do.  False for allocators
+// installed by the application, which may hand out used memory.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemAllocZeroes();
+
+// Chooses whether TCMalloc_SystemRelease uses MADV_FREE, which lets
+// the kernel take the pages only under memory pressure and leaves
+// their old contents until then, or MADV_DONTNEED, which drops them
+// right away.  Returns false, changing nothing, where there is no such
+// choice, which is everywhere but on Linux.  MADV_FREE is given up on
+// if the kernel turns out not to support it.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemSetReleaseMadvFree(bool madv_free);
+
+// Returns true if TCMalloc_SystemRelease uses MADV_FREE.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemReleaseMadvFree();
+
+// Moves the pages of [from, from+length) to [to, to+length) without
+// copying them, replacing whatever was mapped at "to" and leaving
+// fresh zero-filled pages at "from".  Both ranges must be whole system
+// pages of the default system allocator.  Returns false, with nothing
+// changed, if that is not supported (mremap() on Linux) or fails.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemMove(void* from, void* to, size_t length);
+
+// Asks the operating system to back the specified range with huge pages
+// where it can (madvise(MADV_HUGEPAGE) on Linux).  Purely a hint; does
+// nothing where unsupported.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemHugePageHint(void* start, size_t length);
+
+// Asks the operating system to place the not yet touched pages of the
+// specified range on NUMA node "node" (a node number as the kernel
+// knows it), falling back to other nodes when it is out of memory.
+// Returns false if that is not supported.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemBindToNode(void* start, size_t length, int node);
+
+// Reserves "bytes" of address space that reads as zeroes and takes no
+// memory until parts of it are made writable by
+// TCMalloc_SystemCommitReserved.  The reservation is never given back.
+// Returns NULL if that is not supported, or on failure.
+extern PERFTOOLS_DLL_DECL
+void* TCMalloc_SystemReserve(size_t bytes);
+
+// Makes the pages covering the specified range of a reservation from
+// TCMalloc_SystemReserve writable, and counts them in
+// TCMalloc_SystemTaken.  The memory is taken from the system as the
+// pages are first written.  Returns false on failure.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemCommitReserved(void* start, size_t length);
+
+// Acquire and release all locks held by the functions above, so that
+// fork() cannot leave one of them held in the child.  Taken after
+// pageheap_lock and the central cache locks.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemAllocLockAll();
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemAllocUnlockAll();
+
 // The current system allocator.
 extern PERFTOOLS_DLL_DECL SysAllocator* tcmalloc_sys_alloc;
 
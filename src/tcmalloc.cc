@@ -119,10 +119,14 @@
 #include "base/commandlineflags.h"      // for RegisterFlagValidator, etc
 #include "base/dynamic_annotations.h"   // for RunningOnValgrind
 #include "base/spinlock.h"              // for SpinLockHolder
+#include "base/sysinfo.h"               // for SleepForMilliseconds
 #include "central_freelist.h"  // for CentralFreeListPadded
 #include "common.h"            // for StackTrace, kPageShift, etc
+#include "cpu_cache.h"         // for CpuCache
 #include "internal_logging.h"  // for ASSERT, TCMalloc_Printer, etc
+#include "large_span_cache.h"  // for LargeSpanCache
 #include "linked_list.h"       // for SLL_SetNext
+#include "maybe_threads.h"     // for perftools_pthread_create
 #include "malloc_hook-inl.h"       // for MallocHook::InvokeNewHook, etc
 #include "page_heap.h"         // for PageHeap, PageHeap::Stats
 #include "page_heap_allocator.h"  // for PageHeapAllocator
@@ -150,7 +154,10 @@ using STL_NAMESPACE::vector;
 #include "libc_override.h"
 
 using tcmalloc::AlignmentForSize;
+using tcmalloc::CentralFreeList;
+using tcmalloc::CpuCache;
 using tcmalloc::kLog;
+using tcmalloc::LargeSpanCache;
 using tcmalloc::kCrash;
 using tcmalloc::kCrashWithStats;
 using tcmalloc::Log;
@@ -211,6 +218,21 @@ DEFINE_int64(tcmalloc_large_alloc_report_threshold,
              "logging unless the flag is overridden.  Set to 0 to "
              "disable reporting entirely.");
 
+DEFINE_int64(tcmalloc_release_half_life_ms,
+             EnvToInt64("TCMALLOC_RELEASE_HALF_LIFE_MS", 10000),
+             "With background release on (TCMALLOC_BACKGROUND_RELEASE), "
+             "free memory that is not reused is returned to the system "
+             "at a rate that halves it every this many milliseconds.  "
+             "Zero or less means releasing all of it as soon as it has "
+             "been idle for a while.");
+
+DEFINE_int64(tcmalloc_pregrow_watermark_mb,
+             EnvToInt64("TCMALLOC_PREGROW_WATERMARK_MB", 0),
+             "If positive, a background thread grows the page heap "
+             "whenever it has less than this many MiB of free pages, so "
+             "that allocations rarely have to wait for the system.  "
+             "Zero disables pre-growing.");
+
 
 // We already declared these functions in tcmalloc.h, but we have to
 // declare them again to give them an ATTRIBUTE_SECTION: we want to
@@ -311,6 +333,10 @@ extern "C" {
   //    Windows: _msize()
   size_t tc_malloc_size(void* p) PERFTOOLS_NOTHROW
       ATTRIBUTE_SECTION(google_malloc);
+  void* tc_malloc_size_returning(size_t size, size_t* actual_size) PERFTOOLS_NOTHROW
+      ATTRIBUTE_SECTION(google_malloc);
+  void* tc_new_size_returning(size_t size, size_t* actual_size)
+      ATTRIBUTE_SECTION(google_malloc);
 }  // extern "C"
 #endif  // #ifndef _WIN32
 
@@ -348,28 +374,39 @@ size_t InvalidGetAllocatedSize(const void* ptr) {
 // Extract interesting stats
 struct TCMallocStats {
   uint64_t thread_bytes;      // Bytes in thread caches
+  uint64_t cpu_bytes;         // Bytes in per-CPU caches
   uint64_t central_bytes;     // Bytes in central cache
   uint64_t transfer_bytes;    // Bytes in central transfer cache
+  uint64_t large_span_bytes;  // Bytes in large span cache
   uint64_t metadata_bytes;    // Bytes alloced for metadata
   PageHeap::Stats pageheap;   // Stats from page heap
 };
 
 // Get stats into "r".  Also, if class_count != NULL, class_count[k]
 // will be set to the total number of objects of size class k in the
-// central cache, transfer cache, and per-thread caches. If small_spans
+// central cache, transfer cache, per-CPU and per-thread caches. If small_spans
 // is non-NULL, it is filled.  Same for large_spans.
 static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
                          PageHeap::SmallSpanStats* small_spans,
                          PageHeap::LargeSpanStats* large_spans) {
   r->central_bytes = 0;
   r->transfer_bytes = 0;
+  uint64_t central_released_bytes = 0;
   for (int cl = 0; cl < Static::num_size_classes(); ++cl) {
-    const int length = Static::central_cache()[cl].length();
-    const int tc_length = Static::central_cache()[cl].tc_length();
-    const size_t cache_overhead = Static::central_cache()[cl].OverheadBytes();
+    int length = 0;
+    int tc_length = 0;
+    size_t cache_overhead = 0;
+    size_t released = 0;
+    for (int s = 0; s < Static::num_central_shards(cl); ++s) {
+      length += Static::central_shard(s, cl)->length();
+      tc_length += Static::central_shard(s, cl)->tc_length();
+      cache_overhead += Static::central_shard(s, cl)->OverheadBytes();
+      released += Static::central_shard(s, cl)->released_bytes();
+    }
     const size_t size = static_cast<uint64_t>(
         Static::sizemap()->ByteSizeForClass(cl));
-    r->central_bytes += (size * length) + cache_overhead;
+    r->central_bytes += (size * length) + cache_overhead - released;
+    central_released_bytes += released;
     r->transfer_bytes += (size * tc_length);
     if (class_count) {
       // Sum the lengths of all per-class freelists, except the per-thread
@@ -384,8 +421,16 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
   { // scope
     SpinLockHolder h(Static::pageheap_lock());
     ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
-    r->metadata_bytes = tcmalloc::metadata_system_bytes();
+    r->cpu_bytes = 0;
+    CpuCache::GetStats(&r->cpu_bytes, class_count);
+    r->large_span_bytes = LargeSpanCache::bytes();
+    r->metadata_bytes = tcmalloc::metadata_system_bytes() +
+        Static::pageheap()->pagemap_bytes();
     r->pageheap = Static::pageheap()->stats();
+    // Free pages released from the spans of the central cache are
+    // counted as unmapped, not as central cache bytes.
+    r->pageheap.unmapped_bytes += central_released_bytes;
+    r->pageheap.committed_bytes -= central_released_bytes;
     if (small_spans != NULL) {
       Static::pageheap()->GetSmallSpanStats(small_spans);
     }
@@ -422,7 +467,9 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
                                         - stats.pageheap.free_bytes
                                         - stats.central_bytes
                                         - stats.transfer_bytes
-                                        - stats.thread_bytes);
+                                        - stats.thread_bytes
+                                        - stats.cpu_bytes
+                                        - stats.large_span_bytes);
 
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   out->printf(
@@ -435,6 +482,8 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in central cache freelist\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in transfer cache freelist\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in thread cache freelists\n"
+      "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in per-CPU cache freelists\n"
+      "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in large span cache\n"
       "MALLOC: + %12" PRIu64 " (%7.1f MiB) Bytes in malloc metadata\n"
       "MALLOC:   ------------\n"
       "MALLOC: = %12" PRIu64 " (%7.1f MiB) Actual memory used (physical + swap)\n"
@@ -455,6 +504,8 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       stats.central_bytes, stats.central_bytes / MiB,
       stats.transfer_bytes, stats.transfer_bytes / MiB,
       stats.thread_bytes, stats.thread_bytes / MiB,
+      stats.cpu_bytes, stats.cpu_bytes / MiB,
+      stats.large_span_bytes, stats.large_span_bytes / MiB,
       stats.metadata_bytes, stats.metadata_bytes / MiB,
       physical_memory_used, physical_memory_used / MiB,
       stats.pageheap.unmapped_bytes, stats.pageheap.unmapped_bytes / MiB,
@@ -464,8 +515,30 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       uint64_t(kPageSize));
 
   if (level >= 2) {
+    const uint64_t reuses = stats.pageheap.reuse_count;
+    uint32 release_delay;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      release_delay = Static::pageheap()->GetReleaseDelay();
+    }
+    out->printf("------------------------------------------------\n");
+    out->printf("Released page heap spans allocated again\n");
     out->printf("------------------------------------------------\n");
-    out->printf("Total size of freelists for per-thread caches,\n");
+    out->printf("MALLOC:   %12" PRIu64 " (%7.1f MiB) Reused after release"
+                " (%.1f release ticks later on average)\n"
+                "MALLOC:   %12" PRIu64 "              Reused within %d"
+                " release ticks\n"
+                "MALLOC:   %12d              Extra release ticks spans"
+                " wait before release\n",
+                reuses, stats.pageheap.total_reuse_bytes / MiB,
+                reuses == 0 ? 0.0 :
+                static_cast<double>(stats.pageheap.total_reuse_ticks) / reuses,
+                stats.pageheap.quick_reuse_count,
+                static_cast<int>(PageHeap::kQuickReuseTicks),
+                static_cast<int>(release_delay));
+
+    out->printf("------------------------------------------------\n");
+    out->printf("Total size of freelists for per-thread and per-CPU caches,\n");
     out->printf("transfer cache, and central cache, by size class\n");
     out->printf("------------------------------------------------\n");
     uint64_t cumulative = 0;
@@ -483,6 +556,33 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       }
     }
 
+    out->printf("------------------------------------------------\n");
+    out->printf("Central cache spans by share of objects in use,"
+                " by size class\n");
+    out->printf("------------------------------------------------\n");
+    COMPILE_ASSERT(CentralFreeList::kOccupancyBuckets == 4,
+                   occupancy_buckets_are_quarters);
+    for (uint32 cl = 1; cl < Static::num_size_classes(); ++cl) {
+      CentralFreeList::SpanOccupancy occupancy;
+      memset(&occupancy, 0, sizeof(occupancy));
+      for (int s = 0; s < Static::num_central_shards(cl); ++s) {
+        Static::central_shard(s, cl)->GetSpanOccupancy(&occupancy);
+      }
+      const size_t partial = occupancy.partial[0] + occupancy.partial[1] +
+          occupancy.partial[2] + occupancy.partial[3];
+      if (partial + occupancy.full == 0) continue;
+      out->printf("class %3d [ %8" PRIuS " bytes ] : "
+                  "%6" PRIuS " spans; <=25%%: %6" PRIuS
+                  "; <=50%%: %6" PRIuS "; <=75%%: %6" PRIuS
+                  "; <100%%: %6" PRIuS "; full: %6" PRIuS "\n",
+                  cl,
+                  static_cast<size_t>(Static::sizemap()->ByteSizeForClass(cl)),
+                  partial + occupancy.full,
+                  occupancy.partial[0], occupancy.partial[1],
+                  occupancy.partial[2], occupancy.partial[3],
+                  occupancy.full);
+    }
+
     // append page heap info
     int nonempty_sizes = 0;
     for (int s = 0; s < kMaxPages; s++) {
@@ -526,9 +626,80 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
                 PagesToMiB(total_normal + total_returned),
                 PagesToMiB(large.returned_pages),
                 PagesToMiB(total_returned));
+
+    PageHeap::HugePageStats hp;
+    bool hugepage_aware;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      hugepage_aware = Static::pageheap()->GetHugePageAware();
+      if (hugepage_aware) {
+        Static::pageheap()->GetHugePageStats(&hp);
+      }
+    }
+    if (hugepage_aware) {
+      const int64 partial = hp.partial[0] + hp.partial[1] +
+          hp.partial[2] + hp.partial[3];
+      out->printf("------------------------------------------------\n");
+      out->printf("HugePages: %" PRId64 " of %" PRIuS " KiB;"
+                  " %" PRId64 " full; %" PRId64 " partial;"
+                  " %" PRId64 " free (%" PRId64 " released)\n",
+                  int64_t(hp.hugepages), kHugePageSize >> 10,
+                  int64_t(hp.full), int64_t(partial),
+                  int64_t(hp.free), int64_t(hp.released));
+      static const char* const kBucketNames[4] = {
+        "  0% < used <=  25%", " 25% < used <=  50%",
+        " 50% < used <=  75%", " 75% < used <  100%"
+      };
+      for (int i = 0; i < 4; i++) {
+        out->printf("%s: %6" PRId64 " hugepages\n",
+                    kBucketNames[i], int64_t(hp.partial[i]));
+      }
+      if (partial > 0) {
+        out->printf("Average use of partial hugepages: %5.1f%%\n",
+                    100.0 * hp.partial_used_pages /
+                    (partial * kPagesPerHugePage));
+      }
+    }
+
+    PageHeap::NodeStats nodes[kMaxNumaNodes];
+    int num_nodes;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      num_nodes = Static::pageheap()->GetNumaNodes();
+      for (int n = 0; n < num_nodes; n++) {
+        nodes[n] = Static::pageheap()->node_stats(n);
+      }
+    }
+    if (num_nodes > 1) {
+      out->printf("------------------------------------------------\n");
+      out->printf("NUMA nodes: %d\n", num_nodes);
+      for (int n = 0; n < num_nodes; n++) {
+        out->printf("node %d: %7.1f MiB system; %7.1f MiB free;"
+                    " %7.1f MiB unmapped\n", n,
+                    nodes[n].system_bytes / MiB,
+                    nodes[n].free_bytes / MiB,
+                    nodes[n].unmapped_bytes / MiB);
+      }
+    }
   }
 }
 
+// Splits a "tcmalloc.numa_node<N>_<stat>" property name.  Returns N and
+// points *stat at "_<stat>", or returns -1 for any other name.
+static int ParseNumaNodeProperty(const char* name, const char** stat) {
+  static const char kPrefix[] = "tcmalloc.numa_node";
+  if (strncmp(name, kPrefix, sizeof(kPrefix) - 1) != 0) return -1;
+  const char* p = name + sizeof(kPrefix) - 1;
+  if (*p < '0' || *p > '9') return -1;
+  int node = 0;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    node = node * 10 + (*p - '0');
+    if (node >= kMaxNumaNodes) return -1;
+  }
+  *stat = p;
+  return node;
+}
+
 static void PrintStats(int level) {
   const int kBufferSize = 16 << 10;
   char* buffer = new char[kBufferSize];
@@ -614,6 +785,97 @@ static void IterateOverRanges(void* arg, MallocExtension::RangeFunction func) {
 }
 
 // TCMalloc's support for extra malloc interfaces
+#ifdef HAVE_PTHREAD
+// How often the background thread wakes up to check the pre-grow
+// watermark, and how many of those wake-ups make one release tick.
+// Without a watermark it only wakes up once per release tick.
+static const int kBackgroundThreadWakeupMs = 10;
+static const int kWakeupsPerReleaseTick = 10;
+static const int kBackgroundReleaseTickMs =
+    kBackgroundThreadWakeupMs * kWakeupsPerReleaseTick;
+
+// Protected by pageheap_lock.
+static bool background_thread_running = false;
+
+static void* BackgroundThread(void*) {
+  int tick_elapsed_ms = 0;  // Since the last release tick
+  for (;;) {
+    const Length watermark =
+        static_cast<Length>(FLAGS_tcmalloc_pregrow_watermark_mb) <<
+        (20 - kPageShift);
+    const int sleep_ms = watermark > 0 ?
+        kBackgroundThreadWakeupMs : kBackgroundReleaseTickMs - tick_elapsed_ms;
+    SleepForMilliseconds(sleep_ms);
+    tick_elapsed_ms += sleep_ms;
+    const bool release_tick = tick_elapsed_ms >= kBackgroundReleaseTickMs;
+    if (release_tick) tick_elapsed_ms = 0;
+
+    // Releasing ln(2) * tick / half-life of the free pages on every
+    // tick halves memory that stays free once per half-life.
+    const int64 half_life = FLAGS_tcmalloc_release_half_life_ms;
+    double fraction = 1.0;
+    if (half_life > 0) {
+      fraction = 0.693147 * kBackgroundReleaseTickMs / half_life;
+      if (fraction > 1.0) fraction = 1.0;
+    }
+    if (FLAGS_tcmalloc_release_rate <= 1e-6) {
+      // Tiny release rate means that releasing is disabled.
+      fraction = 0;
+    }
+
+    SpinLockHolder h(Static::pageheap_lock());
+    if (Static::pageheap()->GetBackgroundRelease() && release_tick) {
+      Static::pageheap()->ReleaseIdlePages(fraction);
+    }
+    if (watermark > 0) {
+      Static::pageheap()->Pregrow(watermark);
+    }
+  }
+  return NULL;
+}
+
+#ifdef HAVE_FORK
+// The thread does not survive fork; the child goes back to releasing
+// memory from free() and growing the heap on demand.
+static void BackgroundThreadAfterForkInChild() {
+  background_thread_running = false;
+  Static::pageheap()->SetBackgroundRelease(false);
+}
+#endif
+#endif  // HAVE_PTHREAD
+
+// Starts the thread that does background release and pre-growing of
+// the page heap unless it is running already.  If the thread cannot
+// be started, background release is turned off again.
+// REQUIRES: pageheap_lock is not held.
+static void StartBackgroundThread() {
+#ifdef HAVE_PTHREAD
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    if (background_thread_running) return;
+    background_thread_running = true;
+  }
+#ifdef HAVE_FORK
+  static bool atfork_registered = false;
+  if (!atfork_registered) {
+    perftools_pthread_atfork(NULL, NULL, BackgroundThreadAfterForkInChild);
+    atfork_registered = true;
+  }
+#endif
+  pthread_t thread;
+  if (perftools_pthread_create(&thread, BackgroundThread, NULL) == 0) {
+    return;
+  }
+  Log(kLog, __FILE__, __LINE__,
+      "Could not start the page heap background thread");
+  SpinLockHolder h(Static::pageheap_lock());
+  background_thread_running = false;
+#else
+  SpinLockHolder h(Static::pageheap_lock());
+#endif
+  Static::pageheap()->SetBackgroundRelease(false);
+}
+
 class TCMallocImplementation : public MallocExtension {
  private:
   // ReleaseToSystem() might release more than the requested bytes because
@@ -685,6 +947,18 @@ class TCMallocImplementation : public MallocExtension {
     ThreadCache::BecomeTemporarilyIdle();
   }
 
+  virtual size_t MallocBatch(size_t size, size_t n, void** out) {
+    return tc_malloc_batch(size, n, out);
+  }
+
+  virtual void FreeBatch(void** ptrs, size_t n) {
+    tc_free_batch(ptrs, n);
+  }
+
+  virtual bool TryResize(void* p, size_t new_size) {
+    return tc_try_expand(p, new_size) != 0;
+  }
+
   virtual void Ranges(void* arg, RangeFunction func) {
     IterateOverRanges(arg, func);
   }
@@ -697,6 +971,8 @@ class TCMallocImplementation : public MallocExtension {
       ExtractStats(&stats, NULL, NULL, NULL);
       *value = stats.pageheap.system_bytes
                - stats.thread_bytes
+               - stats.cpu_bytes
+               - stats.large_span_bytes
                - stats.central_bytes
                - stats.transfer_bytes
                - stats.pageheap.free_bytes
@@ -727,6 +1003,17 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.central_cache_released_bytes") == 0) {
+      size_t released = 0;
+      for (int cl = 0; cl < Static::num_size_classes(); ++cl) {
+        for (int s = 0; s < Static::num_central_shards(cl); ++s) {
+          released += Static::central_shard(s, cl)->released_bytes();
+        }
+      }
+      *value = released;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.transfer_cache_free_bytes") == 0) {
       TCMallocStats stats;
       ExtractStats(&stats, NULL, NULL, NULL);
@@ -741,6 +1028,33 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.cpu_cache_free_bytes") == 0) {
+      TCMallocStats stats;
+      ExtractStats(&stats, NULL, NULL, NULL);
+      *value = stats.cpu_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_bytes") == 0) {
+      *value = LargeSpanCache::bytes();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_budget") == 0) {
+      *value = LargeSpanCache::budget();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_hits") == 0) {
+      *value = LargeSpanCache::hits();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.large_span_cache_misses") == 0) {
+      *value = LargeSpanCache::misses();
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.pageheap_free_bytes") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = Static::pageheap()->stats().free_bytes;
@@ -801,6 +1115,30 @@ class TCMallocImplementation : public MallocExtension {
         return true;
     }
 
+    if (strcmp(name, "tcmalloc.pageheap_reuse_count") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->stats().reuse_count;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_quick_reuse_count") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->stats().quick_reuse_count;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_total_reuse_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->stats().total_reuse_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_total_reuse_ticks") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->stats().total_reuse_ticks;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.max_total_thread_cache_bytes") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = ThreadCache::overall_thread_cache_size();
@@ -820,6 +1158,66 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.hugepage_aware") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(Static::pageheap()->GetHugePageAware());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_release") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(Static::pageheap()->GetBackgroundRelease());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_delay_ticks") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->GetReleaseDelay();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_madv_free") == 0) {
+      *value = size_t(TCMalloc_SystemReleaseMadvFree());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_nodes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->GetNumaNodes();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.size_class_regions") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(Static::pageheap()->GetSizeClassRegions());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.span_bitmaps") == 0) {
+      *value = size_t(CentralFreeList::GetSpanBitmaps());
+      return true;
+    }
+
+    const char* stat;
+    const int node = ParseNumaNodeProperty(name, &stat);
+    if (node >= 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      if (node >= Static::pageheap()->GetNumaNodes()) return false;
+      const PageHeap::NodeStats stats = Static::pageheap()->node_stats(node);
+      if (strcmp(stat, "_system_bytes") == 0) {
+        *value = stats.system_bytes;
+        return true;
+      }
+      if (strcmp(stat, "_free_bytes") == 0) {
+        *value = stats.free_bytes;
+        return true;
+      }
+      if (strcmp(stat, "_unmapped_bytes") == 0) {
+        *value = stats.unmapped_bytes;
+        return true;
+      }
+    }
+
     return false;
   }
 
@@ -838,6 +1236,19 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.background_release") == 0) {
+      {
+        SpinLockHolder l(Static::pageheap_lock());
+        Static::pageheap()->SetBackgroundRelease(value != 0);
+      }
+      if (value != 0) StartBackgroundThread();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_madv_free") == 0) {
+      return TCMalloc_SystemSetReleaseMadvFree(value != 0);
+    }
+
     return false;
   }
 
@@ -857,21 +1268,52 @@ class TCMallocImplementation : public MallocExtension {
     tcmalloc_sys_alloc = alloc;
   }
 
+  virtual void ReleaseFreeMemory() {
+    // The objects cached per CPU go back to their spans first, so that
+    // the spans they empty are released as well.
+    CpuCache::Drain();
+    ReleaseToSystem(static_cast<size_t>(-1));
+  }
+
   virtual void ReleaseToSystem(size_t num_bytes) {
+    size_t bytes_released;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      if (num_bytes <= extra_bytes_released_) {
+        // We released too much on a prior call, so don't release any
+        // more this time.
+        extra_bytes_released_ = extra_bytes_released_ - num_bytes;
+        return;
+      }
+      num_bytes = num_bytes - extra_bytes_released_;
+      // num_bytes might be less than one page.  If we pass zero to
+      // ReleaseAtLeastNPages, it won't do anything, so we release a whole
+      // page now and let extra_bytes_released_ smooth it out over time.
+      Length num_pages = max<Length>(num_bytes >> kPageShift, 1);
+      bytes_released = Static::pageheap()->ReleaseAtLeastNPages(
+          num_pages) << kPageShift;
+    }
+    // Then the free pages of partly used spans.  pageheap_lock is not
+    // held meanwhile: the central lists take it to give back the spans
+    // that become free.
+    if (CentralFreeList::GetSpanBitmaps()) {
+      for (int cl = 1;
+           cl < Static::num_size_classes() && bytes_released < num_bytes;
+           ++cl) {
+        for (int s = 0; s < Static::num_central_shards(cl); ++s) {
+          bytes_released += Static::central_shard(s, cl)->ReleaseFreePages();
+        }
+      }
+    }
+    // Last, the large spans kept for reuse.
+    const bool flushed =
+        bytes_released < num_bytes && LargeSpanCache::Flush() != 0;
     SpinLockHolder h(Static::pageheap_lock());
-    if (num_bytes <= extra_bytes_released_) {
-      // We released too much on a prior call, so don't release any
-      // more this time.
-      extra_bytes_released_ = extra_bytes_released_ - num_bytes;
-      return;
+    if (flushed) {
+      bytes_released += Static::pageheap()->ReleaseAtLeastNPages(
+          max<Length>((num_bytes - bytes_released) >> kPageShift, 1))
+          << kPageShift;
     }
-    num_bytes = num_bytes - extra_bytes_released_;
-    // num_bytes might be less than one page.  If we pass zero to
-    // ReleaseAtLeastNPages, it won't do anything, so we release a whole
-    // page now and let extra_bytes_released_ smooth it out over time.
-    Length num_pages = max<Length>(num_bytes >> kPageShift, 1);
-    size_t bytes_released = Static::pageheap()->ReleaseAtLeastNPages(
-        num_pages) << kPageShift;
     if (bytes_released > num_bytes) {
       extra_bytes_released_ = bytes_released - num_bytes;
     } else {
@@ -919,6 +1361,7 @@ class TCMallocImplementation : public MallocExtension {
     static const char* kCentralCacheType = "tcmalloc.central";
     static const char* kTransferCacheType = "tcmalloc.transfer";
     static const char* kThreadCacheType = "tcmalloc.thread";
+    static const char* kCpuCacheType = "tcmalloc.cpu";
     static const char* kPageHeapType = "tcmalloc.page";
     static const char* kPageHeapUnmappedType = "tcmalloc.page_unmapped";
     static const char* kLargeSpanType = "tcmalloc.large";
@@ -933,14 +1376,18 @@ class TCMallocImplementation : public MallocExtension {
       MallocExtension::FreeListInfo i;
       i.min_object_size = prev_class_size + 1;
       i.max_object_size = class_size;
-      i.total_bytes_free =
-          Static::central_cache()[cl].length() * class_size;
+      int length = 0;
+      int tc_length = 0;
+      for (int s = 0; s < Static::num_central_shards(cl); ++s) {
+        length += Static::central_shard(s, cl)->length();
+        tc_length += Static::central_shard(s, cl)->tc_length();
+      }
+      i.total_bytes_free = length * class_size;
       i.type = kCentralCacheType;
       v->push_back(i);
 
       // transfer cache
-      i.total_bytes_free =
-          Static::central_cache()[cl].tc_length() * class_size;
+      i.total_bytes_free = tc_length * class_size;
       i.type = kTransferCacheType;
       v->push_back(i);
 
@@ -969,6 +1416,26 @@ class TCMallocImplementation : public MallocExtension {
       prev_class_size = Static::sizemap()->ByteSizeForClass(cl);
     }
 
+    // Add stats from per-CPU caches
+    if (CpuCache::IsActive()) {
+      memset(class_count, 0, sizeof(class_count));
+      uint64_t cpu_bytes = 0;
+      CpuCache::GetStats(&cpu_bytes, class_count);
+
+      prev_class_size = 0;
+      for (int cl = 1; cl < Static::num_size_classes(); ++cl) {
+        MallocExtension::FreeListInfo i;
+        i.min_object_size = prev_class_size + 1;
+        i.max_object_size = Static::sizemap()->ByteSizeForClass(cl);
+        i.total_bytes_free =
+            class_count[cl] * Static::sizemap()->ByteSizeForClass(cl);
+        i.type = kCpuCacheType;
+        v->push_back(i);
+
+        prev_class_size = Static::sizemap()->ByteSizeForClass(cl);
+      }
+    }
+
     // append page heap info
     PageHeap::SmallSpanStats small;
     PageHeap::LargeSpanStats large;
@@ -1107,6 +1574,14 @@ TCMallocGuard::TCMallocGuard() {
     tc_free(tc_malloc(1));
     ThreadCache::InitTSD();
     tc_free(tc_malloc(1));
+    bool background_release;
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      background_release = Static::pageheap()->GetBackgroundRelease();
+    }
+    if (background_release || FLAGS_tcmalloc_pregrow_watermark_mb > 0) {
+      StartBackgroundThread();
+    }
     // Either we, or debugallocation.cc, or valgrind will control memory
     // management.  We register our extension if we're the winner.
 #ifdef TCMALLOC_USING_DEBUGALLOCATION
@@ -1172,7 +1647,8 @@ static void* DoSampledAllocation(size_t size) {
 
   SpinLockHolder h(Static::pageheap_lock());
   // Allocate span
-  Span *span = Static::pageheap()->New(tcmalloc::pages(size == 0 ? 1 : size));
+  Span *span = Static::pageheap()->New(tcmalloc::pages(size == 0 ? 1 : size),
+                                       Static::CurrentNumaNode());
   if (PREDICT_FALSE(span == NULL)) {
     return NULL;
   }
@@ -1329,10 +1805,24 @@ static void* do_malloc_pages(ThreadCache* heap, size_t size) {
     SpinLockHolder h(Static::pageheap_lock());
     report_large = should_report_large(num_pages);
   } else {
-    SpinLockHolder h(Static::pageheap_lock());
-    Span* span = Static::pageheap()->New(num_pages);
-    result = (PREDICT_FALSE(span == NULL) ? NULL : SpanToMallocResult(span));
-    report_large = should_report_large(num_pages);
+    // A span from the large span cache doesn't need the page heap, nor
+    // its lock unless the allocation may have to be reported.
+    const int node = Static::CurrentNumaNode();
+    Span* span = LargeSpanCache::Get(num_pages, node);
+    if (span != NULL) {
+      result = SpanToMallocResult(span);
+#ifdef ENABLE_LARGE_ALLOC_REPORT
+      SpinLockHolder h(Static::pageheap_lock());
+      report_large = should_report_large(num_pages);
+#else
+      report_large = false;
+#endif
+    } else {
+      SpinLockHolder h(Static::pageheap_lock());
+      span = Static::pageheap()->New(num_pages, node);
+      result = (PREDICT_FALSE(span == NULL) ? NULL : SpanToMallocResult(span));
+      report_large = should_report_large(num_pages);
+    }
   }
 
   if (report_large) {
@@ -1368,6 +1858,10 @@ ATTRIBUTE_ALWAYS_INLINE inline void* do_malloc(size_t size) {
 
   // The common case, and also the simplest.  This just pops the
   // size-appropriate freelist, after replenishing it if it's empty.
+  if (CpuCache::UsesClass(cl)) {
+    return CheckedMallocResult(
+        CpuCache::Allocate(cache, cl, allocated_size, nop_oom_handler));
+  }
   return CheckedMallocResult(cache->Allocate(allocated_size, cl, nop_oom_handler));
 }
 
@@ -1384,13 +1878,26 @@ ATTRIBUTE_ALWAYS_INLINE inline void* do_malloc_or_cpp_alloc(size_t size) {
                     false, true);
 }
 
+// Returns true if the block at ptr, just allocated for "size" bytes, is
+// a large one whose pages the page heap knows to read as zero, because
+// they came fresh from the system or were released since last used.
+static bool PagesKnownZero(void* ptr, size_t size) {
+  if (PREDICT_TRUE(size <= kMaxSize) || tcmalloc::IsEmergencyPtr(ptr)) {
+    return false;
+  }
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  const Span* span = Static::pageheap()->GetDescriptor(p);
+  return span != NULL && span->start == p && span->sizeclass == 0 &&
+      span->known_zero;
+}
+
 ATTRIBUTE_ALWAYS_INLINE inline void* do_calloc(size_t n, size_t elem_size) {
   // Overflow check
   const size_t size = n * elem_size;
   if (elem_size != 0 && size / elem_size != n) return NULL;
 
   void* result = do_malloc_or_cpp_alloc(size);
-  if (result != NULL) {
+  if (result != NULL && !PagesKnownZero(result, size)) {
     memset(result, 0, tc_nallocx(size, 0));
   }
   return result;
@@ -1404,6 +1911,9 @@ inline void free_null_or_invalid(void* ptr, void (*invalid_free_fn)(void*)) {
 }
 
 static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
+  if (!span->sample && LargeSpanCache::Put(span)) {
+    return;
+  }
   SpinLockHolder h(Static::pageheap_lock());
   if (span->sample) {
     StackTrace* st = reinterpret_cast<StackTrace*>(span->objects);
@@ -1468,6 +1978,10 @@ void do_free_with_callback(void* ptr,
   if (PREDICT_TRUE(heap != NULL)) {
     ASSERT(Static::IsInited());
     // If we've hit initialized thread cache, so we're done.
+    if (CpuCache::UsesClass(cl)) {
+      CpuCache::Deallocate(heap, ptr, cl);
+      return;
+    }
     heap->Deallocate(ptr, cl);
     return;
   }
@@ -1485,7 +1999,8 @@ void do_free_with_callback(void* ptr,
 
   // Otherwise, delete directly into central cache
   tcmalloc::SLL_SetNext(ptr, NULL);
-  Static::central_cache()[cl].InsertRange(ptr, ptr, 1);
+  Static::central_freelist(cl, 0, Static::CurrentNumaNode())
+      ->InsertRange(ptr, ptr, 1);
 }
 
 // The default "do_free" that uses the default callback.
@@ -1522,6 +2037,72 @@ inline size_t GetSizeWithCallback(const void* ptr,
   return span->length << kPageShift;
 }
 
+// Large blocks at least this big that cannot grow in place have their
+// pages moved rather than copied by realloc.  Each move leaves the old
+// pages as separate mappings, so small blocks are not worth it.
+static const size_t kMinReallocMoveBytes = 4 << 20;
+
+// Helper for do_realloc_with_callback().  Grows the large block at
+// old_ptr to at least new_size bytes without copying it, by extending
+// its span into the free pages that follow it or, failing that, by
+// moving its pages to a span of at least alloc_size bytes.  Returns
+// the block's new address, or NULL if it has to be copied.
+static ATTRIBUTE_NOINLINE void* do_realloc_pages(void* old_ptr,
+                                                 size_t new_size,
+                                                 size_t alloc_size) {
+  const PageID p = reinterpret_cast<uintptr_t>(old_ptr) >> kPageShift;
+  Span* span;
+  Span* new_span;
+  Length num_pages = tcmalloc::pages(new_size);
+  bool report_large;
+  {
+    SpinLockHolder h(Static::pageheap_lock());
+    span = Static::pageheap()->GetDescriptor(p);
+    if (span == NULL || span->start != p || span->sizeclass != 0 ||
+        span->sample || span->location != Span::IN_USE) {
+      return NULL;
+    }
+    if (Static::pageheap()->Extend(span, num_pages)) {
+      report_large = should_report_large(num_pages);
+      new_span = span;
+    } else {
+      if ((span->length << kPageShift) < kMinReallocMoveBytes ||
+          Static::pageheap()->GetHugePageAware()) {
+        return NULL;
+      }
+      num_pages = tcmalloc::pages(alloc_size);
+      new_span = Static::pageheap()->New(num_pages,
+                                         Static::CurrentNumaNode());
+      if (new_span == NULL) {
+        return NULL;
+      }
+      report_large = should_report_large(num_pages);
+    }
+  }
+
+  void* result = SpanToMallocResult(new_span);
+  if (new_span != span) {
+    // The old span cannot have changed while unlocked: it is still
+    // allocated, to the caller.
+    const size_t old_bytes = span->length << kPageShift;
+    const bool moved = TCMalloc_SystemMove(old_ptr, result, old_bytes);
+    if (!moved) {
+      memcpy(result, old_ptr, old_bytes);
+    }
+    SpinLockHolder h(Static::pageheap_lock());
+    if (moved) {
+      Static::pageheap()->DeleteReleased(span);
+    } else {
+      Static::pageheap()->Delete(span);
+    }
+  }
+
+  if (report_large) {
+    ReportLargeAlloc(num_pages, result);
+  }
+  return result;
+}
+
 // This lets you call back to a given function pointer if ptr is invalid.
 // It is used primarily by windows code which wants a specialized callback.
 ATTRIBUTE_ALWAYS_INLINE inline void* do_realloc_with_callback(
@@ -1545,6 +2126,15 @@ ATTRIBUTE_ALWAYS_INLINE inline void* do_realloc_with_callback(
     // Need to reallocate.
     void* new_ptr = NULL;
 
+    if (new_size > old_size && old_size > kMaxSize) {
+      new_ptr = do_realloc_pages(old_ptr, new_size,
+                                 max(new_size, lower_bound_to_grow));
+      if (new_ptr != NULL) {
+        MallocHook::InvokeDeleteHook(old_ptr);
+        MallocHook::InvokeNewHook(new_ptr, new_size);
+        return new_ptr;
+      }
+    }
     if (new_size > old_size && new_size < lower_bound_to_grow) {
       new_ptr = do_malloc_or_cpp_alloc(lower_bound_to_grow);
     }
@@ -1592,7 +2182,7 @@ void* do_memalign_pages(size_t align, size_t size) {
 
   // Allocate extra pages and carve off an aligned portion
   const Length alloc = tcmalloc::pages(size + align);
-  Span* span = Static::pageheap()->New(alloc);
+  Span* span = Static::pageheap()->New(alloc, Static::CurrentNumaNode());
   if (PREDICT_FALSE(span == NULL)) return NULL;
 
   // Skip starting portion so that we end up aligned
@@ -1640,12 +2230,16 @@ inline struct mallinfo do_mallinfo() {
   // size values will be truncated.
   info.arena     = static_cast<int>(stats.pageheap.system_bytes);
   info.fsmblks   = static_cast<int>(stats.thread_bytes
+                                    + stats.cpu_bytes
+                                    + stats.large_span_bytes
                                     + stats.central_bytes
                                     + stats.transfer_bytes);
   info.fordblks  = static_cast<int>(stats.pageheap.free_bytes +
                                     stats.pageheap.unmapped_bytes);
   info.uordblks  = static_cast<int>(stats.pageheap.system_bytes
                                     - stats.thread_bytes
+                                    - stats.cpu_bytes
+                                    - stats.large_span_bytes
                                     - stats.central_bytes
                                     - stats.transfer_bytes
                                     - stats.pageheap.free_bytes
@@ -1791,6 +2385,20 @@ static ATTRIBUTE_ALWAYS_INLINE inline void* dispatch_allocate_full(size_t size)
   return allocate_full_malloc_oom(size);
 }
 
+// Like the above, and also sets *actual_size, if not NULL, to the
+// usable size of the result.  The usable size follows from "size"
+// alone, as for nallocx(), except for emergency blocks.
+template <void* OOMHandler(size_t)>
+static ATTRIBUTE_ALWAYS_INLINE inline void* dispatch_allocate_full(
+    size_t size, size_t* actual_size) {
+  void* p = dispatch_allocate_full<OOMHandler>(size);
+  if (actual_size != NULL && p != NULL) {
+    *actual_size = (PREDICT_FALSE(tcmalloc::IsEmergencyPtr(p)) ?
+                    size : tc_nallocx(size, 0));
+  }
+  return p;
+}
+
 struct retry_memalign_data {
   size_t align;
   size_t size;
@@ -1832,30 +2440,41 @@ void* memalign_pages(size_t align, size_t size,
 // produced code is short enough to enable effort-less human
 // comprehension. Which itself led to elimination of various checks
 // that were not necessary for fast-path.
+//
+// If actual_size is not NULL, the usable size of the result is stored
+// there.  Callers that pass a constant NULL pay nothing for that.
 template <void* OOMHandler(size_t)>
 ATTRIBUTE_ALWAYS_INLINE inline
-static void * malloc_fast_path(size_t size) {
+static void * malloc_fast_path(size_t size, size_t* actual_size = NULL) {
   if (PREDICT_FALSE(!base::internal::new_hooks_.empty())) {
-    return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
+    return tcmalloc::dispatch_allocate_full<OOMHandler>(size, actual_size);
   }
 
   ThreadCache *cache = ThreadCache::GetFastPathCache();
 
   if (PREDICT_FALSE(cache == NULL)) {
-    return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
+    return tcmalloc::dispatch_allocate_full<OOMHandler>(size, actual_size);
   }
 
   uint32 cl;
   if (PREDICT_FALSE(!Static::sizemap()->GetSizeClass(size, &cl))) {
-    return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
+    return tcmalloc::dispatch_allocate_full<OOMHandler>(size, actual_size);
   }
 
   size_t allocated_size = Static::sizemap()->ByteSizeForClass(cl);
 
   if (PREDICT_FALSE(!cache->TryRecordAllocationFast(allocated_size))) {
-    return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
+    return tcmalloc::dispatch_allocate_full<OOMHandler>(size, actual_size);
+  }
+
+  if (actual_size != NULL) {
+    *actual_size = allocated_size;
   }
 
+  if (CpuCache::UsesClass(cl)) {
+    return CheckedMallocResult(
+        CpuCache::Allocate(cache, cl, allocated_size, OOMHandler));
+  }
   return CheckedMallocResult(cache->Allocate(allocated_size, cl, OOMHandler));
 }
 
@@ -1884,6 +2503,12 @@ void* tc_malloc(size_t size) PERFTOOLS_NOTHROW {
   return malloc_fast_path<tcmalloc::malloc_oom>(size);
 }
 
+extern "C" PERFTOOLS_DLL_DECL
+void* tc_malloc_size_returning(size_t size,
+                               size_t* actual_size) PERFTOOLS_NOTHROW {
+  return malloc_fast_path<tcmalloc::malloc_oom>(size, actual_size);
+}
+
 static ATTRIBUTE_ALWAYS_INLINE inline
 void free_fast_path(void *ptr) {
   if (PREDICT_FALSE(!base::internal::delete_hooks_.empty())) {
@@ -1985,6 +2610,11 @@ void* tc_new_nothrow(size_t size, const std::nothrow_t&) PERFTOOLS_NOTHROW {
   return malloc_fast_path<tcmalloc::cpp_nothrow_oom>(size);
 }
 
+extern "C" PERFTOOLS_DLL_DECL
+void* tc_new_size_returning(size_t size, size_t* actual_size) {
+  return malloc_fast_path<tcmalloc::cpp_throw_oom>(size, actual_size);
+}
+
 extern "C" PERFTOOLS_DLL_DECL void tc_delete(void* p) PERFTOOLS_NOTHROW
 #ifdef TC_ALIAS
 TC_ALIAS(tc_free);
@@ -2199,4 +2829,149 @@ extern "C" PERFTOOLS_DLL_DECL void* tc_malloc_skip_new_handler(size_t size)  PER
   return result;
 }
 
+// The batch functions look the size class up, check for hooks and
+// account the sampler once for the whole batch.  Anything unusual,
+// including a batch that is due to be sampled, goes through the
+// ordinary functions one object at a time.
+extern "C" PERFTOOLS_DLL_DECL
+size_t tc_malloc_batch(size_t size, size_t n, void** out) PERFTOOLS_NOTHROW {
+  ThreadCache* cache = ThreadCache::GetFastPathCache();
+  uint32 cl;
+  if (PREDICT_TRUE(base::internal::new_hooks_.empty() && cache != NULL &&
+                   Static::sizemap()->GetSizeClass(size, &cl) &&
+                   !CpuCache::UsesClass(cl))) {
+    const size_t allocated_size = Static::sizemap()->ByteSizeForClass(cl);
+    // Keeps the sampler's arithmetic in range.
+    if (n <= (static_cast<size_t>(1) << 30) / allocated_size &&
+        cache->TryRecordAllocationFast(allocated_size * n)) {
+      const size_t count = cache->AllocateBatch(allocated_size, cl, n, out);
+      if (PREDICT_FALSE(count < n)) {
+        errno = ENOMEM;
+      }
+      return count;
+    }
+  }
+
+  size_t count = 0;
+  for (; count < n; count++) {
+    out[count] = tc_malloc(size);
+    if (out[count] == NULL) {
+      break;
+    }
+  }
+  return count;
+}
+
+extern "C" PERFTOOLS_DLL_DECL
+void tc_free_batch(void** ptrs, size_t n) PERFTOOLS_NOTHROW {
+  ThreadCache* heap = ThreadCache::GetCacheIfPresent();
+  if (PREDICT_FALSE(!base::internal::delete_hooks_.empty() || heap == NULL)) {
+    for (size_t i = 0; i < n; i++) {
+      tc_free(ptrs[i]);
+    }
+    return;
+  }
+
+  size_t i = 0;
+  while (i < n) {
+    void* ptr = ptrs[i++];
+    uint32 cl;
+    if (PREDICT_FALSE(!Static::pageheap()->TryGetSizeClass(
+            reinterpret_cast<uintptr_t>(ptr) >> kPageShift, &cl) ||
+        CpuCache::UsesClass(cl))) {
+      do_free(ptr);
+      continue;
+    }
+    // Link up the objects of the same class that follow, and hand them
+    // to the thread cache together.
+    void* tail = ptr;
+    int count = 1;
+    while (i < n) {
+      void* next = ptrs[i];
+      uint32 next_cl;
+      if (!Static::pageheap()->TryGetSizeClass(
+              reinterpret_cast<uintptr_t>(next) >> kPageShift, &next_cl) ||
+          next_cl != cl) {
+        break;
+      }
+      tcmalloc::SLL_SetNext(tail, next);
+      tail = next;
+      count++;
+      i++;
+    }
+    heap->DeallocateRange(ptr, tail, count, cl);
+  }
+}
+
+// Returns true if a block of size class cl may be treated as a block of
+// new_size bytes, which callers will free with that size: new_size must
+// map to the same class.  A block never moves to another class in place.
+static inline bool SizeKeepsClass(size_t new_size, uint32 cl) {
+  uint32 new_cl;
+  return Static::sizemap()->GetSizeClass(new_size, &new_cl) && new_cl == cl;
+}
+
+// Helper for tc_try_expand().  Resizes the block at ptr, which was not
+// found in the size class cache, to hold new_size bytes in place.  A
+// large block gives its trailing pages back to the page heap, or takes
+// more from the free span that follows it, but never becomes small
+// enough for a size class.
+static ATTRIBUTE_NOINLINE bool do_try_resize_pages(void* ptr,
+                                                   size_t new_size) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  SpinLockHolder h(Static::pageheap_lock());
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  if (span == NULL || span->location != Span::IN_USE) {
+    return false;
+  }
+  if (span->sizeclass != 0) {
+    return SizeKeepsClass(new_size, span->sizeclass);
+  }
+  if (span->start != p) {
+    return false;
+  }
+  if (span->sample) {
+    const size_t orig_size =
+        reinterpret_cast<StackTrace*>(span->objects)->size;
+    uint32 orig_cl;
+    if (Static::sizemap()->GetSizeClass(orig_size, &orig_cl)) {
+      return SizeKeepsClass(new_size, orig_cl);
+    }
+    return new_size > kMaxSize && new_size <= tc_nallocx(orig_size, 0);
+  }
+  if (new_size <= kMaxSize) {
+    return false;
+  }
+
+  const Length num_pages = new_size == 0 ? 1 : tcmalloc::pages(new_size);
+  if (num_pages < span->length) {
+    Static::pageheap()->Delete(Static::pageheap()->Split(span, num_pages));
+  } else if (num_pages > span->length) {
+    return Static::pageheap()->Extend(span, num_pages);
+  }
+  return true;
+}
+
+extern "C" PERFTOOLS_DLL_DECL
+int tc_try_expand(void* ptr, size_t new_size) PERFTOOLS_NOTHROW {
+  if (PREDICT_FALSE(ptr == NULL || tcmalloc::IsEmergencyPtr(ptr))) {
+    return 0;
+  }
+  uint32 cl;
+  bool resized;
+  if (Static::pageheap()->TryGetSizeClass(
+          reinterpret_cast<uintptr_t>(ptr) >> kPageShift, &cl)) {
+    resized = SizeKeepsClass(new_size, cl);
+  } else {
+    resized = do_try_resize_pages(ptr, new_size);
+  }
+  if (!resized) {
+    return 0;
+  }
+  // Report the updated size, as realloc does.
+  MallocHook::InvokeDeleteHook(ptr);
+  MallocHook::InvokeNewHook(ptr, new_size);
+  return 1;
+}
+
 #endif  // TCMALLOC_USING_DEBUGALLOCATION
@@ -7,9 +7,14 @@
 
 #include "config_for_unittests.h"
 #include "page_heap.h"
+#include "span_set.h"
 #include "system-alloc.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <utility>
 #include "base/logging.h"
+#include "base/spinlock.h"
 #include "common.h"
 
 DECLARE_int64(tcmalloc_heap_limit_mb);
@@ -38,6 +43,116 @@ static void CheckStats(const tcmalloc::PageHeap* ph,
   EXPECT_EQ(unmapped_pages, stats.unmapped_bytes >> kPageShift);
 }
 
+// Counts system allocations made without 'lock' held.  Metadata
+// allocations still happen with it held.
+struct LockCheckingSysAllocator : public SysAllocator {
+  SysAllocator* child;
+  SpinLock* lock;
+  int calls;
+
+  void* Alloc(size_t size, size_t* actual_size, size_t alignment) {
+    if (!lock->IsHeld()) calls++;
+    return child->Alloc(size, actual_size, alignment);
+  }
+};
+
+static void TestPageHeap_GrowOutsideLock() {
+  SpinLock lock;
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap(&lock);
+
+  LockCheckingSysAllocator alloc;
+  alloc.child = MallocExtension::instance()->GetSystemAllocator();
+  alloc.lock = &lock;
+  alloc.calls = 0;
+  MallocExtension::instance()->SetSystemAllocator(&alloc);
+  {
+    SpinLockHolder h(&lock);
+    tcmalloc::Span* s = ph->New(256);
+    EXPECT_TRUE(lock.IsHeld());
+    EXPECT_EQ(1, alloc.calls);
+    CheckStats(ph, 256, 0, 0);
+
+    // Pre-growing makes sure enough pages are free.
+    ph->Pregrow(300);
+    EXPECT_EQ(2, alloc.calls);
+    CheckStats(ph, 556, 300, 0);
+    ph->Pregrow(300);
+    EXPECT_EQ(2, alloc.calls);
+
+    ph->Delete(s);
+  }
+  MallocExtension::instance()->SetSystemAllocator(alloc.child);
+
+  delete ph;
+}
+
+static void TestPageHeap_IdleRelease() {
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap();
+  ph->SetBackgroundRelease(true);
+
+  // Freeing memory does not release anything by itself.
+  tcmalloc::Span* s1 = ph->New(256);
+  tcmalloc::Span* s2 = ph->Split(s1, 128);
+  ph->Delete(s2);
+  CheckStats(ph, 256, 128, 0);
+
+  // 's2' has to be idle for a whole tick first.
+  EXPECT_EQ(0, ph->ReleaseIdlePages(1.0));
+  CheckStats(ph, 256, 128, 0);
+  ph->ReleaseIdlePages(1.0);
+  CheckStats(ph, 256, 0, 128);
+
+  // A zero fraction only advances the clock.
+  ph->Delete(s1);
+  ph->ReleaseIdlePages(0);
+  ph->ReleaseIdlePages(0);
+  CheckStats(ph, 256, 128, 128);
+  ph->ReleaseIdlePages(1.0);
+  CheckStats(ph, 256, 0, 256);
+
+  delete ph;
+}
+
+// Releases more separate free spans than fit in one release batch,
+// dropping the heap's lock around each batch.
+static void TestPageHeap_BatchRelease() {
+  static const int kSpans = 200;
+  SpinLock lock;
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap(&lock);
+  SpinLockHolder h(&lock);
+
+  tcmalloc::Span* spans[2 * kSpans];
+  for (int i = 0; i < 2 * kSpans; i++) {
+    spans[i] = ph->New(1);
+  }
+  for (int i = 0; i < 2 * kSpans; i += 2) {
+    ph->Delete(spans[i]);
+  }
+  const uint64_t system_pages = ph->stats().system_bytes >> kPageShift;
+  const uint64_t free_pages = ph->stats().free_bytes >> kPageShift;
+  CHECK_GT(free_pages, kSpans);
+
+  ph->ReleaseAtLeastNPages(free_pages);
+  CheckStats(ph, system_pages, 0, free_pages);
+  if (HaveSystemRelease) {
+    for (int i = 0; i < 2 * kSpans; i += 2) {
+      EXPECT_EQ(tcmalloc::Span::ON_RETURNED_FREELIST,
+                ph->GetDescriptor(spans[i]->start)->location);
+    }
+  }
+  CHECK(ph->Check());
+
+  for (int i = 1; i < 2 * kSpans; i += 2) {
+    ph->Delete(spans[i]);
+  }
+  tcmalloc::PageHeap::Stats stats = ph->stats();
+  EXPECT_EQ(system_pages,
+            (stats.free_bytes + stats.unmapped_bytes) >> kPageShift);
+  CHECK(ph->Check());
+
+  delete ph;
+}
+
 static void TestPageHeap_Stats() {
   tcmalloc::PageHeap* ph = new tcmalloc::PageHeap();
 
@@ -152,10 +267,274 @@ static void TestPageHeap_Limit() {
   delete ph;
 }
 
+static void TestPageHeap_HugePages() {
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap();
+  ph->SetHugePageAware(true);
+  const Length P = kPagesPerHugePage;
+  tcmalloc::PageHeap::HugePageStats hp;
+
+  // The heap grows in whole, aligned hugepages.
+  tcmalloc::Span* a = ph->New(2 * P);
+  EXPECT_EQ(0, a->start % P);
+  EXPECT_EQ(2 * P, ph->stats().system_bytes >> kPageShift);
+  ph->GetHugePageStats(&hp);
+  EXPECT_EQ(2, hp.hugepages);
+  EXPECT_EQ(2, hp.full);
+
+  // Leave hugepage 0 nearly full and hugepage 1 nearly empty, with a
+  // free single page on each.
+  tcmalloc::Span* a1 = ph->Split(a, 1);
+  tcmalloc::Span* a2 = ph->Split(a1, P - 1);
+  tcmalloc::Span* a3 = ph->Split(a2, 1);
+  tcmalloc::Span* a4 = ph->Split(a3, 2);
+  const PageID first_free = a->start;
+  ph->Delete(a4);
+  ph->Delete(a);
+  ph->Delete(a2);
+  ph->GetHugePageStats(&hp);
+  EXPECT_EQ(0, hp.full);
+  EXPECT_EQ(1, hp.partial[0]);
+  EXPECT_EQ(1, hp.partial[3]);
+  EXPECT_EQ(P + 1, hp.partial_used_pages);
+
+  // Single pages come from the fuller hugepage.
+  tcmalloc::Span* s = ph->New(1);
+  EXPECT_EQ(first_free, s->start);
+  ph->GetHugePageStats(&hp);
+  EXPECT_EQ(1, hp.full);
+
+  // Memory is only released in whole hugepages: with a page in use on
+  // each of them there is nothing to release.
+  EXPECT_EQ(0, ph->ReleaseAtLeastNPages(1));
+  ph->Delete(a1);
+  ph->Delete(s);
+  if (HaveSystemRelease) {
+    EXPECT_EQ(P, ph->ReleaseAtLeastNPages(1));
+    ph->GetHugePageStats(&hp);
+    EXPECT_EQ(1, hp.free);
+    EXPECT_EQ(1, hp.released);
+    EXPECT_EQ(P, ph->stats().unmapped_bytes >> kPageShift);
+  }
+  EXPECT_TRUE(ph->CheckExpensive());
+
+  // Reusing a released hugepage commits it again.
+  tcmalloc::Span* b = ph->New(P);
+  ph->GetHugePageStats(&hp);
+  EXPECT_EQ(0, hp.released);
+
+  // Asking for every free page (ReleaseFreeMemory) releases partially
+  // used hugepages too.
+  if (HaveSystemRelease) {
+    EXPECT_GE(ph->ReleaseAtLeastNPages(kMaxValidPages), 1);
+    EXPECT_EQ(0, ph->stats().free_bytes);
+  }
+  ph->Delete(b);
+  ph->Delete(a3);
+  EXPECT_TRUE(ph->CheckExpensive());
+
+  delete ph;
+}
+
+static void TestPageHeap_NumaNodes() {
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap();
+  CHECK(ph->SetNumaNodes(2));
+  EXPECT_EQ(2, ph->GetNumaNodes());
+
+  // Each node grows its own memory.
+  tcmalloc::Span* a = ph->New(1, 0);
+  tcmalloc::Span* b = ph->New(1, 1);
+  EXPECT_EQ(0, a->node);
+  EXPECT_EQ(1, b->node);
+  tcmalloc::PageHeap::NodeStats n0 = ph->node_stats(0);
+  tcmalloc::PageHeap::NodeStats n1 = ph->node_stats(1);
+  EXPECT_GT(n0.system_bytes, 0);
+  EXPECT_GT(n1.system_bytes, 0);
+  EXPECT_EQ(ph->stats().system_bytes, n0.system_bytes + n1.system_bytes);
+  EXPECT_EQ(ph->stats().free_bytes, n0.free_bytes + n1.free_bytes);
+
+  // Splits and carved leftovers stay on their node, and freed spans
+  // are not coalesced with the other node's.
+  tcmalloc::Span* b2 = ph->New(4, 1);
+  EXPECT_EQ(1, b2->node);
+  tcmalloc::Span* b3 = ph->Split(b2, 2);
+  EXPECT_EQ(1, b3->node);
+  const uint64_t n1_system = ph->node_stats(1).system_bytes;
+  ph->Delete(a);
+  ph->Delete(b);
+  ph->Delete(b2);
+  ph->Delete(b3);
+  EXPECT_EQ(n1_system, ph->node_stats(1).system_bytes);
+  for (int node = 0; node < 2; node++) {
+    tcmalloc::PageHeap::NodeStats n = ph->node_stats(node);
+    EXPECT_EQ(n.system_bytes, n.free_bytes + n.unmapped_bytes);
+  }
+  EXPECT_TRUE(ph->CheckExpensive());
+
+  // Released memory is accounted to its node.
+  if (HaveSystemRelease) {
+    ph->ReleaseAtLeastNPages(kMaxValidPages);
+    EXPECT_EQ(0, ph->node_stats(0).free_bytes);
+    EXPECT_EQ(0, ph->node_stats(1).free_bytes);
+    EXPECT_EQ(ph->node_stats(1).system_bytes,
+              ph->node_stats(1).unmapped_bytes);
+  }
+  EXPECT_TRUE(ph->CheckExpensive());
+
+  delete ph;
+}
+
+static void TestPageHeap_SizeClassRegions() {
+  tcmalloc::PageHeap* ph = new tcmalloc::PageHeap();
+  if (!ph->SetSizeClassRegions(true)) {
+    // No room for the regions on this platform.
+    delete ph;
+    return;
+  }
+  EXPECT_TRUE(ph->GetSizeClassRegions());
+  // Only release memory when asked to.
+  ph->SetBackgroundRelease(true);
+
+  // Spans of a class come from its region, which tells their class.
+  // The smallest classes all take spans of a single page.
+  const uint32 kClasses[] = {1, 2, 3};
+  tcmalloc::Span* spans[3];
+  uint64_t pages = 0;
+  for (int i = 0; i < 3; i++) {
+    const uint32 cl = kClasses[i];
+    const Length n = 1;
+    spans[i] = ph->NewForSizeClass(n, cl);
+    CHECK(spans[i] != NULL);
+    EXPECT_EQ(n, spans[i]->length);
+    EXPECT_EQ(cl, spans[i]->sizeclass);
+    EXPECT_TRUE(ph->InSizeClassRegion(spans[i]->start));
+    uint32 found;
+    EXPECT_TRUE(ph->TryGetSizeClass(spans[i]->start + n - 1, &found));
+    EXPECT_EQ(cl, found);
+    pages += n;
+  }
+  CheckStats(ph, pages, 0, 0);
+
+  // Freed spans stay in their region, and are handed out again.
+  const PageID start = spans[0]->start;
+  ph->Delete(spans[0]);
+  CheckStats(ph, pages, spans[0]->length, 0);
+  EXPECT_TRUE(ph->CheckExpensive());
+  spans[0] = ph->NewForSizeClass(spans[0]->length, kClasses[0]);
+  EXPECT_EQ(start, spans[0]->start);
+  CheckStats(ph, pages, 0, 0);
+
+  // Free region spans are released like any others.
+  for (int i = 0; i < 3; i++) {
+    ph->Delete(spans[i]);
+  }
+  ph->ReleaseAtLeastNPages(kMaxValidPages);
+  CheckStats(ph, pages, 0, pages);
+  EXPECT_TRUE(ph->CheckExpensive());
+  spans[0] = ph->NewForSizeClass(spans[0]->length, kClasses[0]);
+  EXPECT_EQ(start, spans[0]->start);
+  ph->Delete(spans[0]);
+
+  // Ordinary spans never come from the regions.
+  tcmalloc::Span* other = ph->New(1);
+  EXPECT_FALSE(ph->InSizeClassRegion(other->start));
+  ph->Delete(other);
+  EXPECT_TRUE(ph->CheckExpensive());
+
+  delete ph;
+}
+
+// Checks a SpanSet against a std::set through random inserts and
+// erases, enough of them to grow and shrink the tree by a few levels.
+static void TestSpanSet_Random() {
+  typedef std::set<std::pair<Length, PageID> > Reference;
+  static const int kSpans = 20000;
+  tcmalloc::Span* spans = new tcmalloc::Span[kSpans];
+  bool* present = new bool[kSpans];
+  for (int i = 0; i < kSpans; i++) {
+    spans[i].start = 1 + i;
+    // Few distinct lengths, so many spans compare by address.
+    spans[i].length = kMaxPages + 1 + rand() % 64;
+    present[i] = false;
+  }
+
+  tcmalloc::SpanSet set;
+  Reference reference;
+  srand(1);
+  for (int round = 0; round < 4; round++) {
+    // Fill up to about 3/4 of the spans, then drain to about 1/4.
+    const size_t target = round % 2 == 0 ? kSpans * 3 / 4 : kSpans / 4;
+    while (reference.size() != target) {
+      int i = rand() % kSpans;
+      if (rand() % 2 == 0 && reference.size() > target) {
+        // The page heap mostly erases what BestFit just found.
+        tcmalloc::Span* s = set.BestFit(kMaxPages + 1 + rand() % 64);
+        if (s != NULL) i = s - spans;
+      }
+      const std::pair<Length, PageID> key(spans[i].length, spans[i].start);
+      if (present[i] && reference.size() > target) {
+        set.erase(&spans[i]);
+        reference.erase(key);
+        present[i] = false;
+      } else if (!present[i] && reference.size() < target) {
+        set.insert(&spans[i]);
+        reference.insert(key);
+        present[i] = true;
+      }
+    }
+    EXPECT_EQ(reference.size(), set.size());
+
+    // Same order both ways.
+    tcmalloc::SpanSet::iterator it = set.begin();
+    for (Reference::iterator r = reference.begin(); r != reference.end();
+         ++r, ++it) {
+      CHECK(it != set.end());
+      EXPECT_EQ(r->first, it->length);
+      EXPECT_EQ(r->second, it->start);
+      EXPECT_EQ(r->second, it->span->start);
+    }
+    CHECK(it == set.end());
+    for (Reference::reverse_iterator r = reference.rbegin();
+         r != reference.rend(); ++r) {
+      --it;
+      EXPECT_EQ(r->second, it->start);
+    }
+    CHECK(it == set.begin());
+
+    // Best fit is the first span at least as long, by address.
+    for (Length n = kMaxPages; n <= kMaxPages + 66; n++) {
+      Reference::iterator r =
+          reference.lower_bound(std::make_pair(n, PageID(0)));
+      tcmalloc::Span* s = set.BestFit(n);
+      if (r == reference.end()) {
+        EXPECT_TRUE(s == NULL);
+      } else {
+        CHECK(s != NULL);
+        EXPECT_EQ(r->second, s->start);
+      }
+    }
+  }
+
+  for (int i = 0; i < kSpans; i++) {
+    if (present[i]) set.erase(&spans[i]);
+  }
+  EXPECT_TRUE(set.empty());
+  EXPECT_TRUE(set.begin() == set.end());
+  EXPECT_TRUE(set.BestFit(1) == NULL);
+  delete[] present;
+  delete[] spans;
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {
   TestPageHeap_Stats();
+  TestPageHeap_IdleRelease();
+  TestPageHeap_BatchRelease();
+  TestPageHeap_GrowOutsideLock();
+  TestPageHeap_HugePages();
+  TestPageHeap_NumaNodes();
+  TestPageHeap_SizeClassRegions();
+  TestSpanSet_Random();
   TestPageHeap_Limit();
   printf("PASS\n");
   // on windows as part of library destructors we call getenv which
@@ -161,6 +161,44 @@ void TestNext(const char* name) {
   CHECK(map.Next(103) == NULL);
 }
 
+#if defined(HAVE_MMAP) && defined(__LP64__)
+// Checks that a flat map commits only the parts of its array that
+// are ensured, with a reservation as big as the one tcmalloc uses.
+void TestFlatCommit() {
+  RAW_LOG(ERROR, "Running FlatCommitTest\n");
+  typedef TCMalloc_PageMapFlat<35> Map;
+  static Map map(malloc);
+  const size_t chunk_bytes = sizeof(void*) << 15;
+  CHECK_EQ(map.committed_bytes(), 0);
+  CHECK(map.get(12345) == NULL);
+  CHECK(map.get(uintptr_t(1) << 34) == NULL);
+  CHECK(map.Next(0) == NULL);
+
+  int a, b;
+  const uintptr_t far = (uintptr_t(1) << 34) + 7;
+  CHECK(map.Ensure(far, 1));
+  CHECK_EQ(map.committed_bytes(), chunk_bytes);
+  map.set(far, &a);
+  CHECK(map.get(far) == &a);
+  CHECK(map.get(far - 1) == NULL);
+  CHECK(map.Next(0) == &a);
+  CHECK(map.Next(far + 1) == NULL);
+
+  // Ensuring again commits nothing more; crossing into the next chunk
+  // commits just that one.
+  CHECK(map.Ensure(far, 2));
+  CHECK_EQ(map.committed_bytes(), chunk_bytes);
+  const uintptr_t next_chunk = (far | ((1 << 15) - 1)) + 1;
+  CHECK(map.Ensure(next_chunk - 1, 2));
+  CHECK_EQ(map.committed_bytes(), 2 * chunk_bytes);
+  map.set(next_chunk, &b);
+  CHECK(map.Next(far + 1) == &b);
+
+  CHECK(!map.Ensure((uintptr_t(1) << 35) - 1, 2));
+  CHECK(map.get(uintptr_t(1) << 35) == NULL);
+}
+#endif
+
 int main(int argc, char** argv) {
   TestMap< TCMalloc_PageMap1<10> > (100, true);
   TestMap< TCMalloc_PageMap1<10> > (1 << 10, false);
@@ -168,10 +206,20 @@ int main(int argc, char** argv) {
   TestMap< TCMalloc_PageMap2<20> > (1 << 20, false);
   TestMap< TCMalloc_PageMap3<20> > (100, true);
   TestMap< TCMalloc_PageMap3<20> > (1 << 20, false);
+#ifdef HAVE_MMAP
+  TestMap< TCMalloc_PageMapFlat<20> > (100, true);
+  TestMap< TCMalloc_PageMapFlat<20> > (1 << 20, false);
+#endif
 
   TestNext< TCMalloc_PageMap1<10> >("PageMap1");
   TestNext< TCMalloc_PageMap2<10> >("PageMap2");
   TestNext< TCMalloc_PageMap3<10> >("PageMap3");
+#ifdef HAVE_MMAP
+  TestNext< TCMalloc_PageMapFlat<10> >("PageMapFlat");
+#endif
+#if defined(HAVE_MMAP) && defined(__LP64__)
+  TestFlatCommit();
+#endif
 
   printf("PASS\n");
   return 0;
@@ -82,9 +82,15 @@
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>        // defines pvalloc/etc on cygwin
 #endif
+#if defined(HAVE_FORK) && defined(HAVE_PTHREAD)
+#include <pthread.h>       // for the fork-during-growth test
+#include <signal.h>        // for kill
+#include <sys/wait.h>      // for waitpid
+#endif
 #include <assert.h>
 #include <vector>
 #include <algorithm>
+#include <set>
 #include <string>
 #include <new>
 #include "base/logging.h"
@@ -177,17 +183,26 @@ using std::vector;
 using std::string;
 
 DECLARE_double(tcmalloc_release_rate);
+DECLARE_int64(tcmalloc_release_half_life_ms);
 DECLARE_int32(max_free_queue_size);     // in debugallocation.cc
 DECLARE_int64(tcmalloc_sample_parameter);
 
 struct OOMAbleSysAlloc : public SysAllocator {
   SysAllocator *child;
   int simulate_oom;
+  // When set, every allocation takes a while, and in_alloc tells when
+  // one has started.
+  volatile int simulate_slow;
+  volatile int in_alloc;
 
   void* Alloc(size_t size, size_t* actual_size, size_t alignment) {
     if (simulate_oom) {
       return NULL;
     }
+    if (simulate_slow) {
+      in_alloc = true;
+      usleep(100 * 1000);
+    }
     return child->Alloc(size, actual_size, alignment);
   }
 };
@@ -916,6 +931,21 @@ static void TestRanges() {
 }
 
 #ifndef DEBUGALLOCATION
+static size_t GetPropertyOrZero(const char* name) {
+  size_t value = 0;
+  MallocExtension::instance()->GetNumericProperty(name, &value);
+  return value;
+}
+
+// True if memory is released in a way the exact accounting below
+// cannot predict.
+static bool HasOwnReleasePolicy() {
+  return GetPropertyOrZero("tcmalloc.hugepage_aware") != 0 ||
+         GetPropertyOrZero("tcmalloc.background_release") != 0 ||
+         GetPropertyOrZero("tcmalloc.span_bitmaps") != 0 ||
+         GetPropertyOrZero("tcmalloc.large_span_cache_budget") != 0;
+}
+
 static size_t GetUnmappedBytes() {
   size_t bytes;
   CHECK(MallocExtension::instance()->GetNumericProperty(
@@ -949,6 +979,9 @@ static void TestReleaseToSystem() {
 
   if(!HaveSystemRelease) return;
 
+  // Memory is released in whole hugepages only, or behind our back.
+  if (HasOwnReleasePolicy()) return;
+
   const double old_tcmalloc_release_rate = FLAGS_tcmalloc_release_rate;
   FLAGS_tcmalloc_release_rate = 0;
 
@@ -1012,6 +1045,9 @@ static void TestAggressiveDecommit() {
 
   if(!HaveSystemRelease) return;
 
+  // Aggressive decommit is ignored in these modes.
+  if (HasOwnReleasePolicy()) return;
+
   fprintf(LOGSTREAM, "Testing aggressive de-commit\n");
 
   AggressiveDecommitChanger enabler(1);
@@ -1049,6 +1085,365 @@ static void TestAggressiveDecommit() {
 #endif   // #ifndef DEBUGALLOCATION
 }
 
+static void TestBackgroundRelease() {
+#if !defined(DEBUGALLOCATION) && defined(HAVE_PTHREAD)
+  if(!HaveSystemRelease) return;
+
+  // A free 1MB span need not cover a whole hugepage.
+  if (GetPropertyOrZero("tcmalloc.hugepage_aware") != 0) return;
+  // Nor does it go back to the page heap while it is in the large span
+  // cache.
+  if (GetPropertyOrZero("tcmalloc.large_span_cache_budget") != 0) return;
+
+  fprintf(LOGSTREAM, "Testing background release\n");
+
+  MallocExtension* inst = MallocExtension::instance();
+  const size_t old_value = GetPropertyOrZero("tcmalloc.background_release");
+  const int64 old_half_life = FLAGS_tcmalloc_release_half_life_ms;
+  FLAGS_tcmalloc_release_half_life_ms = 0;  // release all idle memory
+  CHECK(inst->SetNumericProperty("tcmalloc.background_release", 1));
+  EXPECT_EQ(1, GetPropertyOrZero("tcmalloc.background_release"));
+
+  static const int MB = 1048576;
+  void* volatile a = malloc(MB);
+  size_t starting_bytes = GetUnmappedBytes();
+  free(a);
+
+  // The freed span goes back to the system once it has been idle for
+  // a while.
+  for (int i = 0; i < 100 && GetUnmappedBytes() < starting_bytes + MB; i++) {
+    usleep(100000);
+  }
+  EXPECT_GE(GetUnmappedBytes(), starting_bytes + MB);
+
+  CHECK(inst->SetNumericProperty("tcmalloc.background_release", old_value));
+  FLAGS_tcmalloc_release_half_life_ms = old_half_life;
+#endif
+}
+
+static void TestSpanBitmaps() {
+#ifndef DEBUGALLOCATION
+  if (!HaveSystemRelease) return;
+  if (GetPropertyOrZero("tcmalloc.span_bitmaps") == 0) return;
+
+  fprintf(LOGSTREAM, "Testing span bitmaps\n");
+
+  // Leave one object of every 16 alive, so most spans of this class
+  // (which have several pages) stay in use with free pages in them.
+  static const int kObjects = 4096;
+  static const size_t kSize = 2048;
+  char** objects = new char*[kObjects];
+  for (int i = 0; i < kObjects; i++) {
+    objects[i] = static_cast<char*>(malloc(kSize));
+    memset(objects[i], i, kSize);
+  }
+  for (int i = 0; i < kObjects; i++) {
+    if (i % 16 != 0) {
+      free(objects[i]);
+      objects[i] = NULL;
+    }
+  }
+  MallocExtension::instance()->MarkThreadIdle();
+  MallocExtension::instance()->ReleaseFreeMemory();
+  EXPECT_GT(GetPropertyOrZero("tcmalloc.central_cache_released_bytes"), 0);
+
+  // The objects left alive are intact, and the released pages can be
+  // used again.
+  for (int i = 0; i < kObjects; i++) {
+    if (objects[i] != NULL) {
+      for (size_t j = 0; j < kSize; j++) {
+        CHECK_EQ(objects[i][j], static_cast<char>(i));
+      }
+    } else {
+      objects[i] = static_cast<char*>(malloc(kSize));
+      memset(objects[i], i, kSize);
+    }
+  }
+  for (int i = 0; i < kObjects; i++) {
+    free(objects[i]);
+  }
+  delete[] objects;
+#endif
+}
+
+static void TestLargeSpanCache() {
+#ifndef DEBUGALLOCATION
+  if (GetPropertyOrZero("tcmalloc.large_span_cache_budget") <
+      (8 << 20)) {
+    return;
+  }
+
+  fprintf(LOGSTREAM, "Testing large span cache\n");
+
+  MallocExtension::instance()->ReleaseFreeMemory();
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_bytes"), 0);
+
+  static const size_t kSize = 4 << 20;
+  const size_t hits = GetPropertyOrZero("tcmalloc.large_span_cache_hits");
+  const size_t misses =
+      GetPropertyOrZero("tcmalloc.large_span_cache_misses");
+  char* a = static_cast<char*>(malloc(kSize));
+  memset(a, 1, kSize);
+  free(a);
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_bytes"), kSize);
+
+  // The same number of pages is served from the cache, a different one
+  // is not.
+  char* b = static_cast<char*>(malloc(kSize));
+  CHECK_EQ(a, b);
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_bytes"), 0);
+  char* c = static_cast<char*>(malloc(kSize + 65536));
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_hits"), hits + 1);
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_misses"),
+           misses + 2);
+  memset(b, 2, kSize);
+  memset(c, 3, kSize + 65536);
+  free(b);
+  free(c);
+
+  // The cache gives its spans back to the page heap on request.
+  MallocExtension::instance()->ReleaseFreeMemory();
+  CHECK_EQ(GetPropertyOrZero("tcmalloc.large_span_cache_bytes"), 0);
+#endif
+}
+
+// Growing a large block keeps its contents, whether its span grows in
+// place or its pages are moved.
+static void TestLargeRealloc() {
+#ifndef DEBUGALLOCATION
+  fprintf(LOGSTREAM, "Testing realloc of large blocks\n");
+  const int64 old_sample_parameter = FLAGS_tcmalloc_sample_parameter;
+  FLAGS_tcmalloc_sample_parameter = 0;   // sampled blocks are copied
+
+  static const size_t kSize = 8 << 20;
+  char* a = static_cast<char*>(malloc(kSize));
+  char* volatile blocker = static_cast<char*>(malloc(kSize));
+  for (size_t i = 0; i < kSize; i += 4096) {
+    a[i] = static_cast<char>(i >> 12);
+  }
+  a[kSize - 1] = 'z';
+  a = static_cast<char*>(realloc(a, 3 * kSize));
+  CHECK(a != NULL);
+  for (size_t i = 0; i < kSize; i += 4096) {
+    CHECK_EQ(a[i], static_cast<char>(i >> 12));
+  }
+  CHECK_EQ(a[kSize - 1], 'z');
+  memset(a + kSize, 1, 2 * kSize);
+  free(blocker);
+
+  // With the pages after the block free, it grows where it is.
+  char* b = static_cast<char*>(malloc(kSize));
+  char* c = static_cast<char*>(malloc(kSize));
+  if (c < b) std::swap(b, c);
+  const bool adjacent = (c == b + kSize);
+  memset(b, 2, kSize);
+  free(c);
+  char* d = static_cast<char*>(realloc(b, kSize + kSize / 2));
+  CHECK(d != NULL);
+  if (adjacent &&
+      GetPropertyOrZero("tcmalloc.large_span_cache_budget") == 0) {
+    CHECK_EQ(d, b);
+  }
+  for (size_t i = 0; i < kSize; i++) {
+    CHECK_EQ(d[i], 2);
+  }
+  memset(d + kSize, 3, kSize / 2);
+  free(d);
+  free(a);
+
+  FLAGS_tcmalloc_sample_parameter = old_sample_parameter;
+#endif
+}
+
+static void TestTryExpand() {
+#ifndef DEBUGALLOCATION
+  fprintf(LOGSTREAM, "Testing tc_try_expand\n");
+  const int64 old_sample_parameter = FLAGS_tcmalloc_sample_parameter;
+  FLAGS_tcmalloc_sample_parameter = 0;   // sampled blocks keep their pages
+
+  // A small block can take any size of its class, but not move to a
+  // smaller class, since it would then be freed as one.
+  void* p = malloc(100);
+  const size_t usable = nallocx(100, 0);
+  CHECK_EQ(tc_try_expand(p, usable), 1);
+  CHECK_EQ(tc_try_expand(p, usable + 1), 0);
+  CHECK_LT(nallocx(1, 0), usable);
+  CHECK_EQ(tc_try_expand(p, 1), 0);
+  CHECK_EQ(tc_try_expand(p, 100), 1);
+  CHECK_EQ(MallocExtension::instance()->GetAllocatedSize(p), usable);
+  if (GetPropertyOrZero("tcmalloc.size_class_regions")) {
+    // Pages of the 4 GiB region of the class that have not been handed
+    // out yet hold no block.
+    CHECK_EQ(tc_try_expand(static_cast<char*>(p) + (1 << 30), 1), 0);
+  }
+  // Freeing with the size it was resized to keeps the block in its class.
+  CHECK_EQ(tc_try_expand(p, usable), 1);
+  tc_free_sized(p, usable);
+  void* q = malloc(1);
+  CHECK(q != p);
+  CHECK_EQ(MallocExtension::instance()->GetAllocatedSize(q), nallocx(1, 0));
+  free(q);
+
+  // A large block grows into the free pages after it, and gives back
+  // the pages it no longer needs.
+  static const size_t kSize = 4 << 20;
+  MallocExtension* inst = MallocExtension::instance();
+  char* a = static_cast<char*>(malloc(kSize));
+  char* b = static_cast<char*>(malloc(kSize));
+  if (b < a) std::swap(a, b);
+  const bool adjacent = (b == a + kSize);
+  memset(a, 1, kSize);
+  free(b);
+  if (adjacent &&
+      GetPropertyOrZero("tcmalloc.large_span_cache_budget") == 0) {
+    CHECK(inst->TryResize(a, 2 * kSize));
+    CHECK_GE(inst->GetAllocatedSize(a), 2 * kSize);
+    memset(a + kSize, 2, kSize);
+  }
+  CHECK_EQ(tc_try_expand(a, kSize / 4), 1);
+  CHECK_EQ(inst->GetAllocatedSize(a), kSize / 4);
+  for (size_t i = 0; i < kSize / 4; i++) {
+    CHECK_EQ(a[i], 1);
+  }
+  // It does not shrink into a size class.
+  CHECK_EQ(tc_try_expand(a, 100), 0);
+  CHECK_EQ(inst->GetAllocatedSize(a), kSize / 4);
+  char* c = static_cast<char*>(malloc(kSize));
+  memset(c, 3, kSize);
+  tc_free_sized(a, kSize / 4);
+  free(c);
+
+  FLAGS_tcmalloc_sample_parameter = old_sample_parameter;
+#endif
+}
+
+// ReleaseFreeMemory must also return what sits in the per-CPU caches.
+static void TestCpuCacheDrain() {
+#ifndef DEBUGALLOCATION
+  static const int kObjects = 1000;
+  void* objects[kObjects];
+  for (int i = 0; i < kObjects; i++) {
+    objects[i] = malloc(64);
+  }
+  for (int i = 0; i < kObjects; i++) {
+    free(objects[i]);
+  }
+  const size_t cached = GetPropertyOrZero("tcmalloc.cpu_cache_free_bytes");
+  if (cached == 0) return;  // Per-CPU caches are off.
+
+  fprintf(LOGSTREAM, "Testing draining of per-CPU caches\n");
+  MallocExtension::instance()->ReleaseFreeMemory();
+  EXPECT_LT(GetPropertyOrZero("tcmalloc.cpu_cache_free_bytes"), cached);
+#endif
+}
+
+// calloc skips clearing large blocks whose pages are known to be
+// zero; make sure the ones it gets are.
+static void TestLargeCalloc() {
+#ifndef DEBUGALLOCATION
+  fprintf(LOGSTREAM, "Testing calloc of large blocks\n");
+  static const size_t kSizes[] = { 300 << 10, 2 << 20, 9 << 20 };
+  for (int release = 0; release < 2; release++) {
+    for (size_t i = 0; i < arraysize(kSizes); i++) {
+      const size_t size = kSizes[i];
+      char* p = static_cast<char*>(malloc(size));
+      memset(p, 0x5a, size);
+      free(p);
+      if (release) {
+        MallocExtension::instance()->ReleaseFreeMemory();
+      }
+      char* q = static_cast<char*>(calloc(1, size));
+      for (size_t j = 0; j < size; j++) {
+        CHECK_EQ(q[j], 0);
+      }
+      memset(q, 0xa5, size);
+      free(q);
+    }
+  }
+#endif
+}
+
+static void TestReleaseReuse() {
+#ifndef DEBUGALLOCATION
+  fprintf(LOGSTREAM, "Testing reuse of released memory\n");
+  MallocExtension* inst = MallocExtension::instance();
+  static const size_t kSize = 4 << 20;
+
+  // Memory allocated again right after its release is reused quickly,
+  // which makes free spans wait longer before they are released.
+  const size_t reuses = GetPropertyOrZero("tcmalloc.pageheap_reuse_count");
+  const size_t quick = GetPropertyOrZero("tcmalloc.pageheap_quick_reuse_count");
+  void* p = malloc(kSize);
+  free(p);
+  inst->ReleaseFreeMemory();
+  p = malloc(kSize);
+  EXPECT_GT(GetPropertyOrZero("tcmalloc.pageheap_reuse_count"), reuses);
+  EXPECT_GT(GetPropertyOrZero("tcmalloc.pageheap_quick_reuse_count"), quick);
+  if (!GetPropertyOrZero("tcmalloc.background_release")) {
+    // The background thread may already have lowered it again.
+    EXPECT_GE(GetPropertyOrZero("tcmalloc.release_delay_ticks"), 1);
+  }
+  free(p);
+
+  // Pages released with MADV_FREE keep their contents, which calloc()
+  // must not hand out.  Allocate until the old pages come back.
+  const size_t madv_free = GetPropertyOrZero("tcmalloc.release_madv_free");
+  if (inst->SetNumericProperty("tcmalloc.release_madv_free", 1)) {
+    char* q = static_cast<char*>(malloc(kSize));
+    memset(q, 0x5a, kSize);
+    const uintptr_t old_start = reinterpret_cast<uintptr_t>(q);
+    free(q);
+    inst->ReleaseFreeMemory();
+    vector<char*> blocks;
+    bool overlaps = false;
+    for (int i = 0; i < 16 && !overlaps; i++) {
+      char* r = static_cast<char*>(calloc(1, kSize));
+      for (size_t j = 0; j < kSize; j++) {
+        CHECK_EQ(r[j], 0);
+      }
+      const uintptr_t start = reinterpret_cast<uintptr_t>(r);
+      overlaps = start < old_start + kSize && old_start < start + kSize;
+      blocks.push_back(r);
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+      free(blocks[i]);
+    }
+    CHECK(inst->SetNumericProperty("tcmalloc.release_madv_free", madv_free));
+  }
+#endif
+}
+
+static void TestNumaNodeProperties() {
+#ifndef DEBUGALLOCATION
+  const size_t nodes = GetPropertyOrZero("tcmalloc.numa_nodes");
+  EXPECT_GE(nodes, 1);
+  if (nodes == 1) return;
+
+  fprintf(LOGSTREAM, "Testing %d NUMA nodes\n", int(nodes));
+
+  // Allocations on every node account for the whole heap.
+  void* volatile a = malloc(1 << 20);
+  MallocExtension* inst = MallocExtension::instance();
+  size_t heap_size = 0;
+  CHECK(inst->GetNumericProperty("generic.heap_size", &heap_size));
+  size_t system_bytes = 0;
+  for (size_t n = 0; n < nodes; n++) {
+    char name[64];
+    snprintf(name, sizeof(name), "tcmalloc.numa_node%d_system_bytes", int(n));
+    size_t value;
+    CHECK(inst->GetNumericProperty(name, &value));
+    system_bytes += value;
+  }
+  EXPECT_EQ(heap_size, system_bytes);
+
+  char name[64];
+  size_t value;
+  snprintf(name, sizeof(name), "tcmalloc.numa_node%d_free_bytes", int(nodes));
+  EXPECT_FALSE(inst->GetNumericProperty(name, &value));
+  free(a);
+#endif
+}
+
 // On MSVC10, in release mode, the optimizer convinces itself
 // g_no_memory is never changed (I guess it doesn't realize OnNoMemory
 // might be called).  Work around this by setting the var volatile.
@@ -1102,6 +1497,81 @@ static void TestSetNewMode() {
   tc_set_new_mode(old_mode);
 }
 
+static void TestBatch() {
+  fprintf(LOGSTREAM, "Testing batch allocation\n");
+  static const size_t kSizes[] = {8, 100, 4000, 200000};
+  static const size_t kCounts[] = {1, 16, 300};
+  void* ptrs[2 * 300 + 2];
+  for (size_t s = 0; s < arraysize(kSizes); s++) {
+    for (size_t c = 0; c < arraysize(kCounts); c++) {
+      const size_t size = kSizes[s];
+      const size_t n = kCounts[c];
+      CHECK_EQ(n, tc_malloc_batch(size, n, ptrs));
+      CHECK_EQ(n, MallocExtension::instance()->MallocBatch(size, n, ptrs + n));
+      std::set<void*> distinct(ptrs, ptrs + 2 * n);
+      CHECK_EQ(2 * n, distinct.size());
+      for (size_t i = 0; i < 2 * n; i++) {
+        CHECK_GE(MallocExtension::instance()->GetAllocatedSize(ptrs[i]), size);
+        memset(ptrs[i], i, size);
+      }
+      // Batches to free may mix sizes and hold NULL.
+      ptrs[2 * n] = NULL;
+      ptrs[2 * n + 1] = malloc(size + 1);
+      std::swap(ptrs[0], ptrs[2 * n + 1]);
+      tc_free_batch(ptrs, n + 1);
+      MallocExtension::instance()->FreeBatch(ptrs + n + 1, n + 1);
+    }
+  }
+
+#ifndef DEBUGALLOCATION
+  // Size class regions do not get their memory from the system
+  // allocator, so simulate_oom does not limit them.
+  if (GetPropertyOrZero("tcmalloc.size_class_regions") == 0) {
+    // More than the address space the test may use.
+    static const size_t kOOMSize = 200000;
+    static const size_t kOOMCount = 8192;
+    static void* oom_ptrs[kOOMCount];
+    get_test_sys_alloc()->simulate_oom = true;
+    errno = 0;
+    const size_t count = tc_malloc_batch(kOOMSize, kOOMCount, oom_ptrs);
+    get_test_sys_alloc()->simulate_oom = false;
+    CHECK_LT(count, kOOMCount);
+    CHECK_EQ(errno, ENOMEM);
+    tc_free_batch(oom_ptrs, count);
+  }
+#endif
+}
+
+struct FixedSizeObject : public tc::FixedSizeAllocated {
+  char data[40];
+};
+
+static void TestFixedSize() {
+  fprintf(LOGSTREAM, "Testing fixed size allocation\n");
+  void* p = tc::allocate<24>();
+  CHECK(p != NULL);
+  CHECK_GE(MallocExtension::instance()->GetAllocatedSize(p), 24);
+  memset(p, 0, 24);
+  tc::deallocate<24>(p);
+
+  p = tc::allocate<100000>();
+  CHECK(p != NULL);
+  CHECK_GE(MallocExtension::instance()->GetAllocatedSize(p), 100000);
+  tc::deallocate<100000>(p);
+
+  SetNewHook();
+  FixedSizeObject* object = new FixedSizeObject;
+  VerifyNewHookWasCalled();
+  CHECK_GE(MallocExtension::instance()->GetAllocatedSize(object),
+           sizeof(FixedSizeObject));
+  memset(object->data, 0, sizeof(object->data));
+  SetDeleteHook();
+  delete object;
+  VerifyDeleteHookWasCalled();
+  ResetNewHook();
+  ResetDeleteHook();
+}
+
 static void TestErrno(void) {
   void* ret;
   if (kOSSupportsMemalign) {
@@ -1122,6 +1592,24 @@ static void TestErrno(void) {
   EXPECT_EQ(ENOMEM, errno);
 }
 
+// The size-returning functions report what GetAllocatedSize would.
+static void TestSizeReturning() {
+  for (size_t size = 0; size <= (1 << 20); size += 7) {
+    size_t actual = 0;
+    void* ptr = tc_malloc_size_returning(size, &actual);
+    ASSERT_GE(actual, size);
+    ASSERT_EQ(actual, MallocExtension::instance()->GetAllocatedSize(ptr));
+    memset(ptr, 1, actual);
+    tc_free_sized(ptr, actual);
+
+    actual = 0;
+    ptr = tc_new_size_returning(size, &actual);
+    ASSERT_GE(actual, size);
+    ASSERT_EQ(actual, MallocExtension::instance()->GetAllocatedSize(ptr));
+    tc_delete_sized(ptr, size);
+  }
+}
+
 
 #ifndef DEBUGALLOCATION
 // Ensure that nallocx works before main.
@@ -1175,13 +1663,18 @@ static ATTRIBUTE_NOINLINE void TestNewOOMHandling() {
   // internal allocation fails. So don't test it.
   setup_oomable_sys_alloc();
 
+  // Size class regions do not get their memory from the system
+  // allocator, so use objects too large for a size class with them.
+  const size_t size =
+      GetPropertyOrZero("tcmalloc.size_class_regions") ? (1 << 20) : 512;
+
   std::new_handler old = std::set_new_handler(test_new_handler);
   get_test_sys_alloc()->simulate_oom = true;
 
   ASSERT_EQ(saw_new_handler_runs, 0);
 
   for (int i = 0; i < 10240; i++) {
-    oom_test_last_ptr = new char [512];
+    oom_test_last_ptr = new char [size];
     ASSERT_NE(oom_test_last_ptr, NULL);
     if (saw_new_handler_runs) {
       break;
@@ -1193,6 +1686,55 @@ static ATTRIBUTE_NOINLINE void TestNewOOMHandling() {
   get_test_sys_alloc()->simulate_oom = false;
   std::set_new_handler(old);
 }
+
+#if defined(HAVE_FORK) && defined(HAVE_PTHREAD)
+static const size_t kForkGrowthSize = 64 << 20;
+
+static void* GrowHeapThread(void*) {
+  free(malloc(kForkGrowthSize));
+  return NULL;
+}
+
+// The page heap lets go of its lock while it takes memory from the
+// system.  A fork() in the meantime must not leave the child with the
+// system allocator's lock held by a thread that is gone.
+static void TestForkDuringGrowth() {
+  fprintf(LOGSTREAM, "Testing fork during heap growth\n");
+  OOMAbleSysAlloc* sys_alloc = get_test_sys_alloc();
+  sys_alloc->in_alloc = false;
+  sys_alloc->simulate_slow = true;
+
+  pthread_t thread;
+  CHECK_EQ(pthread_create(&thread, NULL, GrowHeapThread, NULL), 0);
+  while (!sys_alloc->in_alloc) {
+    usleep(1000);
+  }
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    // Growing the heap again takes the system allocator's lock.
+    void* p = malloc(kForkGrowthSize);
+    _exit(p == NULL ? 1 : 0);
+  }
+
+  int status = 0;
+  int waited_ms = 0;
+  while (waitpid(pid, &status, WNOHANG) == 0 && waited_ms < 10000) {
+    usleep(10 * 1000);
+    waited_ms += 10;
+  }
+  if (waited_ms >= 10000) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+  }
+  CHECK_LT(waited_ms, 10000);  // Otherwise the child deadlocked.
+  CHECK(WIFEXITED(status));
+  CHECK_EQ(WEXITSTATUS(status), 0);
+
+  CHECK_EQ(pthread_join(thread, NULL), 0);
+  sys_alloc->simulate_slow = false;
+}
+#endif  // HAVE_FORK && HAVE_PTHREAD
 #endif  // !DEBUGALLOCATION
 
 static int RunAllTests(int argc, char** argv) {
@@ -1203,6 +1745,9 @@ static int RunAllTests(int argc, char** argv) {
 
 #ifndef DEBUGALLOCATION
   TestNewOOMHandling();
+#if defined(HAVE_FORK) && defined(HAVE_PTHREAD)
+  TestForkDuringGrowth();
+#endif
 #endif
 
   // TODO(odo):  This test has been disabled because it is only by luck that it
@@ -1607,14 +2152,26 @@ static int RunAllTests(int argc, char** argv) {
   TestRanges();
   TestReleaseToSystem();
   TestAggressiveDecommit();
+  TestBackgroundRelease();
+  TestSpanBitmaps();
+  TestLargeSpanCache();
+  TestLargeRealloc();
+  TestTryExpand();
+  TestCpuCacheDrain();
+  TestLargeCalloc();
+  TestReleaseReuse();
+  TestNumaNodeProperties();
   TestSetNewMode();
   TestErrno();
+  TestBatch();
+  TestFixedSize();
 
 // GetAllocatedSize under DEBUGALLOCATION returns the size that we asked for.
 #ifndef DEBUGALLOCATION
   TestNAllocX();
   TestNAllocXAlignment();
 #endif
+  TestSizeReturning();
 
   return 0;
 }
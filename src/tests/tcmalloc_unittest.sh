@@ -81,4 +81,76 @@ echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_ENABLE_SIZED_DELETE=t ..."
 
 TCMALLOC_ENABLE_SIZED_DELETE=t run_unittest
 
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_PERCPU_CACHES=t ... "
+
+TCMALLOC_PERCPU_CACHES=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_CENTRAL_FREELIST_SHARDS=4 ... "
+
+TCMALLOC_CENTRAL_FREELIST_SHARDS=4 run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_CENTRAL_FREELIST_SHARDS=4 TCMALLOC_PERCPU_CACHES=t ... "
+
+TCMALLOC_CENTRAL_FREELIST_SHARDS=4 TCMALLOC_PERCPU_CACHES=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_HUGEPAGE_AWARE=t ... "
+
+TCMALLOC_HUGEPAGE_AWARE=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_BACKGROUND_RELEASE=t ... "
+
+TCMALLOC_BACKGROUND_RELEASE=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_PREGROW_WATERMARK_MB=64 ... "
+
+TCMALLOC_PREGROW_WATERMARK_MB=64 run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_NUMA_FAKE_NODES=2 ... "
+
+TCMALLOC_NUMA_FAKE_NODES=2 run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_NUMA_FAKE_NODES=2 TCMALLOC_PERCPU_CACHES=t ... "
+
+TCMALLOC_NUMA_FAKE_NODES=2 TCMALLOC_PERCPU_CACHES=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_SIZE_CLASS_REGIONS=t ... "
+
+TCMALLOC_SIZE_CLASS_REGIONS=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_SPAN_BITMAPS=t ... "
+
+TCMALLOC_SPAN_BITMAPS=t run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_LARGE_SPAN_CACHE_BYTES ... "
+
+# Sampled spans are never cached, so sampling is turned off for the
+# checks of TestLargeSpanCache.
+TCMALLOC_SAMPLE_PARAMETER=0 TCMALLOC_LARGE_SPAN_CACHE_BYTES=67108864 \
+  run_unittest
+
+echo -n "Testing $TCMALLOC_UNITTEST with TCMALLOC_SIZE_CLASSES ... "
+
+# Powers of two, and three more classes around 1 KiB
+( for i in 3 4 5 6 7 8 9; do echo $((1 << i)); done
+  echo "768 1"; echo 1024; echo 1280
+  for i in 11 12 13 14 15 16 17 18; do echo $((1 << i)); done
+) > $TMPDIR/size_classes
+TCMALLOC_SIZE_CLASSES=$TMPDIR/size_classes run_unittest
+if grep -q "Ignoring TCMALLOC_SIZE_CLASSES" $TMPDIR/output; then
+  echo "The size classes file was not loaded"
+  exit 5
+fi
+
+echo -n "Testing $TCMALLOC_UNITTEST with too many objects per span ... "
+
+# 128 pages of 8-byte objects are more than the 16-bit refcount of a
+# span can count (or more than kMaxPages with larger pages); the
+# default classes are used instead.
+( echo "8 128"; sed 1d $TMPDIR/size_classes ) > $TMPDIR/size_classes_bad
+TCMALLOC_SIZE_CLASSES=$TMPDIR/size_classes_bad run_unittest
+if ! grep -q "Ignoring TCMALLOC_SIZE_CLASSES" $TMPDIR/output; then
+  echo "The size classes file was not rejected"
+  exit 5
+fi
+
 echo "PASS"
@@ -63,7 +63,20 @@ void SetTestResourceLimit() {
 
   // Restrict the test to 1GiB, which should fit comfortably well on both
   // 32-bit and 64-bit hosts, and executes in ~1s.
-  const rlim_t kMaxMem = 1<<30;
+#if defined(TCMALLOC_FLAT_PAGEMAP) && defined(__LP64__)
+  // Leave room for the address space the flat pagemap reserves, which
+  // is at most 2^35 entries of 8 bytes, and takes no memory by itself.
+  rlim_t kMaxMem = (rlim_t(1) << 30) + (rlim_t(1) << 38);
+#else
+  rlim_t kMaxMem = 1<<30;
+#endif
+#ifdef __LP64__
+  // The same goes for the address space of size class regions, 4GiB
+  // per size class.
+  if (getenv("TCMALLOC_SIZE_CLASS_REGIONS") != NULL) {
+    kMaxMem += rlim_t(1) << 39;
+  }
+#endif
 
   struct rlimit rlim;
   if (getrlimit(USE_RESOURCE, &rlim) == 0) {
@@ -40,6 +40,7 @@
 #include "base/spinlock.h"              // for SpinLockHolder
 #include "getenv_safe.h"                // for TCMallocGetenvSafe
 #include "central_freelist.h"           // for CentralFreeListPadded
+#include "cpu_cache.h"                  // for CpuCache
 #include "maybe_threads.h"
 
 using std::min;
@@ -67,6 +68,7 @@ ssize_t ThreadCache::unclaimed_cache_space_ = kDefaultOverallThreadCacheSize;
 PageHeapAllocator<ThreadCache> threadcache_allocator;
 ThreadCache* ThreadCache::thread_heaps_ = NULL;
 int ThreadCache::thread_heap_count_ = 0;
+unsigned int ThreadCache::next_central_shard_ = 0;
 ThreadCache* ThreadCache::next_memory_steal_ = NULL;
 #ifdef HAVE_TLS
 __thread ThreadCache::ThreadLocalData ThreadCache::threadlocal_data_
@@ -94,6 +96,7 @@ void ThreadCache::Init(pthread_t tid) {
   prev_ = NULL;
   tid_  = tid;
   in_setspecific_ = false;
+  central_shard_ = next_central_shard_++;
   for (uint32 cl = 0; cl < Static::num_size_classes(); ++cl) {
     list_[cl].Init(Static::sizemap()->class_to_size(cl));
   }
@@ -122,8 +125,9 @@ void* ThreadCache::FetchFromCentralCache(uint32 cl, int32_t byte_size,
 
   const int num_to_move = min<int>(list->max_length(), batch_size);
   void *start, *end;
-  int fetch_count = Static::central_cache()[cl].RemoveRange(
-      &start, &end, num_to_move);
+  CentralFreeList* central = Static::central_freelist(
+      cl, central_shard_, Static::CurrentNumaNode());
+  int fetch_count = central->RemoveRange(&start, &end, num_to_move);
 
   if (fetch_count == 0) {
     ASSERT(start == NULL);
@@ -157,12 +161,71 @@ void* ThreadCache::FetchFromCentralCache(uint32 cl, int32_t byte_size,
   return start;
 }
 
+size_t ThreadCache::AllocateBatch(size_t size, uint32 cl, size_t n,
+                                  void** out) {
+  FreeList* list = &list_[cl];
+  size_t count = 0;
+  while (count < n && list->TryPop(&out[count])) {
+    count++;
+  }
+  size_ -= size * count;
+
+  // Take whole batches from the central cache, which is what its
+  // transfer cache holds, and keep what is left of the last one.
+  const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  CentralFreeList* central = Static::central_freelist(
+      cl, central_shard_, Static::CurrentNumaNode());
+  while (count < n) {
+    void *start, *end;
+    int fetch_count = central->RemoveRange(&start, &end, batch_size);
+    if (fetch_count == 0) {
+      break;
+    }
+    for (; fetch_count > 0 && count < n; fetch_count--) {
+      out[count++] = start;
+      start = SLL_Next(start);
+    }
+    if (fetch_count > 0) {
+      size_ += size * fetch_count;
+      list->PushRange(fetch_count, start, end);
+    }
+  }
+  return count;
+}
+
+void ThreadCache::DeallocateRange(void* start, void* end, int N, uint32 cl) {
+  FreeList* list = &list_[cl];
+  list->PushRange(N, start, end);
+  size_ += N * list->object_size();
+
+  if (PREDICT_FALSE(list->length() > list->max_length())) {
+    // Release whole batches to get back under max_length, and count
+    // this as one overflow of the list in adjusting max_length.
+    const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+    int excess = list->length() - list->max_length();
+    excess += batch_size - 1;
+    excess -= excess % batch_size;
+    ReleaseToCentralCache(list, cl, excess);
+    AdjustMaxLength(list, batch_size);
+  }
+  if (PREDICT_FALSE(size_ > max_size_)) {
+    Scavenge();
+  }
+}
+
 void ThreadCache::ListTooLong(FreeList* list, uint32 cl) {
   size_ += list->object_size();
 
   const int batch_size = Static::sizemap()->num_objects_to_move(cl);
   ReleaseToCentralCache(list, cl, batch_size);
+  AdjustMaxLength(list, batch_size);
 
+  if (PREDICT_FALSE(size_ > max_size_)) {
+    Scavenge();
+  }
+}
+
+void ThreadCache::AdjustMaxLength(FreeList* list, int batch_size) {
   // If the list is too long, we need to transfer some number of
   // objects to the central cache.  Ideally, we would transfer
   // num_objects_to_move, so the code below tries to make max_length
@@ -181,10 +244,6 @@ void ThreadCache::ListTooLong(FreeList* list, uint32 cl) {
       list->set_length_overages(0);
     }
   }
-
-  if (PREDICT_FALSE(size_ > max_size_)) {
-    Scavenge();
-  }
 }
 
 // Remove some objects of class "cl" from thread heap and add to central cache
@@ -196,15 +255,17 @@ void ThreadCache::ReleaseToCentralCache(FreeList* src, uint32 cl, int N) {
   // We return prepackaged chains of the correct size to the central cache.
   // TODO: Use the same format internally in the thread caches?
   int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  CentralFreeList* central = Static::central_freelist(
+      cl, central_shard_, Static::CurrentNumaNode());
   while (N > batch_size) {
     void *tail, *head;
     src->PopRange(batch_size, &head, &tail);
-    Static::central_cache()[cl].InsertRange(head, tail, batch_size);
+    central->InsertRange(head, tail, batch_size);
     N -= batch_size;
   }
   void *tail, *head;
   src->PopRange(N, &head, &tail);
-  Static::central_cache()[cl].InsertRange(head, tail, N);
+  central->InsertRange(head, tail, N);
   size_ -= delta_bytes;
 }
 
@@ -401,6 +462,7 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
 #ifdef HAVE_TLS
   current_heap_ptr = NULL;
 #endif
+  CpuCache::InitThread();
   return heap;
 }
 
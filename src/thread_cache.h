@@ -88,6 +88,14 @@ class ThreadCache {
   void* Allocate(size_t size, uint32 cl, void *(*oom_handler)(size_t size));
   void Deallocate(void* ptr, uint32 size_class);
 
+  // Allocates n objects of the given size and class into out[], from
+  // this cache first and then straight from the central cache.
+  // Returns the number of objects allocated, which is less than n only
+  // if memory ran out.
+  size_t AllocateBatch(size_t size, uint32 cl, size_t n, void** out);
+  // Frees the N objects of class cl linked from start to end.
+  void DeallocateRange(void* start, void* end, int N, uint32 cl);
+
   void Scavenge();
 
   int GetSamplePeriod();
@@ -253,6 +261,9 @@ class ThreadCache {
   // to eventually converge on num_objects_to_move(cl).
   void ListTooLong(FreeList* src, uint32 cl);
 
+  // The max_length adjustment of ListTooLong, for one overflow of src.
+  void AdjustMaxLength(FreeList* src, int batch_size);
+
   // Releases N items from this thread cache.
   void ReleaseToCentralCache(FreeList* src, uint32 cl, int N);
 
@@ -300,6 +311,9 @@ class ThreadCache {
   static ThreadCache* thread_heaps_;
   static int thread_heap_count_;
 
+  // Handed out round-robin to new heaps as their central_shard_.
+  static unsigned int next_central_shard_;
+
   // A pointer to one of the objects in thread_heaps_.  Represents
   // the next ThreadCache from which a thread over its max_size_ should
   // steal memory limit.  Round-robin through all of the objects in
@@ -332,6 +346,7 @@ class ThreadCache {
 
   pthread_t     tid_;                   // Which thread owns it
   bool          in_setspecific_;        // In call to pthread_setspecific?
+  unsigned int  central_shard_;         // Hint for Static::central_freelist()
 
   // Allocate a new heap. REQUIRES: Static::pageheap_lock is held.
   static ThreadCache* NewHeap(pthread_t tid);
@@ -109,11 +109,45 @@ extern "C" {
    */
   PERFTOOLS_DLL_DECL size_t tc_malloc_size(void* ptr) PERFTOOLS_NOTHROW;
 
+  /*
+   * Like tc_malloc(), and also stores the usable size of the block, as
+   * tc_malloc_size() would return it, in *actual_size.  That costs no
+   * second lookup.  The block may be freed with tc_free_sized() with
+   * either size.  *actual_size is left alone if allocation fails.
+   */
+  PERFTOOLS_DLL_DECL void* tc_malloc_size_returning(size_t size,
+                                                    size_t* actual_size) PERFTOOLS_NOTHROW;
+
+  /*
+   * Allocates n objects of the given size into out[0..n-1], and
+   * returns how many it allocated, which is less than n only when
+   * memory ran out; errno is then ENOMEM.  tc_free_batch() frees n
+   * objects, in any mix of sizes; objects of the same size are
+   * cheapest to free together.
+   * These amount to loops over tc_malloc() and tc_free(), but look up
+   * the size class and check for hooks once per batch.
+   */
+  PERFTOOLS_DLL_DECL size_t tc_malloc_batch(size_t size, size_t n,
+                                            void** out) PERFTOOLS_NOTHROW;
+  PERFTOOLS_DLL_DECL void tc_free_batch(void** ptrs, size_t n) PERFTOOLS_NOTHROW;
+
+  /*
+   * Resizes the block at ptr to hold new_size bytes without moving it,
+   * and returns 1, or returns 0 and leaves the block as it was.  Small
+   * blocks can be resized to any size of their size class; large
+   * blocks can grow into free pages that follow them, and shrinking
+   * gives their trailing pages back, down to the largest size class.
+   * The block may then be freed with new_size as its size.
+   */
+  PERFTOOLS_DLL_DECL int tc_try_expand(void* ptr, size_t new_size) PERFTOOLS_NOTHROW;
+
 #ifdef __cplusplus
   PERFTOOLS_DLL_DECL int tc_set_new_mode(int flag) PERFTOOLS_NOTHROW;
   PERFTOOLS_DLL_DECL void* tc_new(size_t size);
   PERFTOOLS_DLL_DECL void* tc_new_nothrow(size_t size,
                                           const std::nothrow_t&) PERFTOOLS_NOTHROW;
+  /* Like tc_new(), returning the usable size as tc_malloc_size_returning(). */
+  PERFTOOLS_DLL_DECL void* tc_new_size_returning(size_t size, size_t* actual_size);
   PERFTOOLS_DLL_DECL void tc_delete(void* p) PERFTOOLS_NOTHROW;
   PERFTOOLS_DLL_DECL void tc_delete_sized(void* p, size_t size) PERFTOOLS_NOTHROW;
   PERFTOOLS_DLL_DECL void tc_delete_nothrow(void* p,
@@ -145,6 +179,41 @@ extern "C" {
 }
 #endif
 
+#ifdef __cplusplus
+namespace tc {
+
+/*
+ * For objects whose size is known at compile time.  The size is
+ * handed to the sized deallocation functions, so that deallocate()
+ * finds the size class from it rather than from the object's address.
+ * allocate() returns NULL when out of memory, like tc_malloc().
+ */
+template <size_t N> inline void* allocate() PERFTOOLS_NOTHROW {
+  return tc_malloc(N);
+}
+
+template <size_t N> inline void deallocate(void* p) PERFTOOLS_NOTHROW {
+  tc_free_sized(p, N);
+}
+
+/*
+ * Classes derived from FixedSizeAllocated get an operator new and
+ * delete that do the same for every object of the class, through
+ * tc_new() and tc_delete_sized().  Objects must be deleted through a
+ * pointer to their own class, or one with a virtual destructor.
+ */
+struct FixedSizeAllocated {
+  static void* operator new(size_t size) {
+    return tc_new(size);
+  }
+  static void operator delete(void* p, size_t size) PERFTOOLS_NOTHROW {
+    tc_delete_sized(p, size);
+  }
+};
+
+}  /* namespace tc */
+#endif
+
 /* We're only un-defining for public */
 #if !defined(GPERFTOOLS_CONFIG_H_)
 
@@ -146,7 +146,9 @@ void* TCMalloc_SystemAlloc(size_t size, size_t *actual_size,
 }
 
 extern PERFTOOLS_DLL_DECL
-bool TCMalloc_SystemRelease(void* start, size_t length) {
+bool TCMalloc_SystemRelease(void* start, size_t length, bool* zeroed) {
+  // Decommitted pages are zero when committed again.
+  if (zeroed != NULL) *zeroed = TCMalloc_SystemAllocZeroes();
   if (VirtualFree(start, length, MEM_DECOMMIT))
     return true;
 
@@ -171,6 +173,14 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
 }
 
 extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemReleaseBatch(SystemReleaseRange* ranges, int n) {
+  for (int i = 0; i < n; i++) {
+    ranges[i].released = TCMalloc_SystemRelease(ranges[i].start,
+                                                 ranges[i].length,
+                                                 &ranges[i].zeroed);
+  }
+}
+
 void TCMalloc_SystemCommit(void* start, size_t length) {
   if (VirtualAlloc(start, length, MEM_COMMIT, PAGE_READWRITE) == start)
     return;
@@ -195,6 +205,50 @@ void TCMalloc_SystemCommit(void* start, size_t length) {
   }
 }
 
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemHugePageHint(void* start, size_t length) {
+  // Large pages on windows need to be requested up front; nothing to do.
+}
+
+bool TCMalloc_SystemAllocZeroes() {
+  return tcmalloc_sys_alloc == reinterpret_cast<SysAllocator*>(virtual_space);
+}
+
+bool TCMalloc_SystemSetReleaseMadvFree(bool madv_free) {
+  return false;
+}
+
+bool TCMalloc_SystemReleaseMadvFree() {
+  return false;
+}
+
+bool TCMalloc_SystemMove(void* from, void* to, size_t length) {
+  // There is no mremap() on windows.
+  return false;
+}
+
+void* TCMalloc_SystemReserve(size_t bytes) {
+  // Reserved but uncommitted memory cannot be read on windows.
+  return NULL;
+}
+
+bool TCMalloc_SystemCommitReserved(void* start, size_t length) {
+  return false;
+}
+
+bool TCMalloc_SystemBindToNode(void* start, size_t length, int node) {
+  // VirtualAllocExNuma would have to be used at reservation time.
+  return false;
+}
+
+void TCMalloc_SystemAllocLockAll() {
+  spinlock.Lock();
+}
+
+void TCMalloc_SystemAllocUnlockAll() {
+  spinlock.Unlock();
+}
+
 bool RegisterSystemAllocator(SysAllocator *allocator, int priority) {
   return false;   // we don't allow registration on windows, right now
 }